@@ -0,0 +1,387 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "analyze.h"
+#include "opcodes.h"
+#include "cfg.h"
+
+
+typedef struct{
+    assembler *ctx;
+    const chip8CostModel *model;
+    controlFlowGraph g;
+
+    long *blockCycles;          //-1 until worked out
+    long *subroutineCycles;     //-1 until worked out, -2 while it is being worked out
+
+    chip8Loop *loops;
+    size_t loopCount;
+    size_t loopCapacity;
+    bool failed;
+} loopAnalysis;
+
+//A search for the most expensive path from a block
+typedef struct{
+    loopAnalysis *a;
+    const bool *region;         //Blocks the path may go through, NULL for any
+    int header;                 //Block that ends the path when it is reached again, -1 for none
+    unsigned long *cycles;      //Cycles from each block to the end of the path
+    int *choice;                //Block after each block on the path, -1 at the end
+    unsigned char *state;       //0 not visited, 1 on the path being searched, 2 done
+} pathSearch;
+
+
+unsigned instructionCycles(const chip8CostModel *model, unsigned short opcode){
+    const opcodeEntry *form = decodeOpcode(opcode);
+    if(form != NULL){
+        for(size_t i = 0; i < model->costCount; i++){
+            if(strcmp(model->costs[i].mnemonic, form->mnemonic) == 0) return model->costs[i].cycles;
+        }
+    }
+    return model->defaultCycles;
+}
+
+
+//Helper function to get the blocks that can run after a block. A call's
+//subroutine is not one of them, its cost is part of the calling block.
+static int successors(const basicBlock *bb, int *out){
+    int count = 0;
+    switch(bb->exit){
+        case BLOCK_FALLS:
+        case BLOCK_CALLS:
+            out[count++] = bb->next;
+            break;
+        case BLOCK_JUMPS:
+            out[count++] = bb->branch;
+            break;
+        case BLOCK_SKIPS:
+            out[count++] = bb->next;
+            out[count++] = bb->branch;
+            break;
+    }
+
+    int kept = 0;
+    for(int i = 0; i < count; i++){
+        if(out[i] >= 0) out[kept++] = out[i];
+    }
+    return kept;
+}
+
+
+static unsigned long subroutineCycles(loopAnalysis *a, int entry);
+
+//Helper function to get the cycles of a block, with the subroutine it calls
+static unsigned long blockCycles(loopAnalysis *a, int b){
+    if(a->blockCycles[b] >= 0) return a->blockCycles[b];
+
+    const basicBlock *bb = &a->g.blocks[b];
+    unsigned long cycles = 0;
+    for(int i = bb->first; i < bb->end; i++){
+        const instruction *ins = &a->ctx->code[i];
+        if(ins->data == NULL) cycles += instructionCycles(a->model, ins->opcode);
+    }
+    if(bb->exit == BLOCK_CALLS && bb->branch >= 0) cycles += subroutineCycles(a, bb->branch);
+
+    a->blockCycles[b] = cycles;
+    return cycles;
+}
+
+
+//Helper function to find the most expensive path from block b. Edges back to a
+//block on the path being searched are not followed, so loops count once.
+static unsigned long longestPath(pathSearch *s, int b){
+    s->state[b] = 1;
+
+    int next[2];
+    int count = successors(&s->a->g.blocks[b], next);
+
+    unsigned long best = 0;
+    s->choice[b] = -1;
+    for(int i = 0; i < count; i++){
+        int t = next[i];
+        if(s->region != NULL && !s->region[t]) continue;
+
+        unsigned long cycles;
+        if(t == s->header) cycles = 0;
+        else if(s->state[t] == 1) continue;
+        else if(s->state[t] == 2) cycles = s->cycles[t];
+        else cycles = longestPath(s, t);
+
+        if(s->choice[b] == -1 || cycles > best){
+            best = cycles;
+            s->choice[b] = t;
+        }
+    }
+
+    s->cycles[b] = blockCycles(s->a, b) + best;
+    s->state[b] = 2;
+    return s->cycles[b];
+}
+
+
+//Helper function to set up a path search. Returns false if out of memory.
+static bool startSearch(loopAnalysis *a, pathSearch *s, const bool *region, int header){
+    size_t n = a->g.count;
+    s->a = a;
+    s->region = region;
+    s->header = header;
+    s->cycles = malloc(n * sizeof(s->cycles[0]));
+    s->choice = malloc(n * sizeof(s->choice[0]));
+    s->state = calloc(n, sizeof(s->state[0]));
+    if(s->cycles == NULL || s->choice == NULL || s->state == NULL){
+        a->failed = true;
+        return false;
+    }
+    return true;
+}
+
+
+static void endSearch(pathSearch *s){
+    free(s->cycles);
+    free(s->choice);
+    free(s->state);
+}
+
+
+//Helper function to get the cycles of the most expensive way through a
+//subroutine. A subroutine that calls itself counts its own cost once.
+static unsigned long subroutineCycles(loopAnalysis *a, int entry){
+    if(a->subroutineCycles[entry] >= 0) return a->subroutineCycles[entry];
+    if(a->subroutineCycles[entry] == -2) return 0;
+    a->subroutineCycles[entry] = -2;
+
+    pathSearch s;
+    unsigned long cycles = 0;
+    if(startSearch(a, &s, NULL, -1)) cycles = longestPath(&s, entry);
+    endSearch(&s);
+
+    a->subroutineCycles[entry] = cycles;
+    return cycles;
+}
+
+
+//Helper function to record a loop made of the blocks in members and find the
+//loops nested in it
+static void findLoops(loopAnalysis *a, const bool *region, int depth);
+
+static void addLoop(loopAnalysis *a, bool *members, int depth){
+    const controlFlowGraph *g = &a->g;
+    int n = g->count;
+
+    //The loop starts at the first block entered from outside it
+    int header = -1;
+    for(int b = 0; b < n; b++){
+        if(members[b]) continue;
+
+        int next[3];
+        int count = successors(&g->blocks[b], next);
+        if(g->blocks[b].exit == BLOCK_CALLS && g->blocks[b].branch >= 0) next[count++] = g->blocks[b].branch;
+        for(int i = 0; i < count; i++){
+            if(members[next[i]] && (header == -1 || next[i] < header)) header = next[i];
+        }
+    }
+    if(header == -1){
+        for(header = 0; !members[header]; header++);
+    }
+
+    if(a->loopCount == a->loopCapacity){
+        size_t newCapacity = a->loopCapacity ? a->loopCapacity * 2 : 16;
+        chip8Loop *temp = realloc(a->loops, newCapacity * sizeof(a->loops[0]));
+        if(temp == NULL){
+            a->failed = true;
+            return;
+        }
+        a->loops = temp;
+        a->loopCapacity = newCapacity;
+    }
+
+    pathSearch s;
+    if(!startSearch(a, &s, members, header)){
+        endSearch(&s);
+        return;
+    }
+
+    chip8Loop *loop = &a->loops[a->loopCount];
+    memset(loop, 0, sizeof(*loop));
+    loop->line = a->ctx->code[g->blocks[header].first].line;
+    loop->depth = depth;
+    loop->cycles = longestPath(&s, header);
+    loop->path = malloc(n * sizeof(loop->path[0]));
+    if(loop->path == NULL){
+        a->failed = true;
+        endSearch(&s);
+        return;
+    }
+    a->loopCount++;
+
+    //Walk the worst path once round
+    for(int b = header; b >= 0 && loop->pathLength < (size_t)n; b = s.choice[b]){
+        loop->path[loop->pathLength++] = a->ctx->code[g->blocks[b].first].line;
+        loop->instructions += g->blocks[b].end - g->blocks[b].first;
+        if(s.choice[b] == header) break;
+    }
+    endSearch(&s);
+
+    //Loops inside this one show up once its header is taken out
+    members[header] = false;
+    findLoops(a, members, depth + 1);
+}
+
+
+//State of Tarjan's strongly connected components search over a region
+typedef struct{
+    loopAnalysis *a;
+    const bool *region;
+    int depth;
+    int *index;
+    int *lowlink;
+    bool *onStack;
+    int *stack;
+    int stackSize;
+    int counter;
+} componentSearch;
+
+
+static void strongConnect(componentSearch *c, int b){
+    c->index[b] = c->lowlink[b] = c->counter++;
+    c->stack[c->stackSize++] = b;
+    c->onStack[b] = true;
+
+    int next[2];
+    int count = successors(&c->a->g.blocks[b], next);
+    bool selfLoop = false;
+    for(int i = 0; i < count; i++){
+        int t = next[i];
+        if(!c->region[t]) continue;
+        if(t == b) selfLoop = true;
+
+        if(c->index[t] == -1){
+            strongConnect(c, t);
+            if(c->lowlink[t] < c->lowlink[b]) c->lowlink[b] = c->lowlink[t];
+        }
+        else if(c->onStack[t] && c->index[t] < c->lowlink[b]) c->lowlink[b] = c->index[t];
+    }
+    if(c->lowlink[b] != c->index[b] || c->a->failed) return;
+
+    //b is the root of a component, which is a loop if it has an edge round
+    bool *members = calloc(c->a->g.count, sizeof(bool));
+    if(members == NULL){
+        c->a->failed = true;
+        return;
+    }
+
+    int size = 0;
+    int member;
+    do{
+        member = c->stack[--c->stackSize];
+        c->onStack[member] = false;
+        members[member] = true;
+        size++;
+    } while(member != b);
+
+    if(size > 1 || selfLoop) addLoop(c->a, members, c->depth);
+    free(members);
+}
+
+
+static void findLoops(loopAnalysis *a, const bool *region, int depth){
+    size_t n = a->g.count;
+    componentSearch c = {a, region, depth, NULL, NULL, NULL, NULL, 0, 0};
+    c.index = malloc(n * sizeof(int));
+    c.lowlink = malloc(n * sizeof(int));
+    c.onStack = calloc(n, sizeof(bool));
+    c.stack = malloc(n * sizeof(int));
+
+    if(c.index == NULL || c.lowlink == NULL || c.onStack == NULL || c.stack == NULL) a->failed = true;
+    else{
+        for(size_t b = 0; b < n; b++) c.index[b] = -1;
+        for(size_t b = 0; b < n && !a->failed; b++){
+            if(region[b] && c.index[b] == -1) strongConnect(&c, b);
+        }
+    }
+
+    free(c.index);
+    free(c.lowlink);
+    free(c.onStack);
+    free(c.stack);
+}
+
+
+//Most expensive loops first, then in program order
+static int compareLoops(const void *x, const void *y){
+    const chip8Loop *a = x, *b = y;
+    if(a->cycles != b->cycles) return a->cycles < b->cycles ? 1 : -1;
+    return a->line - b->line;
+}
+
+
+void analyzeLoops(assembler *ctx){
+    chip8LoopReport *report = ctx->options->loops;
+    report->loops = NULL;
+    report->count = 0;
+
+    chip8CostModel defaults;
+    const chip8CostModel *model = ctx->options->costModel;
+    if(model == NULL){
+        chip8_default_cost_model(&defaults);
+        model = &defaults;
+    }
+
+    loopAnalysis a = {.ctx = ctx, .model = model};
+    if(buildControlFlowGraph(ctx->code, ctx->codeSize, &a.g) != 0){
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    size_t n = a.g.count;
+    a.blockCycles = malloc((n + 1) * sizeof(long));
+    a.subroutineCycles = malloc((n + 1) * sizeof(long));
+    bool *everything = malloc((n + 1) * sizeof(bool));
+    if(a.blockCycles == NULL || a.subroutineCycles == NULL || everything == NULL) a.failed = true;
+    else{
+        for(size_t b = 0; b < n; b++){
+            a.blockCycles[b] = -1;
+            a.subroutineCycles[b] = -1;
+            everything[b] = true;
+        }
+        findLoops(&a, everything, 1);
+    }
+
+    free(a.blockCycles);
+    free(a.subroutineCycles);
+    free(everything);
+    freeControlFlowGraph(&a.g);
+
+    qsort(a.loops, a.loopCount, sizeof(a.loops[0]), compareLoops);
+    report->loops = a.loops;
+    report->count = a.loopCount;
+    if(a.failed){
+        chip8_free_loop_report(report);
+        ctx->outOfMemory = true;
+    }
+}
@@ -24,624 +24,671 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdbool.h>
+#include <time.h>
 
-//Keep track of program line count
-int linecount = 1;
-int PC = 0;
-char* programName;
+#include "chip8asm.h"
+#include "lexer.h"
+#include "batch.h"
 
-//Variable sized array to keep track of anchorpoints in the assembly
-typedef struct{
-    char name[32];
-    int place;
-} anchorPoint;
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
 
-typedef struct{
-    size_t size;
-    anchorPoint values[];
-} anchorPointList;
 
+//Helper function to print every diagnostic from a run
+void printDiagnostics(const char *programName, const chip8Diagnostics *diagnostics){
+    for(size_t i = 0; i < diagnostics->count; i++){
+        const chip8Diagnostic *d = &diagnostics->items[i];
+        const char *severity = d->severity == CHIP8_ERROR ? "error" : d->severity == CHIP8_WARNING ? "warning" : "note";
 
-//Helper function to add an item to the back of the anchorpoint list
-int push_back(anchorPointList **arr, anchorPoint val){
-    size_t x = *arr ? arr[0]->size : 0, y = x + 1;
+        if(d->line > 0) fprintf(stderr, "%s:%i: %s: %s\n", programName, d->line, severity, d->message);
+        else fprintf(stderr, "%s: %s: %s\n", programName, severity, d->message);
+    }
+}
 
-    if((x & y) == 0){
-        void *temp = realloc(*arr, sizeof **arr + (x + y) * sizeof(arr[0] -> values[0]));
 
-        if(!temp) return 1;
-        *arr = temp;
+//Helper function to get the time in seconds for the stats
+double now(void){
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+//Helper function to print the stats of a run as a table or as JSON.
+//files is the number of programs the stats add up, each of which has its own memory.
+void printStats(FILE *out, const chip8Stats *s, double readTime, double writeTime, size_t files, bool json){
+    const char *phases[] = {"read", "tokenize", "encode", "resolve", "optimize", "output", "write"};
+    double times[] = {readTime, s->tokenizeTime, s->encodeTime, s->resolveTime, s->optimizeTime, s->outputTime, writeTime};
+    const int phaseCount = 7;
+
+    double total = 0;
+    for(int i = 0; i < phaseCount; i++) total += times[i];
+    double linesPerSecond = total > 0 ? s->lines / total : 0;
+    size_t romLimit = files * CHIP8_PROGRAM_SPACE;
+
+    if(json){
+        fprintf(out, "{\"phases\": {");
+        for(int i = 0; i < phaseCount; i++) fprintf(out, "\"%s\": %.9f, ", phases[i], times[i]);
+        fprintf(out, "\"total\": %.9f}, ", total);
+        fprintf(out, "\"files\": %zu, \"lines\": %zu, \"linesPerSecond\": %.0f, \"cachedLines\": %zu, ", files, s->lines, linesPerSecond, s->cachedLines);
+        fprintf(out, "\"instructions\": %zu, \"labels\": %zu, \"symbolLookups\": %zu, \"forwardReferences\": %zu, \"removedInstructions\": %zu, \"threadedJumps\": %zu, ", s->instructions, s->labels, s->symbolLookups, s->forwardReferences, s->removedInstructions, s->threadedJumps);
+        fprintf(out, "\"romBytes\": %zu, \"romLimit\": %zu, \"sections\": %zu, \"gapBytes\": %zu, \"largestFree\": %zu, ", s->bytesUsed, romLimit, s->sections, s->gapBytes, s->largestFree);
+        fprintf(out, "\"virtualRegisters\": %zu, \"spilledRegisters\": %zu, \"spillInstructions\": %zu, ", s->virtualRegisters, s->spilledRegisters, s->spillInstructions);
+        fprintf(out, "\"profiledJumps\": %zu, \"profileJumpsRemoved\": %zu, \"flippedSkips\": %zu, ", s->profiledJumps, s->profileJumpsRemoved, s->flippedSkips);
+        fprintf(out, "\"outlinedSequences\": %zu, \"mergedTails\": %zu, \"outlineSaved\": %zu, ", s->outlinedSequences, s->mergedTails, s->outlineSaved);
+        fprintf(out, "\"collapsedBranches\": %zu, \"packedBytes\": %zu, \"packedSize\": %zu, \"unpackerSize\": %zu, \"mnemonics\": {", s->collapsedBranches, s->packedBytes, s->packedSize, s->unpackerSize);
+        for(size_t i = 0; i < s->mnemonicCount; i++){
+            fprintf(out, "%s\"%s\": %zu", i ? ", " : "", s->mnemonics[i].mnemonic, s->mnemonics[i].count);
+        }
+        fprintf(out, "}}\n");
+        return;
     }
 
-    arr[0]->values[x] = val;
-    arr[0]->size = y;
-    return 0;
+    fprintf(out, "%-20s %12s\n", "Phase", "Time (ms)");
+    for(int i = 0; i < phaseCount; i++) fprintf(out, "%-20s %12.3f\n", phases[i], times[i] * 1000);
+    fprintf(out, "%-20s %12.3f\n\n", "total", total * 1000);
+
+    fprintf(out, "%-20s %12zu\n", "Files", files);
+    fprintf(out, "%-20s %12zu\n", "Lines", s->lines);
+    fprintf(out, "%-20s %12.0f\n", "Lines per second", linesPerSecond);
+    fprintf(out, "%-20s %12zu\n", "Cached lines", s->cachedLines);
+    fprintf(out, "%-20s %12zu\n", "Instructions", s->instructions);
+    fprintf(out, "%-20s %12zu\n", "Labels", s->labels);
+    fprintf(out, "%-20s %12zu\n", "Symbol lookups", s->symbolLookups);
+    fprintf(out, "%-20s %12zu\n", "Forward references", s->forwardReferences);
+    fprintf(out, "%-20s %12zu\n", "Removed instructions", s->removedInstructions);
+    fprintf(out, "%-20s %12zu\n", "Threaded jumps", s->threadedJumps);
+    fprintf(out, "%-20s %12zu of %zu (%.1f%%)\n", "ROM bytes", s->bytesUsed, romLimit, romLimit ? 100.0 * s->bytesUsed / romLimit : 0);
+    fprintf(out, "%-20s %12zu\n", "Sections", s->sections);
+    fprintf(out, "%-20s %12zu\n", "Gap bytes", s->gapBytes);
+    fprintf(out, "%-20s %12zu\n", "Largest free", s->largestFree);
+    fprintf(out, "%-20s %12zu\n", "Virtual registers", s->virtualRegisters);
+    fprintf(out, "%-20s %12zu\n", "Spilled registers", s->spilledRegisters);
+    fprintf(out, "%-20s %12zu\n", "Spill instructions", s->spillInstructions);
+    fprintf(out, "%-20s %12zu\n", "Profiled jumps", s->profiledJumps);
+    fprintf(out, "%-20s %12zu\n", "Jumps removed", s->profileJumpsRemoved);
+    fprintf(out, "%-20s %12zu\n", "Flipped skips", s->flippedSkips);
+    fprintf(out, "%-20s %12zu\n", "Outlined sequences", s->outlinedSequences);
+    fprintf(out, "%-20s %12zu\n", "Merged tails", s->mergedTails);
+    fprintf(out, "%-20s %12zu\n", "Outlining saved", s->outlineSaved);
+    fprintf(out, "%-20s %12zu\n", "Collapsed branches", s->collapsedBranches);
+    fprintf(out, "%-20s %12zu\n", "Packed bytes", s->packedBytes);
+    fprintf(out, "%-20s %12zu\n", "Packed size", s->packedSize);
+    fprintf(out, "%-20s %12zu\n\n", "Unpacker size", s->unpackerSize);
+
+    fprintf(out, "%-20s %12s\n", "Mnemonic", "Count");
+    for(size_t i = 0; i < s->mnemonicCount; i++){
+        fprintf(out, "%-20s %12zu\n", s->mnemonics[i].mnemonic, s->mnemonics[i].count);
+    }
 }
 
-//Helper function to get the numerical value of an anchorpoint
-int getPCFromAnchorpoint(char ac[32], anchorPointList *a){
-    for(int i = 0; i < a->size; i++){
-        if(strcmp(ac, a->values[i].name) == 0){
-            return a->values[i].place;
+
+//Helper function to read a cost model file into model. Each line has a
+//mnemonic, or "default" for every other instruction, and its cost in cycles.
+//Returns 0 on success.
+int readCostModel(const char *path, chip8CostModel *model){
+    FILE *file = fopen(path, "r");
+    if(file == NULL){fprintf(stderr, "Error: Could not read cost model %s. \n", path); return 1;}
+
+    char line[256];
+    int lineNumber = 0;
+    int result = 0;
+    while(fgets(line, sizeof(line), file) != NULL){
+        lineNumber++;
+
+        char mnemonic[16];
+        unsigned cycles;
+        char *comment = strchr(line, ';');
+        if(comment != NULL) *comment = '\0';
+
+        int fields = sscanf(line, "%15s %u", mnemonic, &cycles);
+        if(fields == EOF || fields == -1) continue;
+        if(fields != 2){
+            fprintf(stderr, "%s:%i: error: Expected a mnemonic and a number of cycles\n", path, lineNumber);
+            result = 1;
+        }
+        else if(strcmp(mnemonic, "default") == 0) model->defaultCycles = cycles;
+        else if(chip8_set_cost(model, mnemonic, cycles) != 0){
+            fprintf(stderr, "%s:%i: error: Unknown instruction %s\n", path, lineNumber, mnemonic);
+            result = 1;
         }
     }
 
-    return -1;
+    fclose(file);
+    return result;
 }
 
 
-//Helper function to get a word from the line buffer
-void getword(unsigned char word[32], unsigned char string[32], int wordcount){
-    int wc = 0;
-    int i = 0;
-    int wspot = 0;
-
-    //Remove spaces
-    while(i < 32 && string[i] == ' '){i++;}
-    int reset = 0;
-    //Reset every character in the current word array
-    while(reset < 32){
-        word[reset] = '\0';
-        reset++;
+//Helper function to print the loops of the program, most expensive first.
+//A frame is a 60th of a second at clock cycles per second.
+void printLoops(FILE *out, const chip8LoopReport *report, int clock){
+    double frame = clock / 60.0;
+    if(report->count == 0){
+        fprintf(out, "No loops found.\n");
+        return;
     }
 
-    //Loop though buffer, separating words at spaces or commas
-    while(i < 32){
-        if(string[i] == '\0') return;
-        else if(string[i] == '\n'){i++; continue;}
-        else if(string[i] == ' ' || string[i] == ','){
-            if(wordcount == wc){return;}
-            while(i < 32 && (string[i] == ' ' || string[i] == ',')){i++;}
-            wc++;
-            continue;
-        }
-        else if(wordcount == wc){
-            word[wspot] = tolower(string[i]);
-            wspot++;
-        }
-
-        i++;
+    fprintf(out, "Loops, most expensive first, with %.0f cycles per frame at %i Hz:\n", frame, clock);
+    fprintf(out, "%6s %6s %8s %13s %8s  %s\n", "Line", "Depth", "Cycles", "Instructions", "Frame", "Worst path");
+    for(size_t i = 0; i < report->count; i++){
+        const chip8Loop *loop = &report->loops[i];
+        fprintf(out, "%6i %6i %8lu %13zu %7.1f%%  ", loop->line, loop->depth, loop->cycles, loop->instructions, frame > 0 ? 100.0 * loop->cycles / frame : 0);
+        for(size_t j = 0; j < loop->pathLength; j++) fprintf(out, "%s%i", j ? " -> " : "", loop->path[j]);
+        fprintf(out, "\n");
     }
-    return;
 }
 
-//Helper function to see if a word is a number
-bool isnumber(unsigned char word[32]){
-    for(int i = 0; i < strlen(word); i++){
-        if(word[i] == '\n') break;
-        if(!isdigit(word[i])) return false;
+
+//Helper function to find the line entry that covers a byte address, or NULL
+const chip8LineEntry *findLineEntry(const chip8DebugInfo *debug, unsigned address){
+    size_t low = 0, high = debug->lineCount;
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+        if(debug->lines[middle].address <= address) low = middle + 1;
+        else high = middle;
     }
-    return true;
+    if(low == 0) return NULL;
+
+    const chip8LineEntry *entry = &debug->lines[low - 1];
+    return address < (unsigned)entry->address + entry->size ? entry : NULL;
 }
 
 
-//Helper function to throw an error with a message and line count
-void error(char message[256]){
-    printf(message, programName, linecount);
-    exit(1);
+//Helper function to find the last symbol at or before a byte address, or NULL
+const chip8Symbol *findSymbol(const chip8DebugInfo *debug, unsigned address){
+    size_t low = 0, high = debug->symbolCount;
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+        if(debug->symbols[middle].address <= address) low = middle + 1;
+        else high = middle;
+    }
+    return low == 0 ? NULL : &debug->symbols[low - 1];
 }
 
 
-//Helper function to convert a string to an integer
-int stringToNum(unsigned char c[32], anchorPointList *a){
-    if(isnumber(c)){
-        return atoi(c);
+//Helper function to write a listing: the address and bytes of everything in
+//the image next to the line it came from. Lines without code, such as anchor
+//points and comments, are listed between them. Returns 0 on success.
+int writeListing(const char *path, const char *source, size_t sourceSize, const chip8DebugInfo *debug, const unsigned char *image){
+    //Where every line starts, and one past the end as if the last line had a newline
+    size_t lineCount = sourceSize > 0 && source[sourceSize - 1] != '\n';
+    for(size_t i = 0; i < sourceSize; i++) lineCount += source[i] == '\n';
+    size_t *starts = malloc((lineCount + 1) * sizeof(size_t));
+    if(starts == NULL) return 1;
+    starts[0] = 0;
+    for(size_t i = 0, n = 1; i < sourceSize && n <= lineCount; i++){
+        if(source[i] == '\n') starts[n++] = i + 1;
     }
-    else{
-        int num = getPCFromAnchorpoint(c, a);
-        if(num == -1) error("Expected address number in %s at line %i\n");
-        return num;
+    starts[lineCount] = sourceSize + (sourceSize > 0 && source[sourceSize - 1] != '\n');
+
+    FILE *f = fopen(path, "w");
+    if(f == NULL){
+        free(starts);
+        return 1;
     }
-}
 
+    size_t listed = 0;
+    for(size_t i = 0; i <= debug->lineCount; i++){
+        const chip8LineEntry *entry = i < debug->lineCount ? &debug->lines[i] : NULL;
+        size_t upTo = entry ? (size_t)entry->line - 1 : lineCount;
 
-//Helper function to get the register number from a word in the format 'vx'
-unsigned char getRegisterNumber(char str[16]){
-    if(str[0] != 'v'){error("Expected address (vx) in %s at line %i\n");}
-    
-    //If the number is only 1 digit long, str[2] will just be \0
-    char digits[3] = {str[1], str[2], '\0'};
+        for(size_t line = listed + 1; line <= upTo && line <= lineCount; line++){
+            int length = (int)(starts[line] - starts[line - 1]) - 1;
+            if(length > 0 && source[starts[line - 1] + length - 1] == '\r') length--;
+            fprintf(f, "%-4s  %-12s%6zu  %.*s\n", "", "", line, length, source + starts[line - 1]);
+        }
+        if(upTo > listed) listed = upTo;
+        if(entry == NULL) break;
+
+        //An entry from a macro lists the line that used the macro, which may come up again
+        size_t line = entry->line;
+        int length = 0;
+        if(line >= 1 && line <= lineCount){
+            length = (int)(starts[line] - starts[line - 1]) - 1;
+            if(length > 0 && source[starts[line - 1] + length - 1] == '\r') length--;
+        }
 
-    if(!isnumber(digits)){error("Expected address number in %s at line %i\n");}
+        //Four bytes to a row, so data longer than that continues on rows of its own
+        for(unsigned offset = 0; offset < entry->size; offset += 4){
+            char bytes[16] = "";
+            for(unsigned b = offset; b < entry->size && b < offset + 4; b++){
+                sprintf(bytes + strlen(bytes), b > offset ? " %02X" : "%02X", image[entry->address - CHIP8_PROGRAM_START + b]);
+            }
+            if(offset == 0) fprintf(f, "%04X  %-12s%6zu  %.*s\n", entry->address, bytes, line, length, length ? source + starts[line - 1] : "");
+            else fprintf(f, "%04X  %s\n", entry->address + offset, bytes);
+        }
+        if(line > listed) listed = line;
+    }
+
+    free(starts);
+    return fclose(f) != 0;
+}
 
-    unsigned char addr = atoi(digits);
 
-    if(addr < 0 || addr > 15){error("Address number in %s at line %i must be between 0 and 15.\n");}
+//Helper function to write every anchor point and its address, in address
+//order. Returns 0 on success.
+int writeSymbols(const char *path, const chip8DebugInfo *debug){
+    FILE *f = fopen(path, "w");
+    if(f == NULL) return 1;
 
-    return addr;
+    for(size_t i = 0; i < debug->symbolCount; i++){
+        fprintf(f, "%04X %s\n", debug->symbols[i].address, debug->symbols[i].name);
+    }
+    return fclose(f) != 0;
 }
 
-int main(int argc, char *argv[]){
-    if(argc < 2){printf("Error: Too few arguments. \n"); return 1;}
-    programName = argv[1];
-
-    //Open the file
-    FILE *infile = fopen(programName, "r");
-    //Output file is program.hex
-    FILE *outfile = fopen("program.hex", "wb");
-    if(infile == NULL){printf("Error: Could not find input file. \n"); return 1;}
-
-    anchorPointList *AnchorList = NULL;
-
-    unsigned char buffer[128];
-
-    //Get a line from the input file
-    while(fgets(buffer, 128, infile)){
-        unsigned char word[32];
-        //If the line is blank, just continue
-        if(strlen(buffer) <= 1){
-            linecount++;
-            continue;
-        }
-        //If the line is a comment, continue
-        else if(buffer[0] == ';'){
-            linecount++;
-            continue;
-        }
-        //If the line starts with ',', the word is defining an anchor point
-        else if(buffer[0] == '.'){
-            unsigned char* tempbuf = buffer + 1;
-
-            getword(word, tempbuf, 0);
-
-            anchorPoint a;
-            strcpy(a.name, word);
-            a.place = PC;
-            if(push_back(&AnchorList, a) == -1) error("Could not parse Anchor Point in %s at line %i.\n");
-            
-            linecount++;
-            continue;
-        }
-        
-        getword(word, buffer, 0);
 
-        //SYS is in the instruction set, but the does not need an implementation 
-        if(strcmp("sys", word) == 0){printf("System call. Skipping.\n");}
+//Helper function to run an image in the emulator and print what it did.
+//With debug info, the addresses that ran the most show their line and anchor point.
+//The counts are saved to profileName as a profile, unless it is NULL.
+//Returns the exit code for main.
+int runImage(const unsigned char *image, size_t size, const chip8RunOptions *runOptions, const chip8DebugInfo *debug, const char *profileName, FILE *out){
+    const char *reasons[] = {
+        "Ran to the limit",
+        "Reached the end of the program",
+        "Halted on a jump to itself",
+        "Waiting for a key",
+        "Stack overflow or underflow",
+        "Went outside of memory",
+    };
+
+    chip8RunResult *result = malloc(sizeof(chip8RunResult));
+    if(result == NULL){fprintf(stderr, "Error: Out of memory. \n"); return 1;}
+
+    double start = now();
+    if(chip8_run(image, size, runOptions, result) != CHIP8_OK){
+        free(result);
+        fprintf(stderr, "Error: Out of memory. \n");
+        return 1;
+    }
+    double seconds = now() - start;
+
+    fprintf(out, "%s at 0x%03X.\n", reasons[result->stopReason], result->pc);
+    for(int r = 0; r < 16; r++) fprintf(out, "v%X=%02X ", r, result->v[r]);
+    fprintf(out, "I=%03X\n\n", result->i);
+    fprintf(out, "%-24s %14llu\n", "Instructions", result->instructions);
+    fprintf(out, "%-24s %14llu\n", "Cycles", result->cycles);
+    fprintf(out, "%-24s %14llu\n", "Frames", result->frames);
+    fprintf(out, "%-24s %14.3f\n", "Host time (ms)", seconds * 1000);
+    fprintf(out, "%-24s %14.0f\n\n", "Instructions per second", seconds > 0 ? result->instructions / seconds : 0);
+
+    fprintf(out, "%-24s %14s\n", "Mnemonic", "Count");
+    for(size_t i = 0; i < result->mnemonicCount; i++){
+        fprintf(out, "%-24s %14llu\n", result->mnemonics[i].mnemonic, result->mnemonics[i].count);
+    }
 
-        //Clear screen
-        else if(strcmp("cls", word) == 0){
-            unsigned short opcode = (0 << 12) | 0x00E0;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+    //The ten instructions that ran the most
+    fprintf(out, "\n%-8s %-8s %14s %8s", "Address", "Opcode", "Count", "Share");
+    if(debug) fprintf(out, "  %6s  %s", "Line", "Anchor point");
+    fprintf(out, "\n");
+    bool shown[CHIP8_MEMORY_SIZE] = {false};
+    for(int n = 0; n < 10; n++){
+        int best = -1;
+        for(int a = 0; a < CHIP8_MEMORY_SIZE; a++){
+            if(!shown[a] && result->counts[a] > 0 && (best == -1 || result->counts[a] > result->counts[best])) best = a;
         }
-        //Return from subroutine
-        else if(strcmp("ret", word) == 0){
-            unsigned short opcode = (0 << 12) | 0x00EE;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
-        }
-        //Jump to address
-        else if(strcmp("jp", word) == 0){
-            getword(word, buffer, 1);
-
-            if(word[0] == 'v'){
-                getword(word, buffer, 2);
-                unsigned short addr = stringToNum(word, AnchorList);
-                if(addr < 0 || addr > 4095) error("Address in %s at line %i must be between 0 and 4095\n");
-
-                unsigned short opcode = 0xB << 12;
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
-
-            else{
-                unsigned short opcode = 0x1 << 12;
-                unsigned short addr = stringToNum(word, AnchorList);
-                if(addr < 0 || addr > 4095) error("Address in %s at line %i must be between 0 and 4095.\n");
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
-
+        if(best == -1) break;
+
+        shown[best] = true;
+        fprintf(out, "0x%03X    ", best);
+        size_t offset = best - CHIP8_PROGRAM_START;
+        if(best >= CHIP8_PROGRAM_START && offset + 1 < size){
+            unsigned opcode = image[offset] << 8 | image[offset + 1];
+            if(runOptions->littleEndian) opcode = image[offset + 1] << 8 | image[offset];
+            fprintf(out, "%04X     ", opcode);
         }
-        //Call subroutine
-        else if(strcmp("call", word) == 0){
-            getword(word, buffer, 1);
-
-            unsigned short opcode = 0x2 << 12;
-            unsigned short addr = stringToNum(word, AnchorList);
-            if(addr < 0 || addr > 4095) error("Address in %s at line %i must be between 0 and 4095");
-            opcode = opcode | addr;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+        else fprintf(out, "%-8s ", "-");
+        fprintf(out, "%14llu %7.1f%%", result->counts[best], 100.0 * result->counts[best] / result->instructions);
+
+        if(debug){
+            const chip8LineEntry *entry = findLineEntry(debug, best);
+            const chip8Symbol *symbol = findSymbol(debug, best);
+            if(entry) fprintf(out, "  %6i", entry->line);
+            else fprintf(out, "  %6s", "-");
+            if(symbol && symbol->address == best) fprintf(out, "  %s", symbol->name);
+            else if(symbol) fprintf(out, "  %s+%u", symbol->name, best - symbol->address);
         }
+        fprintf(out, "\n");
+    }
 
-        //Skip instruction if equal
-        else if(strcmp("se", word) == 0){
-            getword(word, buffer, 1);
+    if(profileName && chip8_save_profile(profileName, result->counts) != 0) fprintf(stderr, "Warning: Could not write profile %s. \n", profileName);
 
-            unsigned short addr1 = getRegisterNumber(word);
-            unsigned short addr2;
-            getword(word, buffer, 2);
+    //A program that crashed fails, one that stopped on its own is fine
+    int failed = result->stopReason == CHIP8_STOP_STACK || result->stopReason == CHIP8_STOP_ADDRESS;
+    free(result);
+    return failed;
+}
 
-            if(word[0] == 'v'){
-                addr2 = getRegisterNumber(word);
-                unsigned short opcode = 0x5 << 12;
-                addr1 = addr1 << 4;
-                addr1 = addr1 | addr2;
-                addr1 = addr1 << 4;
-                opcode = opcode | addr1;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
 
-            }
-            else{
-                addr2 = stringToNum(word, AnchorList);
-                if(addr2 < 0 || addr2 > 255){error("Address in %s at line %i must be between 0 and 255.\n");}
-                unsigned short opcode = 0x3 << 12;
-                addr1 = addr1 << 8;
-                addr1 = addr1 | addr2;
-                opcode = addr1 | opcode;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
+//Helper function to print a one line description of an image that did not
+//survive a round trip through the disassembler
+void printVerifyFailure(const batchJob *job){
+    if(job->result == BATCH_ERROR_INPUT) fprintf(stderr, "Error: Could not find input file %s. \n", job->input);
+    else if(job->result == CHIP8_ERROR_MISMATCH) fprintf(stderr, "%s: error: Reassembled image differs at byte %zu\n", job->input, job->mismatch);
+    else if(job->result == CHIP8_ERROR_MEMORY) fprintf(stderr, "Error: Out of memory while verifying %s. \n", job->input);
+    else if(job->imageSize > CHIP8_PROGRAM_SPACE) fprintf(stderr, "%s: error: Image is larger than %i bytes\n", job->input, CHIP8_PROGRAM_SPACE);
+    else if(job->imageSize & 1) fprintf(stderr, "%s: error: Image has an odd number of bytes\n", job->input);
+    else if(job->result != CHIP8_OK) fprintf(stderr, "%s: error: Disassembly does not assemble\n", job->input);
+}
 
 
+//Helper function to get the optimization passes from a comma separated list
+//of their names. Returns 0 if a name is not known.
+unsigned parsePasses(const char *list){
+    const struct{const char *name; unsigned pass;} passes[] = {
+        {"peephole", CHIP8_OPTIMIZE_PEEPHOLE},
+        {"jumps", CHIP8_OPTIMIZE_JUMPS},
+        {"outline", CHIP8_OPTIMIZE_OUTLINE},
+    };
+
+    unsigned result = 0;
+    while(*list != '\0'){
+        size_t length = strcspn(list, ",");
+        unsigned pass = 0;
+        for(size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++){
+            if(strlen(passes[i].name) == length && strncmp(passes[i].name, list, length) == 0) pass = passes[i].pass;
         }
+        if(pass == 0) return 0;
 
-        //Skip if not equal
-        else if(strcmp("sne", word) == 0){
-            getword(word, buffer, 1);
+        result |= pass;
+        list += length;
+        if(*list == ',') list++;
+    }
+    return result;
+}
 
-            unsigned short addr1 = getRegisterNumber(word);
-            unsigned short addr2;
-            getword(word, buffer, 2);
 
-            if(word[0] == 'v'){
-                addr2 = getRegisterNumber(word);
-                unsigned short opcode = 0x9 << 12;
-                addr1 = addr1 << 4;
-                addr1 = addr1 | addr2;
-                addr1 = addr1 << 4;
-                opcode = opcode | addr1;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
+//Helper function to print a one line description of a failed batch job
+void printJobFailure(const batchJob *job){
+    if(job->result == BATCH_ERROR_INPUT) fprintf(stderr, "Error: Could not find input file %s. \n", job->input);
+    else if(job->result == BATCH_ERROR_WRITE) fprintf(stderr, "Error: Could not write output file %s. \n", job->output);
+    else if(job->result == CHIP8_ERROR_MEMORY) fprintf(stderr, "Error: Out of memory while assembling %s. \n", job->input);
+}
 
-            }
-            else{
-                addr2 = stringToNum(word, AnchorList);
-                if(addr2 < 0 || addr2 > 255){error("Address in %s at line %i must be between 0 and 255.\n");}
-                unsigned short opcode = 0x4 << 12;
-                addr1 = addr1 << 8;
-                addr1 = addr1 | addr2;
-                opcode = addr1 | opcode;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
-        }
 
-        //Load some data into or out of some registers
-        else if(strcmp("ld", word) == 0){
-            getword(word, buffer, 1);
-            //Load data into a register
-            if(word[0] == 'v'){
-                unsigned short addr1 = getRegisterNumber(word);
-                unsigned short addr2;
-                getword(word, buffer, 2);
-
-                //Load from another register
-                if(word[0] == 'v'){
-                    addr2 = getRegisterNumber(word);
-                    unsigned short opcode = 0x8 << 12;
-                    addr1 = addr1 << 8;
-                    addr1 = addr1 | (addr2 << 4);
-                    opcode = opcode | addr1;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-                //Load from delay timer
-                else if(strcmp(word, "dt") == 0){
-                    unsigned short opcode = 0xF << 12;
-                    addr1 = addr1 << 8;
-                    addr1 = addr1 | 0x7;
-                    opcode = opcode | addr1;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-                //Load from keyboard
-                else if(strcmp(word, "k") == 0){
-                    unsigned short opcode = 0xF << 12;
-                    addr1 = addr1 << 8;
-                    addr1 = addr1 | 0xA;
-                    opcode = opcode | addr1;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-                //Load from memory
-                else if(strcmp(word, "[i]") == 0){
-                    unsigned short opcode = 0xF << 12;
-                    addr1 = addr1 << 8;
-                    addr1 = addr1 | 65;
-                    opcode = opcode | addr1;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-                //Load from literal number
-                else{
-                    addr2 = stringToNum(word, AnchorList);
-                    if(addr2 < 0 || addr2 > 255){error("Address in %s at line %i must be between 0 and 255.\n");}
-                    unsigned short opcode = 0x6 << 12;
-                    addr1 = addr1 << 8;
-                    addr1 = addr1 | addr2;
-                    opcode = addr1 | opcode;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-            }
-            //Load into I register
-            else if(word[0] == 'i'){
-                getword(word, buffer, 2);
-                
-                //Load from register
-                if(word[0] == 'v'){
-                    unsigned short addr = getRegisterNumber(word);
-                    if(addr < 0 || addr > 255) error("Address in %s at line %i must be between 0 and 255");
-                    unsigned short opcode = 0xF << 12;
-                    addr = (addr << 8) | 0x30;
-                    opcode = opcode | addr;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-
-                //Load from literal number
-                else{
-                    unsigned short addr = stringToNum(word, AnchorList);
-                    if(addr < 0 || addr > 4095) error("Address in %s at line %i must be between 0 and 4095");
-                    unsigned short opcode = 0xA << 12;
-                    opcode = opcode | addr;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
+//Helper function to write the whole image to a file descriptor. Returns 0 on success.
+int writeAll(int fd, const unsigned char *data, size_t size){
+    while(size > 0){
+        long written = write(fd, data, size);
+        if(written <= 0) return 1;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
 
-            }
-            //Load into delay timer
-            else if(strcmp(word, "dt") == 0){
-                getword(word, buffer, 2);
-                unsigned short addr = getRegisterNumber(word);
-                unsigned short opcode = 0xf << 12;
-                addr = addr << 8;
-                addr = addr | 15;
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
-            //Load into sound timer
-            else if(strcmp(word, "st") == 0){
-                getword(word, buffer, 2);
-                unsigned short addr = getRegisterNumber(word);
-                unsigned short opcode = 0xF << 12;
-                addr = addr << 8;
-                addr = addr | 18;
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
-            //Load I with the value of vx
-            else if(word[0] = 'f'){
-                getword(word, buffer, 2);
-                unsigned short addr = getRegisterNumber(word);
-                unsigned short opcode = 0xF << 12;
-                addr = addr << 8;
-                addr = addr | 29;
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
-            //Load bcd representation of vx into memory
-            else if(word[0] == 'b'){
-                getword(word, buffer, 2);
-                unsigned short addr = getRegisterNumber(word);
-                unsigned short opcode = 0xF << 12;
-                addr = addr << 8;
-                addr = addr | 33;
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
-            //Load into memory
-            else if(strcmp(word, "[i]") == 0){
-                getword(word, buffer, 2);
-                unsigned short addr = getRegisterNumber(word);
-                unsigned short opcode = 0xF << 12;
-                addr = addr << 8;
-                addr = addr | 55;
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
+
+int main(int argc, char *argv[]){
+    chip8Options options;
+    chip8_default_options(&options);
+
+    char *programName = NULL;
+    char *outputName = NULL;
+    int outputFd = -1;
+    bool batch = false;
+    int jobs = 0;
+    char *cacheName = NULL;
+    bool showStats = false;
+    bool statsJson = false;
+    bool showLoops = false;
+    chip8CostModel costModel;
+    chip8_default_cost_model(&costModel);
+    chip8LoopReport loops = {0};
+    int clock = 600;
+    bool run = false;
+    char *romName = NULL;
+    char *disassembleName = NULL;
+    bool verify = false;
+    char *listingName = NULL;
+    char *symbolsName = NULL;
+    char *sourceMapName = NULL;
+    char *profileName = NULL;
+    char *profileOutName = NULL;
+    static unsigned long long profile[CHIP8_MEMORY_SIZE];
+    chip8DebugInfo debug = {0};
+    chip8RunOptions runOptions;
+    chip8_default_run_options(&runOptions);
+    runOptions.maxFrames = 600;
+    chip8Stats stats = {0};
+    batchList list = {0};
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--little-endian") == 0) options.littleEndian = true;
+        else if(strcmp(argv[i], "--big-endian") == 0) options.littleEndian = false;
+        else if(strcmp(argv[i], "--batch") == 0) batch = true;
+        else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) outputName = argv[++i];
+        else if(strcmp(argv[i], "--output-fd") == 0 && i + 1 < argc) outputFd = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) jobs = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc) cacheName = argv[++i];
+        else if(strcmp(argv[i], "--stats") == 0) showStats = true;
+        else if(strcmp(argv[i], "-O") == 0) options.optimize = CHIP8_OPTIMIZE_ALL;
+        else if(strcmp(argv[i], "-Os") == 0) options.optimize = CHIP8_OPTIMIZE_SIZE;
+        else if(strcmp(argv[i], "--optimize") == 0 && i + 1 < argc){
+            options.optimize = parsePasses(argv[++i]);
+            if(options.optimize == 0){fprintf(stderr, "Error: Unknown optimization in %s. \n", argv[i]); return 1;}
         }
-        
-        //Add number to register
-        else if(strcmp("add", word) == 0){
-            getword(word, buffer, 1);
-
-            if(word[0] == 'v'){
-                unsigned short addr1 = getRegisterNumber(word);
-                unsigned short addr2;
-                getword(word, buffer, 2);
-                if(word[0] == 'v'){
-                    addr2 = getRegisterNumber(word);
-                    unsigned short opcode = 8 << 12;
-                    addr1 = addr1 << 8;
-                    addr2 = addr2 << 4;
-                    addr1 = addr1 | addr2;
-                    addr1 = addr1 | 4;
-                    opcode = opcode | addr1;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-                else{
-                    addr2 = stringToNum(word, AnchorList);
-                    if(addr2 < 0 || addr2 > 255){error("Byte in %s at line %i must be between 0 and 255.");}
-                    unsigned short opcode = 7 << 12;
-                    addr1 = addr1 << 8;
-                    addr1 = addr1 | addr2;
-                    opcode = opcode | addr1;
-                    fwrite(&opcode, sizeof(opcode), 1, outfile);
-                }
-            }
-            else if(word[0] == 'i'){
-                getword(word, buffer, 2);
-                if(!word[0] == 'v'){error("Expected register (vx) in %s at line %i\n");}
-                unsigned short addr = getRegisterNumber(word);
-                unsigned short opcode = 0xf << 12;
-                addr = addr << 8;
-                addr = addr | 0x1E;
-                opcode = opcode | addr;
-                fwrite(&opcode, sizeof(opcode), 1, outfile);
-            }
+        else if(strcmp(argv[i], "--stats-json") == 0) showStats = statsJson = true;
+        else if(strcmp(argv[i], "--loops") == 0) showLoops = true;
+        else if(strcmp(argv[i], "--clock") == 0 && i + 1 < argc) clock = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--run") == 0) run = true;
+        else if(strcmp(argv[i], "--emulate") == 0 && i + 1 < argc) romName = argv[++i];
+        else if(strcmp(argv[i], "--disassemble") == 0 && i + 1 < argc) disassembleName = argv[++i];
+        else if(strcmp(argv[i], "--verify") == 0) verify = true;
+        else if(strcmp(argv[i], "--listing") == 0 && i + 1 < argc) listingName = argv[++i];
+        else if(strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) symbolsName = argv[++i];
+        else if(strcmp(argv[i], "--source-map") == 0 && i + 1 < argc) sourceMapName = argv[++i];
+        else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc){
+            profileName = argv[++i];
+            int line = chip8_load_profile(profileName, profile);
+            if(line == -1){fprintf(stderr, "Error: Could not read profile %s. \n", profileName); return 1;}
+            if(line > 0){fprintf(stderr, "%s:%i: error: Expected an address and a count. \n", profileName, line); return 1;}
+            options.profile = profile;
         }
-        
-        //Perform logical OR on register
-        else if(strcmp("or", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            getword(word, buffer, 2);
-            unsigned short addr2 = getRegisterNumber(word);
-
-            unsigned short opcode = 8 << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | 1;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
-
+        else if(strcmp(argv[i], "--profile-out") == 0 && i + 1 < argc) profileOutName = argv[++i];
+        else if(strcmp(argv[i], "--cycles") == 0 && i + 1 < argc){
+            runOptions.maxCycles = strtoull(argv[++i], NULL, 10);
+            runOptions.maxFrames = 0;
         }
-
-        //Perform logical AND on register
-        else if(strcmp("and", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            getword(word, buffer, 2);
-            unsigned short addr2 = getRegisterNumber(word);
-
-            unsigned short opcode = 8 << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | 2;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+        else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) runOptions.maxFrames = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--cost-model") == 0 && i + 1 < argc){
+            showLoops = true;
+            if(readCostModel(argv[++i], &costModel) != 0) return 1;
         }
-
-        //Perform logical XOR on register
-        else if(strcmp("xor", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            getword(word, buffer, 2);
-            unsigned short addr2 = getRegisterNumber(word);
-
-            unsigned short opcode = 8 << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | 3;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+        else if(strcmp(argv[i], "--manifest") == 0 && i + 1 < argc){
+            batch = true;
+            if(readManifest(&list, argv[++i]) != 0){fprintf(stderr, "Error: Could not read manifest %s. \n", argv[i]); return 1;}
         }
-
-        //Subtract from register
-        else if(strcmp("sub", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            getword(word, buffer, 2);
-            unsigned short addr2 = getRegisterNumber(word);
-
-            unsigned short opcode = 8 << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | 5;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+        else if(argv[i][0] == '-' && argv[i][1] != '\0'){fprintf(stderr, "Error: Unknown option %s. \n", argv[i]); return 1;}
+        else if(batch || verify){
+            if(addBatchJob(&list, argv[i], NULL) != 0){fprintf(stderr, "Error: Out of memory. \n"); return 1;}
         }
+        else programName = argv[i];
+    }
 
-        //Perform right bit shift on register
-        else if(strcmp("shr", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            unsigned short addr2 = 0;
+    if(showStats) options.stats = &stats;
+    runOptions.clock = clock;
+    runOptions.costModel = &costModel;
+    runOptions.littleEndian = options.littleEndian;
+
+    //Emulator mode runs an image that was assembled before
+    if(romName != NULL){
+        sourceFile rom;
+        if(openSource(romName, &rom) != 0){fprintf(stderr, "Error: Could not find input file %s. \n", romName); return 1;}
+        int result = runImage((const unsigned char *)rom.text, rom.size, &runOptions, NULL, profileOutName, stdout);
+        closeSource(&rom);
+        return result;
+    }
 
-            unsigned short opcode = 8 << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | 6;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+    //Disassembler mode writes the source of an image to -o, or to stdout
+    if(disassembleName != NULL){
+        sourceFile rom;
+        if(openSource(disassembleName, &rom) != 0){fprintf(stderr, "Error: Could not find input file %s. \n", disassembleName); return 1;}
+
+        char *text = malloc(CHIP8_DISASSEMBLY_SIZE);
+        size_t textSize;
+        int result = text ? chip8_disassemble((const unsigned char *)rom.text, rom.size, options.littleEndian, text, CHIP8_DISASSEMBLY_SIZE, &textSize) : CHIP8_ERROR_MEMORY;
+        closeSource(&rom);
+        if(result != CHIP8_OK){
+            free(text);
+            if(result == CHIP8_ERROR_MEMORY) fprintf(stderr, "Error: Out of memory. \n");
+            else if(rom.size <= CHIP8_PROGRAM_SPACE) fprintf(stderr, "Error: %s has an odd number of bytes. \n", disassembleName);
+            else fprintf(stderr, "Error: %s is larger than %i bytes. \n", disassembleName, CHIP8_PROGRAM_SPACE);
+            return 1;
         }
 
-        //Subtract from register and set overflow register
-        else if(strcmp("subn", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            getword(word, buffer, 2);
-            unsigned short addr2 = getRegisterNumber(word);
-
-            unsigned short opcode = 8 << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | 7;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+        FILE *outfile = outputName == NULL || strcmp(outputName, "-") == 0 ? stdout : fopen(outputName, "w");
+        if(outfile == NULL){
+            free(text);
+            fprintf(stderr, "Error: Could not open output file. \n");
+            return 1;
         }
+        fwrite(text, 1, textSize, outfile);
+        free(text);
+        if(outfile != stdout && fclose(outfile) != 0){fprintf(stderr, "Error: Could not write output file. \n"); return 1;}
+        return 0;
+    }
 
-        //Perform left bit shift on register
-        else if(strcmp("shl", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
+    //Verify mode checks that images survive being disassembled and assembled again
+    if(verify){
+        if(programName != NULL && addBatchJob(&list, programName, NULL) != 0){fprintf(stderr, "Error: Out of memory. \n"); return 1;}
+        if(list.count == 0){fprintf(stderr, "Error: Too few arguments. \n"); return 1;}
 
-            unsigned short addr2 = 0;
+        double start = now();
+        size_t failed = verifyBatch(&list, &options, jobs);
+        double seconds = now() - start;
 
-            unsigned short opcode = 8 << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | 0xE;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+        size_t bytes = 0;
+        for(size_t i = 0; i < list.count; i++){
+            printVerifyFailure(&list.jobs[i]);
+            bytes += list.jobs[i].imageSize;
         }
+        printf("%zu of %zu images match after a round trip, %zu bytes in %.3f ms (%.1f MB/s)\n",
+               list.count - failed, list.count, bytes, seconds * 1000, seconds > 0 ? bytes / seconds / 1e6 : 0);
+        freeBatchList(&list);
+        return failed > 0 ? 1 : 0;
+    }
 
-        //Generate random 8-bit number and AND it with the specified register
-        else if(strcmp("rnd", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            getword(word, buffer, 2);
-            unsigned short addr2 = stringToNum(word, AnchorList);
-            if(addr2 < 0 || addr2 > 255) error("Value in %s at line %i must be between 0 and 255\n");
-
-            unsigned short opcode = 0xC << 12;
-            addr1 = (addr1 << 8) | addr2;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
-        }
+    if(showLoops){
+        options.loops = &loops;
+        options.costModel = &costModel;
+    }
 
-        //Draw sprite at the memory location in I
-        else if(strcmp("drw", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
-            getword(word, buffer, 2);
-            unsigned short addr2 = getRegisterNumber(word);
-            getword(word, buffer, 3);
-            unsigned char n = stringToNum(word, AnchorList);
-            if(n < 0 || n > 15) error("Value in %s at line %i must be between 0 and 15");
-
-            unsigned short opcode = 0xD << 12;
-            addr1 = (addr1 << 8) | (addr2 << 4) | n;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
+    //Batch mode assembles every input to its own .hex file on a pool of workers
+    if(batch){
+        if(programName != NULL && addBatchJob(&list, programName, NULL) != 0){fprintf(stderr, "Error: Out of memory. \n"); return 1;}
+        if(list.count == 0){fprintf(stderr, "Error: Too few arguments. \n"); return 1;}
+        if(cacheName != NULL){fprintf(stderr, "Error: --cache can only be used with a single file. \n"); return 1;}
+        if(showLoops || run){fprintf(stderr, "Error: --loops and --run can only be used with a single file. \n"); return 1;}
+        if(listingName || symbolsName || sourceMapName){fprintf(stderr, "Error: --listing, --symbols and --source-map can only be used with a single file. \n"); return 1;}
+        if(profileName || profileOutName){fprintf(stderr, "Error: --profile and --profile-out can only be used with a single file. \n"); return 1;}
+
+        size_t failed = runBatch(&list, &options, jobs);
+        for(size_t i = 0; i < list.count; i++){
+            printDiagnostics(list.jobs[i].input, &list.jobs[i].diagnostics);
+            printJobFailure(&list.jobs[i]);
+        }
+        if(failed > 0) fprintf(stderr, "%zu of %zu files failed to assemble.\n", failed, list.count);
+
+        if(showStats){
+            double readTime = 0, writeTime = 0;
+            for(size_t i = 0; i < list.count; i++){
+                chip8_add_stats(&stats, &list.jobs[i].stats);
+                readTime += list.jobs[i].readTime;
+                writeTime += list.jobs[i].writeTime;
+            }
+            printStats(stdout, &stats, readTime, writeTime, list.count, statsJson);
         }
 
-        //Skip if a specified key is pressed
-        else if(strcmp("skp", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
+        freeBatchList(&list);
+        return failed > 0 ? 1 : 0;
+    }
 
-            unsigned short opcode = 0xE << 12;
-            addr1 = (addr1 << 8) | 0x9E;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
-        }
+    if(programName == NULL){fprintf(stderr, "Error: Too few arguments. \n"); return 1;}
+    if(outputName == NULL) outputName = "program.hex";
 
-        //Skip if a specified key is not pressed
-        else if(strcmp("sknp", word) == 0){
-            getword(word, buffer, 1);
-            unsigned short addr1 = getRegisterNumber(word);
+    //Map the file, or read the whole program from stdin when the input is "-"
+    double readStart = now();
+    sourceFile source;
+    if(strcmp(programName, "-") == 0){
+        programName = "<stdin>";
+        if(readSource(stdin, &source) != 0){fprintf(stderr, "Error: Could not read stdin. \n"); return 1;}
+    }
+    else if(openSource(programName, &source) != 0){fprintf(stderr, "Error: Could not find input file. \n"); return 1;}
+    else options.sourceName = programName;
 
-            unsigned short opcode = 0xE << 12;
-            addr1 = (addr1 << 8) | 0xA1;
-            opcode = opcode | addr1;
-            fwrite(&opcode, sizeof(opcode), 1, outfile);
-        }
-        
-        //Handle unknown instructions
-        else{
-            if(!isspace(word[0])){
-                printf("%s\n", word);
-                error("Unexpected token in %s at line %i\n");
-            }
-            else{
-                linecount++;
-                continue;
-            }
-        }
+    double readTime = now() - readStart;
 
-        
-        linecount++;
-        PC++;
+    //Incremental mode only parses the lines that changed since the cache was saved
+    if(cacheName != NULL){
+        options.cache = chip8_cache_load(cacheName);
+        if(options.cache == NULL){fprintf(stderr, "Error: Out of memory. \n"); return 1;}
     }
 
-    //End byte
-    unsigned short opcode = 0xFFFF;
-    fwrite(&opcode, sizeof(opcode), 1, outfile);
-    fwrite(&opcode, sizeof(opcode), 1, outfile);
-    fclose(infile);
-    fclose(outfile);
+    //Debug info is also kept for --run, so the hot spots it reports show their lines
+    bool debugFiles = listingName || symbolsName || sourceMapName;
+    if(debugFiles || run) options.debug = &debug;
 
-    //Free memory used by anchor list
-    free(AnchorList);
+    unsigned char image[CHIP8_MEMORY_SIZE];
+    size_t imageSize;
+    chip8Diagnostics diagnostics = {0};
 
-    return 0;
+    int result = chip8_assemble(source.text, source.size, &options, image, sizeof(image), &imageSize, &diagnostics);
+
+    //The listing needs the source text, so it is written before the source is closed
+    if(result == CHIP8_OK && debugFiles){
+        if(listingName && writeListing(listingName, source.text, source.size, &debug, image) != 0) fprintf(stderr, "Warning: Could not write listing %s. \n", listingName);
+        if(symbolsName && writeSymbols(symbolsName, &debug) != 0) fprintf(stderr, "Warning: Could not write symbol map %s. \n", symbolsName);
+        if(sourceMapName && chip8_save_source_map(&debug, sourceMapName) != 0) fprintf(stderr, "Warning: Could not write source map %s. \n", sourceMapName);
+    }
+    closeSource(&source);
+
+    if(options.cache != NULL){
+        if(chip8_cache_save(options.cache, cacheName) != 0) fprintf(stderr, "Warning: Could not save cache %s. \n", cacheName);
+        chip8_cache_free(options.cache);
+    }
+
+    printDiagnostics(programName, &diagnostics);
+    chip8_free_diagnostics(&diagnostics);
+
+    if(result == CHIP8_ERROR_MEMORY){fprintf(stderr, "Error: Out of memory. \n"); return 1;}
+    if(result != CHIP8_OK) return 1;
+
+    //The image goes to stdout for "-o -", or to the descriptor given with --output-fd
+    double writeStart = now();
+    if(outputFd == -1 && strcmp(outputName, "-") == 0){
+        outputFd = 1;
+#ifdef _WIN32
+        _setmode(1, _O_BINARY);
+#endif
+    }
+    if(outputFd != -1){
+        if(writeAll(outputFd, image, imageSize) != 0){fprintf(stderr, "Error: Could not write output. \n"); return 1;}
+    }
+    else{
+        //Output file is program.hex unless -o is given. It is only opened once
+        //assembly has succeeded, so a failed run leaves the previous image untouched.
+        FILE *outfile = fopen(outputName, "wb");
+        if(outfile == NULL){fprintf(stderr, "Error: Could not open output file. \n"); return 1;}
+        fwrite(image, 1, imageSize, outfile);
+        if(fclose(outfile) != 0){fprintf(stderr, "Error: Could not write output file. \n"); return 1;}
+    }
+
+    //Reports go to stdout, unless the image already does
+    if(showStats) printStats(outputFd == 1 ? stderr : stdout, &stats, readTime, now() - writeStart, 1, statsJson);
+    if(showLoops) printLoops(outputFd == 1 ? stderr : stdout, &loops, clock);
+    chip8_free_loop_report(&loops);
+    if(run) result = runImage(image, imageSize, &runOptions, &debug, profileOutName, outputFd == 1 ? stderr : stdout);
+    chip8_free_debug_info(&debug);
+
+    return result;
 }
@@ -0,0 +1,234 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//Internal state of one assembly run, shared by the assembler's modules
+
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "chip8asm.h"
+#include "symtab.h"
+#include "lexer.h"
+
+//What a line assembles to, independent of where it ends up in the program.
+//This is what the incremental cache keeps for each line.
+#define LINE_EMPTY 0
+#define LINE_ANCHOR 1
+#define LINE_INSTRUCTION 2
+#define LINE_IGNORED 3
+#define LINE_DATA 4         //Bytes from a data directive, never cached
+#define LINE_CONSTANT 5     //An equ line, never cached
+#define LINE_SECTION 6      //An org or section line, never cached
+#define LINE_PACKED 7       //A pack line, never cached
+#define LINE_BRANCH 8       //A branch, the skip in opcode and the anchor point to jump to in name
+
+typedef struct{
+    unsigned char kind;
+    unsigned short opcode;      //Every field filled in except an anchor point reference
+    unsigned short max;         //Largest value the referenced anchor point may have, 0 if there is none
+    const char *name;           //Anchor point the line defines or references
+    size_t length;
+    const unsigned char *data;  //Bytes of a data line, which live as long as the assembly run
+    size_t size;                //Bytes of a data line, or the address of an org line
+    const char *value;          //Expression of an equ line, or of the value a branch compares with
+    size_t valueLength;
+    unsigned short registers[2];    //Virtual register in the x and y fields as its index + 1, or 0
+    unsigned short address;     //Where a pack line unpacks its bytes
+} lineResult;
+
+//An instruction or a piece of data of the program before it is laid out in
+//the image. Anchor point references are resolved to the index of the
+//instruction they mark, so passes can move and remove instructions and keep
+//them correct. An expression that uses an anchor point keeps max and no target,
+//and is evaluated at layout. So is data with such values, whose max is the
+//largest value of one.
+typedef struct{
+    unsigned short opcode;      //Every field filled in except an anchor point reference
+    unsigned short max;         //Largest value the referenced anchor point may have, 0 if there is none
+    int target;                 //Instruction the anchor point marks, -1 until it is resolved
+    int line;
+    int section;                //Index in ctx->sections, 0 for the main section
+    const char *name;
+    size_t length;
+    const unsigned char *data;  //Bytes of data, NULL for an instruction
+    size_t size;
+    unsigned short registers[2];    //Virtual register in the x and y fields as its index + 1, or 0
+    bool branch;                //jp of a branch, which becomes part of the skip before it if it only goes over one instruction
+} instruction;
+
+//Blocks of memory for data directives. Blocks never move, so data can be
+//pointed to until the run ends.
+typedef struct dataBlock{
+    struct dataBlock *next;
+    size_t size;
+    size_t used;
+    unsigned char bytes[];
+} dataBlock;
+
+//A constant from an equ line, worked out when it is first used
+#define CONSTANT_UNKNOWN 0
+#define CONSTANT_BUSY 1         //Being worked out, meeting it again means it depends on itself
+#define CONSTANT_KNOWN 2
+#define CONSTANT_FAILED 3       //Its error has been reported
+
+typedef struct{
+    const char *text;
+    size_t length;
+    int line;
+    int value;
+    unsigned char state;
+} constant;
+
+//A section of the program. The main section starts the program at
+//CHIP8_PROGRAM_START, an org line starts one at a fixed address, and a named
+//section goes wherever the layout finds room for it.
+typedef struct{
+    const char *name;           //NULL for main and org sections
+    size_t nameLength;
+    int origin;                 //Fixed address, or -1 for a named section
+    int line;
+    size_t size;                //Bytes, worked out at layout
+    int address;                //Where it was placed, worked out at layout
+} section;
+
+//A virtual register, a name such as %tmp that is given a real register once
+//the whole program is known
+typedef struct{
+    const char *name;           //Including the %
+    size_t length;
+    int line;                   //Where it is first used
+} virtualRegister;
+
+//Bytes from a pack line, stored compressed and unpacked to address when the
+//program starts, or stored as they are at address if that takes less room
+typedef struct{
+    const unsigned char *data;
+    size_t size;
+    int address;
+    int line;
+    const unsigned char *packed;    //The bytes compressed, NULL if they are stored as they are
+    size_t packedSize;
+} packedBlock;
+
+//A macro. Its body is the source text between the macro line and endm.
+#define MACRO_PARAMETERS 14
+
+typedef struct{
+    const char *name;
+    size_t nameLength;
+    const char *body;
+    size_t bodyLength;
+    int line;
+    int parameterCount;
+    const char *parameters[MACRO_PARAMETERS];
+    size_t parameterLengths[MACRO_PARAMETERS];
+} macro;
+
+typedef struct{
+    const chip8Options *options;
+    const char *source;
+    size_t sourceSize;
+
+    //Keep track of program line count
+    int line;
+    int PC;
+
+    //The program is built in an image of the whole Chip-8 address space.
+    //Opcodes are stored big-endian, the way they sit in Chip-8 memory.
+    unsigned char image[CHIP8_MEMORY_SIZE];
+    size_t imageSize;
+    bool overflowed;
+
+    anchorPointList *anchors;
+
+    //The program's instructions in source order, laid out once every line is read
+    instruction *code;
+    size_t codeSize;
+    size_t codeCapacity;
+    size_t forwardReferences;
+    size_t programSize;         //Bytes the instructions and data take up so far
+
+    dataBlock *dataBlocks;
+
+    //Sections, created with the main one when the first org or section line is read
+    section *sections;
+    size_t sectionSize;
+    size_t sectionCapacity;
+    int currentSection;
+
+    //Constants, virtual registers and macros, found by name through tables created when the first is defined
+    anchorPointList *constantNames;
+    constant *constants;
+    size_t constantSize;
+    size_t constantCapacity;
+
+    anchorPointList *registerNames;
+    virtualRegister *virtuals;
+    size_t virtualSize;
+    size_t virtualCapacity;
+
+    anchorPointList *macroNames;
+    macro *macros;
+    size_t macroSize;
+    size_t macroCapacity;
+    bool defining;              //Reading the body of the last macro
+    int macroDepth;             //Expansions inside expansions
+    int expansions;             //Numbers the local anchor points of each expansion
+
+    //Blocks of pack lines, packed once the whole program has been read
+    packedBlock *packs;
+    size_t packSize;
+    size_t packCapacity;
+    unsigned char *packTable;   //Segments the unpacker reads, filled in at layout
+
+    //Files mapped by incbin, unmapped when the run ends
+    sourceFile *includes;
+    size_t includeSize;
+    size_t includeCapacity;
+
+    chip8Stats *stats;
+    size_t symbolLookups;
+
+    chip8Diagnostics *diagnostics;
+    size_t errors;
+    bool outOfMemory;
+} assembler;
+
+//Add an instruction or piece of data to the back of the current section
+void addInstruction(assembler *ctx, const lineResult *r);
+
+//Get size bytes that last until the run ends, or NULL if out of memory
+unsigned char *allocateData(assembler *ctx, size_t size);
+
+//Build the tables shared by every run. Returns 0 on success.
+int initShared(void);
+
+//Record a diagnostic for the current line. message is a printf format.
+void error(assembler *ctx, const char *message, ...);
+void warning(assembler *ctx, const char *message, ...);
+void note(assembler *ctx, const char *message, ...);
+
+#endif
@@ -0,0 +1,280 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "batch.h"
+#include "lexer.h"
+
+
+//Helper function to get the time in seconds for the stats
+static double now(void){
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+//Helper function to copy a string, or NULL if out of memory
+static char *copyString(const char *s, size_t length){
+    char *copy = malloc(length + 1);
+    if(copy == NULL) return NULL;
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+
+//Helper function to make the default output path, input.asm becomes input.hex
+static char *defaultOutput(const char *input){
+    size_t length = strlen(input);
+    const char *dot = strrchr(input, '.');
+    const char *slash = strrchr(input, '/');
+    if(dot != NULL && (slash == NULL || dot > slash)) length = dot - input;
+
+    char *output = malloc(length + 5);
+    if(output == NULL) return NULL;
+    memcpy(output, input, length);
+    strcpy(output + length, ".hex");
+    return output;
+}
+
+
+int addBatchJob(batchList *list, const char *input, const char *output){
+    if(list->count == list->capacity){
+        size_t newCapacity = list->capacity ? list->capacity * 2 : 64;
+        batchJob *temp = realloc(list->jobs, newCapacity * sizeof(list->jobs[0]));
+        if(!temp) return 1;
+        list->jobs = temp;
+        list->capacity = newCapacity;
+    }
+
+    batchJob *job = &list->jobs[list->count];
+    memset(job, 0, sizeof(*job));
+    job->input = copyString(input, strlen(input));
+    job->output = output ? copyString(output, strlen(output)) : defaultOutput(input);
+    if(job->input == NULL || job->output == NULL){
+        free(job->input);
+        free(job->output);
+        return 1;
+    }
+
+    list->count++;
+    return 0;
+}
+
+
+int readManifest(batchList *list, const char *path){
+    sourceFile manifest;
+    if(openSource(path, &manifest) != 0) return 1;
+
+    const char *text = manifest.text;
+    size_t size = manifest.size;
+    size_t i = 0;
+    int result = 0;
+
+    //Each line is an input path and an optional output path, separated by whitespace
+    while(i < size && result == 0){
+        const char *words[2];
+        size_t lengths[2];
+        int count = 0;
+
+        while(i < size && text[i] != '\n'){
+            if(text[i] == ' ' || text[i] == '\t' || text[i] == '\r'){
+                i++;
+                continue;
+            }
+            if(text[i] == ';' && count == 0){
+                while(i < size && text[i] != '\n') i++;
+                break;
+            }
+
+            size_t start = i;
+            while(i < size && text[i] != ' ' && text[i] != '\t' && text[i] != '\r' && text[i] != '\n') i++;
+            if(count < 2){
+                words[count] = text + start;
+                lengths[count] = i - start;
+            }
+            count++;
+        }
+        i++;
+
+        if(count == 0) continue;
+        if(count > 2){
+            result = 1;
+            break;
+        }
+
+        char *input = copyString(words[0], lengths[0]);
+        char *output = count > 1 ? copyString(words[1], lengths[1]) : NULL;
+        if(input == NULL || (count > 1 && output == NULL) || addBatchJob(list, input, output) != 0) result = 1;
+        free(input);
+        free(output);
+    }
+
+    closeSource(&manifest);
+    return result;
+}
+
+
+//Helper function to assemble one job and write its image
+static void runJob(batchJob *job, const chip8Options *options){
+    //Each job profiles into its own stats, the caller adds them up
+    chip8Options jobOptions = *options;
+    if(options->stats != NULL) jobOptions.stats = &job->stats;
+    jobOptions.loops = NULL;
+    jobOptions.sourceName = job->input;
+    double start = options->stats ? now() : 0;
+
+    sourceFile source;
+    if(openSource(job->input, &source) != 0){
+        job->result = BATCH_ERROR_INPUT;
+        return;
+    }
+    if(options->stats) job->readTime = now() - start;
+
+    unsigned char image[CHIP8_MEMORY_SIZE];
+    size_t imageSize;
+    job->result = chip8_assemble(source.text, source.size, &jobOptions, image, sizeof(image), &imageSize, &job->diagnostics);
+    closeSource(&source);
+    if(job->result != CHIP8_OK) return;
+
+    start = options->stats ? now() : 0;
+    FILE *outfile = fopen(job->output, "wb");
+    if(outfile == NULL || fwrite(image, 1, imageSize, outfile) != imageSize) job->result = BATCH_ERROR_WRITE;
+    if(outfile != NULL && fclose(outfile) != 0) job->result = BATCH_ERROR_WRITE;
+    if(options->stats) job->writeTime = now() - start;
+}
+
+
+//Helper function to disassemble one job's image, assemble it again and compare
+static void verifyJob(batchJob *job, const chip8Options *options){
+    sourceFile rom;
+    if(openSource(job->input, &rom) != 0){
+        job->result = BATCH_ERROR_INPUT;
+        return;
+    }
+
+    job->imageSize = rom.size;
+    if(rom.size > CHIP8_PROGRAM_SPACE) job->result = CHIP8_ERROR_SOURCE;
+    else job->result = chip8_verify_image((const unsigned char *)rom.text, rom.size, options->littleEndian, &job->mismatch);
+    closeSource(&rom);
+}
+
+
+//Shared state of the worker pool. Workers take the next job index until none are left.
+typedef struct{
+    batchList *list;
+    const chip8Options *options;
+    void (*run)(batchJob *job, const chip8Options *options);
+    size_t next;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} batchQueue;
+
+static void *worker(void *arg){
+    batchQueue *queue = arg;
+
+    while(1){
+#ifndef _WIN32
+        pthread_mutex_lock(&queue->lock);
+#endif
+        size_t index = queue->next++;
+#ifndef _WIN32
+        pthread_mutex_unlock(&queue->lock);
+#endif
+        if(index >= queue->list->count) return NULL;
+
+        queue->run(&queue->list->jobs[index], queue->options);
+    }
+}
+
+
+//Helper function to run every job of the list on up to threads workers.
+//Returns the number of jobs that failed.
+static size_t runPool(batchList *list, const chip8Options *options, int threads, void (*run)(batchJob *job, const chip8Options *options)){
+    batchQueue queue = {.list = list, .options = options, .run = run, .next = 0};
+
+#ifndef _WIN32
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0) threads = 1;
+    if((size_t)threads > list->count) threads = list->count;
+
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+
+    //The calling thread is always one of the workers
+    int started = 0;
+    if(workers != NULL){
+        while(started < threads - 1 && pthread_create(&workers[started], NULL, worker, &queue) == 0) started++;
+    }
+    worker(&queue);
+    for(int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    free(workers);
+    pthread_mutex_destroy(&queue.lock);
+#else
+    (void)threads;
+    worker(&queue);
+#endif
+
+    size_t failed = 0;
+    for(size_t i = 0; i < list->count; i++){
+        if(list->jobs[i].result != CHIP8_OK) failed++;
+    }
+    return failed;
+}
+
+
+size_t runBatch(batchList *list, const chip8Options *options, int threads){
+    return runPool(list, options, threads, runJob);
+}
+
+
+size_t verifyBatch(batchList *list, const chip8Options *options, int threads){
+    return runPool(list, options, threads, verifyJob);
+}
+
+
+void freeBatchList(batchList *list){
+    for(size_t i = 0; i < list->count; i++){
+        free(list->jobs[i].input);
+        free(list->jobs[i].output);
+        chip8_free_diagnostics(&list->jobs[i].diagnostics);
+    }
+    free(list->jobs);
+    memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,79 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//Batch assembly of many source files on a pool of worker threads
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "chip8asm.h"
+
+//Outcome of a job that did not get as far as assembling
+#define BATCH_ERROR_INPUT -1
+#define BATCH_ERROR_WRITE -2
+
+typedef struct{
+    char *input;
+    char *output;
+
+    int result;                     //CHIP8_OK, a chip8_assemble error or a BATCH_ERROR code
+    chip8Diagnostics diagnostics;
+
+    //Filled in when the options ask for stats
+    chip8Stats stats;
+    double readTime;
+    double writeTime;
+
+    //Filled in by verifyBatch
+    size_t imageSize;
+    size_t mismatch;                //First byte that differs when result is CHIP8_ERROR_MISMATCH
+} batchJob;
+
+typedef struct{
+    batchJob *jobs;
+    size_t count;
+    size_t capacity;
+} batchList;
+
+//Add a job. If output is NULL it is the input path with its extension replaced by .hex.
+//Returns 0 on success.
+int addBatchJob(batchList *list, const char *input, const char *output);
+
+//Add a job for every line of a manifest. Each line is an input path,
+//optionally followed by an output path. Blank lines and lines starting
+//with ';' are skipped.
+int readManifest(batchList *list, const char *path);
+
+//Assemble every job on up to threads workers, or one per core if threads is 0.
+//Failures are recorded in each job and never stop the other jobs.
+//Returns the number of jobs that failed.
+size_t runBatch(batchList *list, const chip8Options *options, int threads);
+
+//Check on the same pool of workers that every job's input, an image, assembles
+//back to the same bytes after it is disassembled. Only options->littleEndian is used.
+//Returns the number of images that failed.
+size_t verifyBatch(batchList *list, const chip8Options *options, int threads);
+
+void freeBatchList(batchList *list);
+
+#endif
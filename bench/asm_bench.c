@@ -0,0 +1,429 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//End to end benchmark of the assembler.
+//Generates seeded synthetic programs and assembles them through the library,
+//reporting lines per second, the time of each phase and the peak memory of
+//each case. A Chip-8 program can not be more than 3584 bytes, so a case of
+//many lines is a stream of programs that each fill most of the image.
+//
+//Cases vary along three axes: the number of lines, from 1,000 up to
+//--max-lines, the share of lines that are anchor points, and the mix of
+//mnemonics. Every mix uses every instruction form of the opcode table, and
+//leans towards the ALU, branches or data and I to a different degree.
+//
+//--json prints the results as JSON, one case per line. Saved to a file, it
+//can be passed back with --baseline to fail with exit code 1 when a case is
+//slower or uses more memory than the baseline by more than --threshold percent.
+//
+//Build: gcc -O2 -I. -o asm_bench bench/asm_bench.c chip8asm.c symtab.c opcodes.c lexer.c cache.c optimize.c cfg.c analyze.c emulator.c directive.c expr.c macro.c disasm.c debuginfo.c section.c regalloc.c profile.c outline.c pack.c -lpthread
+//Usage: asm_bench [--lines n] [--max-lines n] [--labels share] [--mix uniform|alu|branch|data]
+//                 [--seed n] [--optimize] [--json] [--baseline file] [--threshold percent]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "chip8asm.h"
+#include "opcodes.h"
+
+#define UNIT_LINES 1000         //Instruction and data lines of each program
+#define UNIT_BYTES 3300         //A program stops growing here, so it always fits in the image
+#define UNIT_SOURCE (1 << 18)   //Room for the text of one program
+#define CONSTANTS 4             //equ lines at the top of each program
+#define MIN_SECONDS 0.25        //Small cases are assembled again until they take this long
+#define MAX_CASES 64
+#define MAX_BASELINE 256
+
+static const char *mixes[] = {"uniform", "alu", "branch", "data"};
+#define MIXES (int)(sizeof(mixes) / sizeof(mixes[0]))
+
+static const double labelShares[] = {0.02, 0.25};
+
+//One case of the suite
+typedef struct{
+    size_t lines;
+    double labels;              //Share of instruction and data lines with an anchor point in front
+    int mix;
+    char name[64];
+} benchCase;
+
+//What a case measured, sent back from the process that ran it
+typedef struct{
+    size_t lines;               //Source lines assembled, counting every repeat
+    size_t bytes;               //Source bytes assembled
+    size_t programs;
+    size_t failed;              //Programs that did not assemble, which means the generator is wrong
+    double seconds;             //Spent in chip8_assemble
+    double tokenizeTime;
+    double encodeTime;
+    double resolveTime;
+    double optimizeTime;
+    double outputTime;
+    long peakKB;                //Filled in by the parent
+} benchResult;
+
+typedef struct{
+    char name[64];
+    double linesPerSecond;
+    long peakKB;
+} baselineEntry;
+
+static uint64_t seed = 1;
+static bool optimize = false;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//xorshift64*, so every platform generates the same programs from a seed
+static uint64_t nextRandom(uint64_t *state){
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+static unsigned randomBelow(uint64_t *state, unsigned n){
+    return (nextRandom(state) >> 32) % n;
+}
+
+//How often a form comes up in a mix. Every form comes up in every mix.
+static unsigned formWeight(const opcodeEntry *form, int mix){
+    unsigned group = form->opcode >> 12;
+    bool branch = (form->flags & OPCODE_BRANCH) || group == 0x1 || group == 0x2 || group == 0x3 || group == 0x4
+               || group == 0x5 || group == 0x9 || group == 0xE;
+    bool alu = !(form->flags & OPCODE_BRANCH) && (group == 0x6 || group == 0x7 || group == 0x8 || group == 0xC);
+    bool data = !(form->flags & OPCODE_BRANCH) && (group == 0xA || group == 0xD || group == 0xF);
+
+    //jp v0 keeps the optimizer from running at all
+    if(optimize && group == 0xB) return 0;
+
+    switch(mix){
+        case 1: return alu ? 8 : 1;
+        case 2: return branch ? 8 : 1;
+        case 3: return data ? 4 : 1;
+        default: return 1;
+    }
+}
+
+//Helper function to pick a form by the weights of the mix
+static const opcodeEntry *pickForm(uint64_t *state, int mix, unsigned total){
+    unsigned pick = randomBelow(state, total);
+    for(int i = 0; i < opcodeCount; i++){
+        unsigned weight = formWeight(&opcodeTable[i], mix);
+        if(pick < weight) return &opcodeTable[i];
+        pick -= weight;
+    }
+    return &opcodeTable[opcodeCount - 1];
+}
+
+//Helper function to write one operand of a form
+static int writeOperand(char *out, unsigned char kind, uint64_t *state, unsigned labels){
+    switch(kind){
+        case OPERAND_REGISTER: return sprintf(out, "v%u", randomBelow(state, 16));
+        case OPERAND_V0: return sprintf(out, "v0");
+        case OPERAND_BYTE:
+            if(randomBelow(state, 4) == 0) return sprintf(out, "c%u + %u", randomBelow(state, CONSTANTS), randomBelow(state, 100));
+            return sprintf(out, "%u", randomBelow(state, 256));
+        case OPERAND_ADDR: return sprintf(out, "l%u", randomBelow(state, labels));
+        case OPERAND_NIBBLE: return sprintf(out, "%u", 1 + randomBelow(state, 15));
+        case OPERAND_I: return sprintf(out, "i");
+        case OPERAND_DT: return sprintf(out, "dt");
+        case OPERAND_ST: return sprintf(out, "st");
+        case OPERAND_K: return sprintf(out, "k");
+        case OPERAND_F: return sprintf(out, "f");
+        case OPERAND_B: return sprintf(out, "b");
+        case OPERAND_MEMORY: return sprintf(out, "[i]");
+        default: return 0;
+    }
+}
+
+//Helper function to generate one program of up to count instruction and data
+//lines into out. Returns its size and adds its lines to *lines.
+static size_t generateProgram(uint64_t *state, const benchCase *c, size_t count, char *out, size_t *lines){
+    unsigned total = 0;
+    for(int i = 0; i < opcodeCount; i++) total += formWeight(&opcodeTable[i], c->mix);
+
+    //Anchor points are spread evenly, so references can go to any of them
+    unsigned labels = c->labels * count + 0.5;
+    if(labels == 0) labels = 1;
+
+    size_t size = 0;
+    for(int i = 0; i < CONSTANTS; i++) size += sprintf(out + size, "c%d equ %u\n", i, randomBelow(state, 100));
+    *lines += CONSTANTS;
+
+    unsigned nextLabel = 0;
+    size_t bytes = 0;
+    for(size_t j = 0; j < count && bytes < UNIT_BYTES; j++){
+        while(nextLabel < labels && (size_t)nextLabel * count / labels <= j){
+            size += sprintf(out + size, ".l%u\n", nextLabel++);
+            (*lines)++;
+        }
+
+        //The data mix has db and dw lines between its instructions
+        if(c->mix == 3 && randomBelow(state, 10) < 3){
+            unsigned n = 1 + randomBelow(state, 4);
+            bool words = randomBelow(state, 4) == 0;
+            size += sprintf(out + size, words ? "dw" : "db");
+            for(unsigned k = 0; k < n; k++) size += sprintf(out + size, "%s%u", k ? ", " : " ", randomBelow(state, words ? 65536 : 256));
+            out[size++] = '\n';
+            bytes += words ? 2 * n : n;
+        }
+        else{
+            const opcodeEntry *form = pickForm(state, c->mix, total);
+            size += sprintf(out + size, "%s", form->mnemonic);
+            for(int k = 0; k < form->operandCount; k++){
+                size += sprintf(out + size, k ? ", " : " ");
+                size += writeOperand(out + size, form->operands[k], state, labels);
+            }
+            out[size++] = '\n';
+            bytes += (bytes & 1) + 4;
+        }
+        (*lines)++;
+    }
+
+    //Anchor points a short program did not get to go at its end
+    while(nextLabel < labels){
+        size += sprintf(out + size, ".l%u\n", nextLabel++);
+        (*lines)++;
+    }
+    return size;
+}
+
+//Helper function to assemble the programs of a case and time them
+static void runCase(const benchCase *c, benchResult *r){
+    char *source = malloc(UNIT_SOURCE);
+    unsigned char *image = malloc(CHIP8_PROGRAM_SPACE);
+    if(source == NULL || image == NULL){fprintf(stderr, "Error: Out of memory. \n"); exit(1);}
+
+    chip8Options options;
+    chip8_default_options(&options);
+    chip8Stats stats;
+    options.stats = &stats;
+    options.optimize = optimize ? CHIP8_OPTIMIZE_ALL : 0;
+
+    memset(r, 0, sizeof(*r));
+    do{
+        //Every repeat assembles the same programs
+        uint64_t state = seed * 0x9E3779B97F4A7C15ull + c->lines * 31 + c->mix * 7 + (uint64_t)(c->labels * 1000) + 1;
+        size_t lines = 0;
+        while(lines < c->lines){
+            size_t count = c->lines - lines < UNIT_LINES ? c->lines - lines : UNIT_LINES;
+            size_t size = generateProgram(&state, c, count, source, &lines);
+
+            memset(&stats, 0, sizeof(stats));
+            chip8Diagnostics diagnostics = {0};
+            size_t imageSize;
+            double start = now();
+            int result = chip8_assemble(source, size, &options, image, CHIP8_PROGRAM_SPACE, &imageSize, &diagnostics);
+            r->seconds += now() - start;
+
+            if(result != CHIP8_OK && r->failed++ == 0){
+                for(size_t i = 0; i < diagnostics.count; i++){
+                    if(diagnostics.items[i].severity == CHIP8_ERROR) fprintf(stderr, "%s: line %i: %s\n", c->name, diagnostics.items[i].line, diagnostics.items[i].message);
+                }
+            }
+            chip8_free_diagnostics(&diagnostics);
+
+            r->tokenizeTime += stats.tokenizeTime;
+            r->encodeTime += stats.encodeTime;
+            r->resolveTime += stats.resolveTime;
+            r->optimizeTime += stats.optimizeTime;
+            r->outputTime += stats.outputTime;
+            r->bytes += size;
+            r->programs++;
+        }
+        r->lines += lines;
+    } while(r->seconds < MIN_SECONDS);
+
+    free(source);
+    free(image);
+}
+
+//Helper function to run a case in its own process, so its peak memory is its own.
+//Returns 0 on success.
+static int measureCase(const benchCase *c, benchResult *r){
+    int fds[2];
+    if(pipe(fds) != 0) return 1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) return 1;
+    if(pid == 0){
+        close(fds[0]);
+        runCase(c, r);
+        _exit(write(fds[1], r, sizeof(*r)) == sizeof(*r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) != pid || got != sizeof(*r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return 1;
+    r->peakKB = usage.ru_maxrss;
+    return 0;
+}
+
+//Helper function to read the cases of a --json run. Returns the number read, or -1 if the file can not be read.
+static int readBaseline(const char *path, baselineEntry *entries){
+    FILE *f = fopen(path, "r");
+    if(f == NULL) return -1;
+
+    int count = 0;
+    char line[1024];
+    while(count < MAX_BASELINE && fgets(line, sizeof(line), f)){
+        const char *name = strstr(line, "\"case\": \"");
+        const char *speed = strstr(line, "\"linesPerSecond\": ");
+        const char *peak = strstr(line, "\"peakKB\": ");
+        if(name == NULL || speed == NULL || peak == NULL) continue;
+
+        baselineEntry *e = &entries[count];
+        name += 9;
+        size_t length = strcspn(name, "\"");
+        if(length >= sizeof(e->name)) continue;
+        memcpy(e->name, name, length);
+        e->name[length] = '\0';
+        e->linesPerSecond = strtod(speed + 18, NULL);
+        e->peakKB = strtol(peak + 10, NULL, 10);
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+int main(int argc, char **argv){
+    size_t onlyLines = 0, maxLines = 10000000;
+    double onlyLabels = -1;
+    int onlyMix = -1;
+    bool json = false;
+    const char *baselinePath = NULL;
+    double threshold = 10;
+
+    for(int i = 1; i < argc; i++){
+        bool value = i + 1 < argc;
+        if(strcmp(argv[i], "--lines") == 0 && value) onlyLines = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--max-lines") == 0 && value) maxLines = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--labels") == 0 && value) onlyLabels = strtod(argv[++i], NULL);
+        else if(strcmp(argv[i], "--seed") == 0 && value) seed = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "--threshold") == 0 && value) threshold = strtod(argv[++i], NULL);
+        else if(strcmp(argv[i], "--baseline") == 0 && value) baselinePath = argv[++i];
+        else if(strcmp(argv[i], "--optimize") == 0) optimize = true;
+        else if(strcmp(argv[i], "--json") == 0) json = true;
+        else if(strcmp(argv[i], "--mix") == 0 && value){
+            i++;
+            for(int m = 0; m < MIXES; m++){
+                if(strcmp(argv[i], mixes[m]) == 0) onlyMix = m;
+            }
+            if(onlyMix == -1){fprintf(stderr, "Error: Unknown mix %s. \n", argv[i]); return 1;}
+        }
+        else{fprintf(stderr, "Error: Unknown option %s. \n", argv[i]); return 1;}
+    }
+    if(onlyLabels > 1 || (onlyLabels < 0 && onlyLabels != -1)){fprintf(stderr, "Error: --labels must be between 0 and 1. \n"); return 1;}
+
+    //Every line count, share of anchor points and mix asked for
+    benchCase cases[MAX_CASES];
+    int caseCount = 0;
+    for(size_t lines = onlyLines ? onlyLines : 1000; lines <= (onlyLines ? onlyLines : maxLines); lines *= 10){
+        for(int l = 0; l < 2; l++){
+            if(onlyLabels != -1 && l > 0) break;
+            for(int m = 0; m < MIXES; m++){
+                if((onlyMix != -1 && m != onlyMix) || caseCount == MAX_CASES) continue;
+                benchCase *c = &cases[caseCount++];
+                c->lines = lines;
+                c->labels = onlyLabels != -1 ? onlyLabels : labelShares[l];
+                c->mix = m;
+                snprintf(c->name, sizeof(c->name), "lines=%zu labels=%.2f mix=%s%s", lines, c->labels, mixes[m], optimize ? " optimize" : "");
+            }
+        }
+        if(lines > maxLines / 10 && !onlyLines) break;
+    }
+
+    baselineEntry baseline[MAX_BASELINE];
+    int baselineCount = 0;
+    if(baselinePath != NULL && (baselineCount = readBaseline(baselinePath, baseline)) < 0){
+        fprintf(stderr, "Error: Could not read %s. \n", baselinePath);
+        return 1;
+    }
+
+    if(json) printf("[\n");
+    else printf("%-44s %12s %9s %9s %9s %9s %9s %9s\n", "case", "lines/s", "tokenize", "encode", "resolve", "optimize", "output", "peak KB");
+
+    int regressions = 0, failures = 0;
+    for(int i = 0; i < caseCount; i++){
+        const benchCase *c = &cases[i];
+        benchResult r;
+        if(measureCase(c, &r) != 0){
+            fprintf(stderr, "%s: the benchmark process failed\n", c->name);
+            failures++;
+            continue;
+        }
+        if(r.failed > 0){
+            fprintf(stderr, "%s: %zu of %zu programs did not assemble\n", c->name, r.failed, r.programs);
+            failures++;
+        }
+
+        //Phases are shown as a share of the time in the assembler
+        double speed = r.lines / r.seconds;
+        if(json){
+            printf("  {\"case\": \"%s\", \"lines\": %zu, \"bytes\": %zu, \"programs\": %zu, \"seconds\": %.6f, \"linesPerSecond\": %.0f, ",
+                   c->name, r.lines, r.bytes, r.programs, r.seconds, speed);
+            printf("\"tokenize\": %.6f, \"encode\": %.6f, \"resolve\": %.6f, \"optimize\": %.6f, \"output\": %.6f, \"peakKB\": %ld}%s\n",
+                   r.tokenizeTime, r.encodeTime, r.resolveTime, r.optimizeTime, r.outputTime, r.peakKB, i + 1 < caseCount ? "," : "");
+        }
+        else{
+            printf("%-44s %12.0f %8.1f%% %8.1f%% %8.1f%% %8.1f%% %8.1f%% %9ld\n", c->name, speed,
+                   100 * r.tokenizeTime / r.seconds, 100 * r.encodeTime / r.seconds, 100 * r.resolveTime / r.seconds,
+                   100 * r.optimizeTime / r.seconds, 100 * r.outputTime / r.seconds, r.peakKB);
+        }
+
+        for(int b = 0; b < baselineCount; b++){
+            if(strcmp(baseline[b].name, c->name) != 0) continue;
+            double slower = 100 * (1 - speed / baseline[b].linesPerSecond);
+            double larger = 100.0 * (r.peakKB - baseline[b].peakKB) / baseline[b].peakKB;
+            if(slower > threshold){
+                fprintf(stderr, "%s: %.1f%% slower than the baseline (%.0f lines/s, was %.0f)\n", c->name, slower, speed, baseline[b].linesPerSecond);
+                regressions++;
+            }
+            if(larger > threshold){
+                fprintf(stderr, "%s: %.1f%% more memory than the baseline (%ld KB, was %ld)\n", c->name, larger, r.peakKB, baseline[b].peakKB);
+                regressions++;
+            }
+        }
+    }
+    if(json) printf("]\n");
+
+    if(baselinePath != NULL) fprintf(stderr, "%d regressions over %.1f%% against %s\n", regressions, threshold, baselinePath);
+    return regressions > 0 || failures > 0;
+}
@@ -0,0 +1,159 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//Benchmark for mnemonic dispatch.
+//Generates a synthetic program with a uniform mix of every instruction form
+//and reports how many lines per second are dispatched to their opcode
+//template, first with the strcmp chain the assembler used to have and then
+//with the opcode table.
+//
+//Build: gcc -O2 -I. -o dispatch_bench bench/dispatch_bench.c opcodes.c symtab.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "opcodes.h"
+
+#define LINES 1000000
+
+//One instruction line split into words
+typedef struct{
+    char words[4][8];
+    size_t lengths[4];
+    int count;
+} line;
+
+static const char *samples[] = {
+    "cls", "ret", "jp 100", "jp v0 100", "call 100", "se v1 5", "se v1 v2",
+    "sne v1 5", "sne v1 v2", "ld v1 v2", "ld v1 dt", "ld v1 k", "ld v1 [i]",
+    "ld v1 5", "ld i v1", "ld i 100", "ld dt v1", "ld st v1", "ld f v1",
+    "ld b v1", "ld [i] v1", "add v1 v2", "add v1 5", "add i v1", "or v1 v2",
+    "and v1 v2", "xor v1 v2", "sub v1 v2", "shr v1", "subn v1 v2", "shl v1",
+    "rnd v1 5", "drw v1 v2 5", "skp v1", "sknp v1",
+};
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//The mnemonic and operand form tests of the old if/else chain in main
+static unsigned short legacyDispatch(const line *l){
+    const char *w = l->words[0];
+    const char *a = l->words[1];
+    const char *b = l->words[2];
+
+    if(strcmp("sys", w) == 0) return 0;
+    else if(strcmp("cls", w) == 0) return 0x00E0;
+    else if(strcmp("ret", w) == 0) return 0x00EE;
+    else if(strcmp("jp", w) == 0) return a[0] == 'v' ? 0xB000 : 0x1000;
+    else if(strcmp("call", w) == 0) return 0x2000;
+    else if(strcmp("se", w) == 0) return b[0] == 'v' ? 0x5000 : 0x3000;
+    else if(strcmp("sne", w) == 0) return b[0] == 'v' ? 0x9000 : 0x4000;
+    else if(strcmp("ld", w) == 0){
+        if(a[0] == 'v'){
+            if(b[0] == 'v') return 0x8000;
+            else if(strcmp(b, "dt") == 0) return 0xF007;
+            else if(strcmp(b, "k") == 0) return 0xF00A;
+            else if(strcmp(b, "[i]") == 0) return 0xF041;
+            else return 0x6000;
+        }
+        else if(a[0] == 'i') return b[0] == 'v' ? 0xF030 : 0xA000;
+        else if(strcmp(a, "dt") == 0) return 0xF00F;
+        else if(strcmp(a, "st") == 0) return 0xF012;
+        else if(a[0] == 'f') return 0xF01D;
+        else if(a[0] == 'b') return 0xF021;
+        else if(strcmp(a, "[i]") == 0) return 0xF037;
+    }
+    else if(strcmp("add", w) == 0){
+        if(a[0] == 'v') return b[0] == 'v' ? 0x8004 : 0x7000;
+        else return 0xF01E;
+    }
+    else if(strcmp("or", w) == 0) return 0x8001;
+    else if(strcmp("and", w) == 0) return 0x8002;
+    else if(strcmp("xor", w) == 0) return 0x8003;
+    else if(strcmp("sub", w) == 0) return 0x8005;
+    else if(strcmp("shr", w) == 0) return 0x8006;
+    else if(strcmp("subn", w) == 0) return 0x8007;
+    else if(strcmp("shl", w) == 0) return 0x800E;
+    else if(strcmp("rnd", w) == 0) return 0xC000;
+    else if(strcmp("drw", w) == 0) return 0xD000;
+    else if(strcmp("skp", w) == 0) return 0xE09E;
+    else if(strcmp("sknp", w) == 0) return 0xE0A1;
+    return 0xFFFF;
+}
+
+//The opcode table lookup used by the assembler
+static unsigned short tableDispatch(const line *l){
+    const opcodeEntry *entry = findMnemonic(l->words[0], l->lengths[0]);
+    if(entry == NULL) return 0xFFFF;
+
+    operandKind kinds[3];
+    for(int i = 1; i < l->count; i++) kinds[i - 1] = classifyOperand(l->words[i], l->lengths[i]);
+
+    const opcodeEntry *form = matchOperands(entry, kinds, l->count - 1);
+    return form ? form->opcode : 0xFFFF;
+}
+
+int main(void){
+    if(initOpcodeTable() != 0){printf("Error: Out of memory. \n"); return 1;}
+
+    int sampleCount = sizeof(samples) / sizeof(samples[0]);
+    line *lines = calloc(LINES, sizeof(line));
+    if(lines == NULL){printf("Error: Out of memory. \n"); return 1;}
+
+    //Split the generated lines up front so only the dispatch is timed
+    unsigned seed = 12345;
+    for(int i = 0; i < LINES; i++){
+        seed = seed * 1103515245 + 12345;
+        char text[32];
+        strcpy(text, samples[(seed >> 8) % sampleCount]);
+
+        for(char *w = strtok(text, " "); w; w = strtok(NULL, " ")){
+            line *l = &lines[i];
+            strcpy(l->words[l->count], w);
+            l->lengths[l->count] = strlen(w);
+            l->count++;
+        }
+    }
+
+    unsigned long checksum = 0;
+    double start = now();
+    for(int i = 0; i < LINES; i++) checksum += legacyDispatch(&lines[i]);
+    double legacyTime = now() - start;
+
+    unsigned long tableChecksum = 0;
+    start = now();
+    for(int i = 0; i < LINES; i++) tableChecksum += tableDispatch(&lines[i]);
+    double tableTime = now() - start;
+
+    printf("strcmp chain: %12.0f lines/s\n", LINES / legacyTime);
+    printf("opcode table: %12.0f lines/s\n", LINES / tableTime);
+    if(checksum != tableChecksum) printf("Warning: dispatchers disagree (%lu vs %lu)\n", checksum, tableChecksum);
+
+    free(lines);
+    return 0;
+}
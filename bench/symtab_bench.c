@@ -0,0 +1,83 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//Benchmark for the anchorpoint table.
+//Builds tables of 10 to 1,000,000 labels and measures the average cost of a
+//lookup in each. With a hashed table the cost per lookup should stay flat.
+//
+//Build: gcc -O2 -I. -o symtab_bench bench/symtab_bench.c symtab.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "symtab.h"
+
+#define LOOKUPS 2000000
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void){
+    printf("%10s %14s %14s\n", "labels", "insert ns/op", "lookup ns/op");
+
+    for(int count = 10; count <= 1000000; count *= 10){
+        anchorPointList *a = newAnchorPointList();
+        if(a == NULL){printf("Error: Out of memory. \n"); return 1;}
+
+        char name[32];
+        double start = now();
+        for(int i = 0; i < count; i++){
+            int length = snprintf(name, sizeof(name), "label_%d", i);
+            if(addAnchorPoint(a, name, length, i) != ANCHOR_OK){printf("Error: Insert failed. \n"); return 1;}
+        }
+        double insertTime = now() - start;
+
+        //Pregenerate the names so only the lookups are timed
+        char (*names)[32] = malloc(sizeof(*names) * 1024);
+        int lengths[1024];
+        unsigned seed = 12345;
+        for(int i = 0; i < 1024; i++){
+            seed = seed * 1103515245 + 12345;
+            lengths[i] = snprintf(names[i], 32, "label_%u", (seed >> 8) % count);
+        }
+
+        long long checksum = 0;
+        start = now();
+        for(int i = 0; i < LOOKUPS; i++){
+            checksum += getPCFromAnchorpoint(names[i & 1023], lengths[i & 1023], a);
+        }
+        double lookupTime = now() - start;
+
+        printf("%10d %14.1f %14.1f   (checksum %lld)\n", count, insertTime * 1e9 / count, lookupTime * 1e9 / LOOKUPS, checksum);
+
+        free(names);
+        freeAnchorPointList(a);
+    }
+
+    return 0;
+}
@@ -0,0 +1,304 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+//Bump whenever what a line assembles to changes, so old caches are discarded
+#define CACHE_MAGIC "C8CACHE"
+#define CACHE_VERSION 3
+
+//A cached line. Its text is kept in the cache's text buffer and compared on
+//every hit, so names can be stored as an offset into the line.
+typedef struct{
+    uint64_t hash;
+    uint32_t textOffset;
+    uint32_t lineLength;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint16_t opcode;
+    uint16_t max;
+    uint8_t kind;
+    uint8_t padding[3];
+    uint32_t run;
+} cacheRecord;
+
+//Records are kept in an array and found through an open-addressed table of
+//indices. A slot holding 0 is empty, otherwise it holds index + 1.
+struct chip8Cache{
+    cacheRecord *records;
+    size_t count;
+    size_t capacity;
+
+    uint32_t *slots;
+    size_t slotCapacity;
+
+    char *text;
+    size_t textSize;
+    size_t textCapacity;
+
+    uint32_t run;
+};
+
+
+uint64_t hashLine(const char *text, size_t length){
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ length;
+    size_t i = 0;
+
+    //Eight bytes at a time, then the tail
+    for(; i + 8 <= length; i += 8){
+        uint64_t word;
+        memcpy(&word, text + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    for(; i < length; i++){
+        h = (h ^ (unsigned char)text[i]) * 0x100000001B3ull;
+    }
+
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 32;
+    return h;
+}
+
+
+//Helper function to insert a record index into the slot table
+static void insertSlot(chip8Cache *cache, size_t index){
+    size_t mask = cache->slotCapacity - 1;
+    size_t i = cache->records[index].hash & mask;
+    while(cache->slots[i] != 0) i = (i + 1) & mask;
+    cache->slots[i] = index + 1;
+}
+
+
+//Helper function to double the slot table and reinsert every record
+static int growSlots(chip8Cache *cache){
+    size_t newCapacity = cache->slotCapacity ? cache->slotCapacity * 2 : 1024;
+    uint32_t *slots = calloc(newCapacity, sizeof(uint32_t));
+    if(slots == NULL) return 1;
+
+    free(cache->slots);
+    cache->slots = slots;
+    cache->slotCapacity = newCapacity;
+    for(size_t i = 0; i < cache->count; i++) insertSlot(cache, i);
+    return 0;
+}
+
+
+chip8Cache *chip8_cache_create(void){
+    chip8Cache *cache = calloc(1, sizeof(chip8Cache));
+    if(cache == NULL) return NULL;
+
+    if(growSlots(cache) != 0){
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+
+void chip8_cache_free(chip8Cache *cache){
+    if(cache == NULL) return;
+    free(cache->records);
+    free(cache->slots);
+    free(cache->text);
+    free(cache);
+}
+
+
+void beginCacheRun(chip8Cache *cache){
+    cache->run++;
+}
+
+
+bool findCachedLine(chip8Cache *cache, uint64_t hash, const char *text, size_t length, lineResult *r){
+    size_t mask = cache->slotCapacity - 1;
+
+    for(size_t i = hash & mask; cache->slots[i] != 0; i = (i + 1) & mask){
+        cacheRecord *record = &cache->records[cache->slots[i] - 1];
+        if(record->hash != hash || record->lineLength != length) continue;
+        if(memcmp(cache->text + record->textOffset, text, length) != 0) continue;
+
+        record->run = cache->run;
+        r->kind = record->kind;
+        r->opcode = record->opcode;
+        r->max = record->max;
+        r->name = text + record->nameOffset;
+        r->length = record->nameLength;
+        r->data = NULL;
+        r->size = 0;
+        r->value = NULL;
+        r->valueLength = 0;
+        r->registers[0] = r->registers[1] = 0;
+        r->address = 0;
+        return true;
+    }
+    return false;
+}
+
+
+int cacheLine(chip8Cache *cache, uint64_t hash, const char *text, size_t length, const lineResult *r){
+    if((cache->count + 1) * 2 > cache->slotCapacity && growSlots(cache) != 0) return 1;
+
+    if(cache->count == cache->capacity){
+        size_t newCapacity = cache->capacity ? cache->capacity * 2 : 1024;
+        cacheRecord *temp = realloc(cache->records, newCapacity * sizeof(cacheRecord));
+        if(temp == NULL) return 1;
+        cache->records = temp;
+        cache->capacity = newCapacity;
+    }
+
+    if(cache->textSize + length > UINT32_MAX) return 1;
+    if(cache->textSize + length > cache->textCapacity){
+        size_t newCapacity = cache->textCapacity ? cache->textCapacity : 65536;
+        while(cache->textSize + length > newCapacity) newCapacity *= 2;
+        char *temp = realloc(cache->text, newCapacity);
+        if(temp == NULL) return 1;
+        cache->text = temp;
+        cache->textCapacity = newCapacity;
+    }
+
+    cacheRecord *record = &cache->records[cache->count];
+    memset(record, 0, sizeof(*record));
+    record->hash = hash;
+    record->textOffset = cache->textSize;
+    record->lineLength = length;
+    record->nameOffset = r->name ? r->name - text : 0;
+    record->nameLength = r->length;
+    record->opcode = r->opcode;
+    record->max = r->max;
+    record->kind = r->kind;
+    record->run = cache->run;
+    memcpy(cache->text + cache->textSize, text, length);
+    cache->textSize += length;
+
+    insertSlot(cache, cache->count);
+    cache->count++;
+    return 0;
+}
+
+
+chip8Cache *chip8_cache_load(const char *path){
+    chip8Cache *cache = chip8_cache_create();
+    if(cache == NULL) return NULL;
+
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) return cache;
+
+    //Header is the magic, the version, the number of records and the size of
+    //the text that follows them
+    char magic[8];
+    uint32_t version, count, textSize;
+    bool valid = fread(magic, 1, 8, f) == 8 && memcmp(magic, CACHE_MAGIC, 8) == 0
+              && fread(&version, sizeof(version), 1, f) == 1 && version == CACHE_VERSION
+              && fread(&count, sizeof(count), 1, f) == 1
+              && fread(&textSize, sizeof(textSize), 1, f) == 1;
+
+    if(valid && count > 0){
+        cache->records = malloc(count * sizeof(cacheRecord));
+        cache->text = malloc(textSize ? textSize : 1);
+        valid = cache->records != NULL && cache->text != NULL
+             && fread(cache->records, sizeof(cacheRecord), count, f) == count
+             && fread(cache->text, 1, textSize, f) == textSize;
+
+        //A record pointing outside the text means the file is damaged
+        for(size_t i = 0; i < count && valid; i++){
+            if(cache->records[i].textOffset > textSize || cache->records[i].lineLength > textSize - cache->records[i].textOffset) valid = false;
+        }
+
+        size_t slotCapacity = cache->slotCapacity;
+        while(count * 2 > slotCapacity) slotCapacity *= 2;
+        uint32_t *slots = valid ? calloc(slotCapacity, sizeof(uint32_t)) : NULL;
+
+        if(slots != NULL){
+            free(cache->slots);
+            cache->slots = slots;
+            cache->slotCapacity = slotCapacity;
+            cache->count = count;
+            cache->capacity = count;
+            cache->textSize = textSize;
+            cache->textCapacity = textSize ? textSize : 1;
+
+            for(size_t i = 0; i < cache->count; i++){
+                cache->records[i].run = 0;
+                insertSlot(cache, i);
+            }
+        }
+        else if(valid){
+            fclose(f);
+            chip8_cache_free(cache);
+            return NULL;
+        }
+        else{
+            free(cache->records);
+            free(cache->text);
+            cache->records = NULL;
+            cache->text = NULL;
+        }
+    }
+
+    fclose(f);
+    return cache;
+}
+
+
+int chip8_cache_save(const chip8Cache *cache, const char *path){
+    FILE *f = fopen(path, "wb");
+    if(f == NULL) return 1;
+
+    uint32_t version = CACHE_VERSION;
+    uint32_t count = 0;
+    uint32_t textSize = 0;
+    for(size_t i = 0; i < cache->count; i++){
+        if(cache->records[i].run != cache->run) continue;
+        count++;
+        textSize += cache->records[i].lineLength;
+    }
+
+    int result = 0;
+    if(fwrite(CACHE_MAGIC, 1, 8, f) != 8 || fwrite(&version, sizeof(version), 1, f) != 1 || fwrite(&count, sizeof(count), 1, f) != 1
+    || fwrite(&textSize, sizeof(textSize), 1, f) != 1) result = 1;
+
+    //Only the lines of the latest run are kept, so the cache does not grow forever.
+    //Their text is written packed after the records, so the offsets are redone.
+    uint32_t textOffset = 0;
+    for(size_t i = 0; i < cache->count && result == 0; i++){
+        if(cache->records[i].run != cache->run) continue;
+        cacheRecord record = cache->records[i];
+        record.textOffset = textOffset;
+        textOffset += record.lineLength;
+        if(fwrite(&record, sizeof(cacheRecord), 1, f) != 1) result = 1;
+    }
+    for(size_t i = 0; i < cache->count && result == 0; i++){
+        const cacheRecord *record = &cache->records[i];
+        if(record->run != cache->run) continue;
+        if(fwrite(cache->text + record->textOffset, 1, record->lineLength, f) != record->lineLength) result = 1;
+    }
+
+    if(fclose(f) != 0) result = 1;
+    return result;
+}
@@ -0,0 +1,158 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "cfg.h"
+
+
+bool isSkipOpcode(unsigned short opcode){
+    switch(opcode & 0xF000){
+        case 0x3000:
+        case 0x4000:
+        case 0x5000:
+        case 0x9000:
+            return true;
+        case 0xE000:
+            return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+        default:
+            return false;
+    }
+}
+
+
+unsigned short invertSkip(unsigned short opcode){
+    switch(opcode & 0xF000){
+        case 0x3000: return (opcode & 0x0FFF) | 0x4000;
+        case 0x4000: return (opcode & 0x0FFF) | 0x3000;
+        case 0x5000: return (opcode & 0x0FFF) | 0x9000;
+        case 0x9000: return (opcode & 0x0FFF) | 0x5000;
+        default: return (opcode & 0xFF00) | ((opcode & 0xFF) == 0x9E ? 0xA1 : 0x9E);
+    }
+}
+
+
+int jumpTarget(const instruction *ins, size_t size){
+    unsigned short group = ins->opcode & 0xF000;
+    if(group != 0x1000 && group != 0x2000) return -1;
+
+    int target = ins->max > 0 ? ins->target : -1;
+    if(target < 0 || (size_t)target >= size) return -1;
+    return target;
+}
+
+
+int buildControlFlowGraph(const instruction *code, size_t size, controlFlowGraph *g){
+    g->blocks = NULL;
+    g->count = 0;
+    g->blockOf = malloc((size + 1) * sizeof(int));
+    bool *leader = calloc(size + 1, sizeof(bool));
+    if(g->blockOf == NULL || leader == NULL){
+        free(leader);
+        freeControlFlowGraph(g);
+        return 1;
+    }
+
+    //Mark where blocks start, and count them
+    leader[0] = true;
+    for(size_t i = 0; i < size; i++){
+        const instruction *ins = &code[i];
+        unsigned short group = ins->opcode & 0xF000;
+        if(i > 0 && ins->section != code[i - 1].section) leader[i] = true;
+
+        //Anything an anchor point or a numbered jump points to can be reached from elsewhere
+        if(ins->target >= 0) leader[ins->target] = true;
+        int target = jumpTarget(ins, size);
+        if(target >= 0) leader[target] = true;
+
+        if(group == 0x1000 || group == 0x2000 || group == 0xB000 || ins->opcode == 0x00EE) leader[i + 1] = true;
+        else if(isSkipOpcode(ins->opcode)){
+            leader[i + 1] = true;
+            if(i + 2 <= size) leader[i + 2] = true;
+        }
+    }
+    for(size_t i = 0; i < size; i++){
+        if(leader[i]) g->count++;
+    }
+
+    g->blocks = malloc((g->count ? g->count : 1) * sizeof(basicBlock));
+    if(g->blocks == NULL){
+        free(leader);
+        freeControlFlowGraph(g);
+        return 1;
+    }
+
+    //Split the program at the leaders
+    int block = -1;
+    for(size_t i = 0; i < size; i++){
+        if(leader[i]){
+            block++;
+            g->blocks[block].first = i;
+        }
+        g->blocks[block].end = i + 1;
+        g->blockOf[i] = block;
+    }
+    g->blockOf[size] = -1;
+    free(leader);
+
+    //Connect each block to the ones it can run next
+    for(size_t b = 0; b < g->count; b++){
+        basicBlock *bb = &g->blocks[b];
+        const instruction *last = &code[bb->end - 1];
+        unsigned short group = last->opcode & 0xF000;
+        int target = jumpTarget(last, size);
+
+        //Sections can be placed anywhere, so code never runs on into the next one
+        bool sectionEnds = (size_t)bb->end == size || code[bb->end].section != last->section;
+        bb->next = sectionEnds ? -1 : g->blockOf[bb->end];
+        bb->branch = -1;
+        bb->exit = BLOCK_FALLS;
+
+        if(last->opcode == 0x00EE) bb->exit = BLOCK_RETURNS;
+        else if(group == 0xB000) bb->exit = BLOCK_UNKNOWN;
+        else if(group == 0x1000 || group == 0x2000){
+            if(target < 0) bb->exit = BLOCK_UNKNOWN;
+            else{
+                bb->exit = group == 0x1000 ? BLOCK_JUMPS : BLOCK_CALLS;
+                bb->branch = g->blockOf[target];
+            }
+        }
+        else if(isSkipOpcode(last->opcode)){
+            bb->exit = BLOCK_SKIPS;
+            size_t landing = bb->end + 1;
+            bb->branch = landing < size && code[landing].section == last->section ? g->blockOf[landing] : -1;
+        }
+    }
+    return 0;
+}
+
+
+void freeControlFlowGraph(controlFlowGraph *g){
+    free(g->blocks);
+    free(g->blockOf);
+    g->blocks = NULL;
+    g->blockOf = NULL;
+    g->count = 0;
+}
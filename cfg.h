@@ -0,0 +1,74 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Control flow graph of the instruction list. Blocks start at the first
+//instruction, at every instruction an anchor point reference points to, at
+//the start of every section, and after every jump, skip, call and return.
+
+#ifndef CFG_H
+#define CFG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "assembler.h"
+
+//How a block ends
+#define BLOCK_FALLS 0       //Runs into next, or off the end of its section if next is -1
+#define BLOCK_JUMPS 1       //jp to branch
+#define BLOCK_SKIPS 2       //next is the skipped instruction, branch is where a skip lands
+#define BLOCK_CALLS 3       //call to branch, which returns to next
+#define BLOCK_RETURNS 4     //ret
+#define BLOCK_UNKNOWN 5     //jp v0, or a jump outside the program
+
+typedef struct{
+    int first;              //First instruction
+    int end;                //One past the last instruction
+    int next;               //Block after this one in the program, -1 at the end
+    int branch;             //Block a jump, skip or call goes to, -1 if there is none
+    unsigned char exit;     //BLOCK_ value
+} basicBlock;
+
+typedef struct{
+    basicBlock *blocks;
+    size_t count;
+    int *blockOf;           //Block of each instruction
+} controlFlowGraph;
+
+//Get the instruction an opcode jumps or calls to, or -1 if it does not go to a
+//known instruction. A numbered address is only known once the program is laid
+//out, so it gives -1.
+int jumpTarget(const instruction *ins, size_t size);
+
+bool isSkipOpcode(unsigned short opcode);
+
+//Get the skip that skips when opcode, which must be a skip, would not
+unsigned short invertSkip(unsigned short opcode);
+
+//Build the graph of size instructions. Returns 0 on success, 1 if out of memory.
+int buildControlFlowGraph(const instruction *code, size_t size, controlFlowGraph *g);
+
+void freeControlFlowGraph(controlFlowGraph *g);
+
+#endif
@@ -0,0 +1,1078 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#include <time.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "assembler.h"
+#include "opcodes.h"
+#include "lexer.h"
+#include "cache.h"
+#include "optimize.h"
+#include "analyze.h"
+#include "directive.h"
+#include "expr.h"
+#include "macro.h"
+#include "debuginfo.h"
+#include "section.h"
+#include "regalloc.h"
+#include "profile.h"
+#include "pack.h"
+
+//Tokens kept for a line: a mnemonic and its operands, or a macro and its arguments
+#define LINE_TOKENS 16
+
+
+//Helper function to copy a message of length characters into a diagnostic.
+//One that is too long has its longest word, which is the name in any message
+//that long, cut in the middle, so the text around the name is kept.
+static void fitMessage(char *out, size_t capacity, const char *text, size_t length){
+    size_t start = 0, longest = 0;
+    for(size_t i = 0; i < length;){
+        size_t end = i;
+        while(end < length && text[end] != ' ') end++;
+        if(end - i > longest){
+            start = i;
+            longest = end - i;
+        }
+        i = end + 1;
+    }
+
+    size_t excess = length + 1 > capacity ? length + 1 - capacity : 0;
+    if(excess == 0 || longest < excess + 5){
+        snprintf(out, capacity, "%.*s", (int)length, text);
+        return;
+    }
+
+    size_t keep = longest - excess - 3;
+    size_t head = (keep + 1) / 2, tail = keep / 2;
+    snprintf(out, capacity, "%.*s...%s", (int)(start + head), text, text + start + longest - tail);
+}
+
+
+//Helper function to add a diagnostic to the caller's list
+static void addDiagnostic(assembler *ctx, chip8Severity severity, const char *message, va_list args){
+    if(severity == CHIP8_ERROR) ctx->errors++;
+
+    chip8Diagnostics *d = ctx->diagnostics;
+    if(d == NULL) return;
+
+    if(d->count == d->capacity){
+        size_t newCapacity = d->capacity ? d->capacity * 2 : 16;
+        chip8Diagnostic *temp = realloc(d->items, newCapacity * sizeof(d->items[0]));
+        if(!temp){
+            ctx->outOfMemory = true;
+            return;
+        }
+        d->items = temp;
+        d->capacity = newCapacity;
+    }
+
+    chip8Diagnostic *item = &d->items[d->count++];
+    item->severity = severity;
+    item->line = ctx->line;
+
+    //The whole message is made first, however long a name in it is, so it can be cut to fit
+    char text[256];
+    va_list again;
+    va_copy(again, args);
+    int length = vsnprintf(text, sizeof(text), message, args);
+    char *full = length >= (int)sizeof(text) ? malloc(length + 1) : NULL;
+    if(full != NULL) vsnprintf(full, length + 1, message, again);
+    else if(length >= (int)sizeof(text)) length = sizeof(text) - 1;
+    va_end(again);
+
+    fitMessage(item->message, sizeof(item->message), full ? full : text, length > 0 ? length : 0);
+    free(full);
+    if(severity == CHIP8_ERROR) d->errors++;
+}
+
+
+//Helper function to report an error with a message and line count
+void error(assembler *ctx, const char *message, ...){
+    va_list args;
+    va_start(args, message);
+    addDiagnostic(ctx, CHIP8_ERROR, message, args);
+    va_end(args);
+}
+
+
+void warning(assembler *ctx, const char *message, ...){
+    va_list args;
+    va_start(args, message);
+    addDiagnostic(ctx, CHIP8_WARNING, message, args);
+    va_end(args);
+}
+
+
+void note(assembler *ctx, const char *message, ...){
+    va_list args;
+    va_start(args, message);
+    addDiagnostic(ctx, CHIP8_NOTE, message, args);
+    va_end(args);
+}
+
+
+//Helper function to get the time in seconds for the stats
+static double now(void){
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+//Helper function to see if a word is a number
+static bool isnumber(const char *word, size_t length){
+    if(length == 0) return false;
+    for(size_t i = 0; i < length; i++){
+        if(!isdigit((unsigned char)word[i])) return false;
+    }
+    return true;
+}
+
+
+//Helper function to convert a word that is known to be a number to an integer.
+//Values that are far too large saturate so range checks still catch them.
+static int wordToInt(const char *word, size_t length){
+    int value = 0;
+    for(size_t i = 0; i < length; i++){
+        if(value > 100000) return value;
+        value = value * 10 + (word[i] - '0');
+    }
+    return value;
+}
+
+
+unsigned char *allocateData(assembler *ctx, size_t size){
+    dataBlock *block = ctx->dataBlocks;
+    if(block == NULL || block->size - block->used < size){
+        size_t blockSize = size > 4096 ? size : 4096;
+        block = malloc(sizeof(dataBlock) + blockSize);
+        if(block == NULL) return NULL;
+        block->next = ctx->dataBlocks;
+        block->size = blockSize;
+        block->used = 0;
+        ctx->dataBlocks = block;
+    }
+
+    unsigned char *bytes = block->bytes + block->used;
+    block->used += size;
+    return bytes;
+}
+
+
+//Helper function to report a value that does not fit in its field
+static void rangeError(assembler *ctx, int max){
+    if(max == 4095) error(ctx, "Address must be between 0 and 4095");
+    else error(ctx, "Value must be between 0 and %i", max);
+}
+
+
+//Helper function to add bytes to the back of the program image
+static void emitBytes(assembler *ctx, const unsigned char *bytes, size_t size){
+    if(ctx->imageSize + size > CHIP8_PROGRAM_SPACE){
+        if(!ctx->overflowed) error(ctx, "Program does not fit in %i bytes", CHIP8_PROGRAM_SPACE);
+        ctx->overflowed = true;
+        return;
+    }
+    memcpy(ctx->image + ctx->imageSize, bytes, size);
+    ctx->imageSize += size;
+}
+
+
+//Helper function to add an opcode to the back of the program image, in the
+//byte order the host emulator expects. Data is always written as it is.
+static void emit(assembler *ctx, unsigned short opcode){
+    unsigned char bytes[2] = {opcode >> 8, opcode & 0xFF};
+    if(ctx->options->littleEndian){
+        bytes[0] = opcode & 0xFF;
+        bytes[1] = opcode >> 8;
+    }
+    emitBytes(ctx, bytes, 2);
+}
+
+
+void addInstruction(assembler *ctx, const lineResult *r){
+    if(ctx->codeSize == ctx->codeCapacity){
+        size_t newCapacity = ctx->codeCapacity ? ctx->codeCapacity * 2 : 256;
+        instruction *temp = realloc(ctx->code, newCapacity * sizeof(ctx->code[0]));
+        if(!temp){
+            ctx->outOfMemory = true;
+            return;
+        }
+        ctx->code = temp;
+        ctx->codeCapacity = newCapacity;
+    }
+
+    instruction *ins = &ctx->code[ctx->codeSize++];
+    ins->opcode = r->opcode;
+    ins->max = r->max;
+    ins->target = -1;
+    ins->line = ctx->line;
+    ins->section = ctx->currentSection;
+    ins->name = r->name;
+    ins->length = r->length;
+    ins->data = r->data;
+    ins->size = r->size;
+    ins->registers[0] = r->registers[0];
+    ins->registers[1] = r->registers[1];
+    ins->branch = false;
+}
+
+
+//Helper function to resolve every anchor point reference once all anchor points
+//and constants are known. Values that depend on where an anchor point ends up
+//are left for layout.
+static void resolveReferences(assembler *ctx){
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        instruction *ins = &ctx->code[i];
+        if(ins->max == 0 || ins->data != NULL) continue;
+        ctx->line = ins->line;
+
+        //A lone anchor point is followed through the passes that move instructions
+        int num = getPCFromAnchorpoint(ins->name, ins->length, ctx->anchors);
+        ctx->symbolLookups++;
+        if(num != -1){
+            if((size_t)num > i) ctx->forwardReferences++;
+            ins->target = num;
+            continue;
+        }
+
+        int value;
+        int result = evaluate(ctx, ins->name, ins->length, EVALUATE_RESOLVE, NULL, &value);
+        if(result == EXPRESSION_LATER) continue;
+        if(result == EXPRESSION_OK){
+            if(value < 0 || value > ins->max) rangeError(ctx, ins->max);
+            else ins->opcode |= value;
+        }
+        ins->max = 0;
+    }
+}
+
+
+//Helper function to write every instruction and piece of data into the image
+//at the address the layout gave it, with its anchor point filled in
+static void layout(assembler *ctx){
+    size_t *offsets = malloc((ctx->codeSize + 1) * sizeof(offsets[0]));
+    if(offsets == NULL){
+        ctx->outOfMemory = true;
+        return;
+    }
+    if(!placeSections(ctx, offsets, true)){
+        free(offsets);
+        return;
+    }
+    fillPackTable(ctx, offsets);
+
+    //The gaps the layout leaves are already zero
+    addressMap addresses = {offsets};
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        const instruction *ins = &ctx->code[i];
+        ctx->line = ins->line;
+        ctx->imageSize = offsets[i] - CHIP8_PROGRAM_START;
+
+        if(ins->data != NULL){
+            if(ins->max != 0) fillData(ctx, ins, &addresses);
+            emitBytes(ctx, ins->data, ins->size);
+            continue;
+        }
+
+        unsigned short opcode = ins->opcode;
+        if(ins->max != 0){
+            int address;
+            int result = EXPRESSION_OK;
+            if(ins->target >= 0) address = offsets[ins->target];
+            else result = evaluate(ctx, ins->name, ins->length, EVALUATE_LAYOUT, &addresses, &address);
+
+            if(result == EXPRESSION_OK){
+                if(address < 0 || address > ins->max) rangeError(ctx, ins->max);
+                else opcode |= address;
+            }
+        }
+        emit(ctx, opcode);
+    }
+    if(!ctx->overflowed) ctx->imageSize = offsets[ctx->codeSize] - CHIP8_PROGRAM_START;
+
+    if(ctx->options->debug && ctx->errors == 0 && !ctx->outOfMemory) collectDebugInfo(ctx, offsets);
+    free(offsets);
+}
+
+
+//Helper function to get the register number from a word in the format 'vx'
+static unsigned char getRegisterNumber(assembler *ctx, const char *str, size_t length){
+    if(length == 0 || tolower((unsigned char)str[0]) != 'v'){
+        error(ctx, "Expected register (vx)");
+        return 0;
+    }
+
+    if(!isnumber(str + 1, length - 1)){
+        error(ctx, "Expected register number");
+        return 0;
+    }
+
+    int addr = wordToInt(str + 1, length - 1);
+
+    if(addr < 0 || addr > 15){
+        error(ctx, "Register number must be between 0 and 15");
+        return 0;
+    }
+
+    return addr;
+}
+
+
+//Helper function to build an opcode from an instruction form and its operands.
+//A number is filled in straight away, an anchor point is left for applyLine.
+static void encode(assembler *ctx, const opcodeEntry *form, const token *operands, lineResult *r){
+    r->opcode = form->opcode;
+    int registerShift = 8;
+
+    for(int i = 0; i < form->operandCount; i++){
+        const char *text = ctx->source + operands[i].offset;
+        size_t length = operands[i].length;
+
+        switch(form->operands[i]){
+            case OPERAND_REGISTER:
+                //A virtual register is filled in once every register is given out
+                if(length > 0 && text[0] == '%'){
+                    if(form->opcode == 0xF037 || form->opcode == 0xF041) error(ctx, "Virtual register %.*s can not be used with [i]", (int)length, text);
+                    else r->registers[registerShift == 8 ? 0 : 1] = addVirtualRegister(ctx, text, length);
+                }
+                else r->opcode |= getRegisterNumber(ctx, text, length) << registerShift;
+                registerShift -= 4;
+                break;
+            case OPERAND_V0:
+                if(getRegisterNumber(ctx, text, length) != 0) error(ctx, "Expected register v0");
+                break;
+            case OPERAND_BYTE:
+            case OPERAND_ADDR:
+            case OPERAND_NIBBLE:{
+                //Anything with a name is worked out once every name is known,
+                //so the line still means the same when it comes from the cache
+                int max = operandMax(form->operands[i]);
+
+                //Where a branch jumps to is always left for its jp, and a value it
+                //compares with that is not known yet is kept apart from it
+                if((form->flags & OPCODE_BRANCH) && form->operands[i] == OPERAND_ADDR){
+                    r->max = max;
+                    r->name = text;
+                    r->length = length;
+                    break;
+                }
+
+                int value;
+                int result = evaluate(ctx, text, length, EVALUATE_LITERALS, NULL, &value);
+                if(result == EXPRESSION_LATER && (form->flags & OPCODE_BRANCH)){
+                    r->value = text;
+                    r->valueLength = length;
+                    break;
+                }
+                if(result == EXPRESSION_LATER){
+                    r->max = max;
+                    r->name = text;
+                    r->length = length;
+                    break;
+                }
+                if(result == EXPRESSION_ERROR) break;
+
+                if(value < 0 || value > max){
+                    rangeError(ctx, max);
+                    value = 0;
+                }
+                r->opcode |= value;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+
+//Helper function to work out what one line assembles to from its tokens.
+//Returns false if the line has errors.
+static bool parseLine(assembler *ctx, const token *tokens, int count, lineResult *r){
+    size_t errors = ctx->errors;
+    memset(r, 0, sizeof(*r));
+    if(count == 0) return true;
+
+    //The line is defining an anchor point
+    if(tokens[0].kind == TOKEN_ANCHOR){
+        const char *name = ctx->source + tokens[0].offset;
+        if(count > 1){
+            error(ctx, "Unexpected token after anchor point %.*s", (int)tokens[0].length, name);
+            return false;
+        }
+
+        r->kind = LINE_ANCHOR;
+        r->name = name;
+        r->length = tokens[0].length;
+        return true;
+    }
+
+    //name equ value defines a constant
+    if(count > 1 && wordIs(ctx->source + tokens[1].offset, tokens[1].length, "equ")){
+        if(count != 3){
+            error(ctx, "Expected name equ value");
+            return false;
+        }
+        r->kind = LINE_CONSTANT;
+        r->name = ctx->source + tokens[0].offset;
+        r->length = tokens[0].length;
+        r->value = ctx->source + tokens[2].offset;
+        r->valueLength = tokens[2].length;
+        return true;
+    }
+
+    const char *mnemonic = ctx->source + tokens[0].offset;
+    const opcodeEntry *entry = findMnemonic(mnemonic, tokens[0].length);
+    if(entry == NULL){
+        directiveHandler directive = findDirective(mnemonic, tokens[0].length);
+        if(directive != NULL) return directive(ctx, tokens[0], r) && ctx->errors == errors;
+
+        error(ctx, "Unexpected token %.*s", (int)tokens[0].length, mnemonic);
+        return false;
+    }
+
+    //SYS is in the instruction set, but the does not need an implementation 
+    if(entry->flags & OPCODE_IGNORED){
+        r->kind = LINE_IGNORED;
+        return true;
+    }
+
+    if(count > 4){
+        error(ctx, "Too many operands");
+        return false;
+    }
+
+    //Work out which form of the instruction the operands select
+    operandKind kinds[3];
+    for(int i = 1; i < count; i++){
+        kinds[i - 1] = classifyOperand(ctx->source + tokens[i].offset, tokens[i].length);
+    }
+
+    const opcodeEntry *form = matchOperands(entry, kinds, count - 1);
+    if(form == NULL){
+        error(ctx, "Invalid operands for %s", entry->mnemonic);
+        return false;
+    }
+
+    r->kind = form->flags & OPCODE_BRANCH ? LINE_BRANCH : LINE_INSTRUCTION;
+    encode(ctx, form, tokens + 1, r);
+    return ctx->errors == errors;
+}
+
+
+//Helper function to place a parsed line in the program
+static void applyLine(assembler *ctx, const lineResult *r){
+    switch(r->kind){
+        case LINE_ANCHOR:{
+            if(ctx->constantNames != NULL && getPCFromAnchorpoint(r->name, r->length, ctx->constantNames) != -1){
+                error(ctx, "%.*s is already a constant", (int)r->length, r->name);
+                break;
+            }
+            int result = addAnchorPoint(ctx->anchors, r->name, r->length, ctx->PC);
+            if(result == ANCHOR_DUPLICATE) error(ctx, "Anchor point %.*s is already defined", (int)r->length, r->name);
+            else if(result != ANCHOR_OK) ctx->outOfMemory = true;
+            break;
+        }
+        case LINE_IGNORED:
+            warning(ctx, "System call skipped");
+            break;
+        case LINE_CONSTANT:
+            defineConstant(ctx, r->name, r->length, r->value, r->valueLength);
+            break;
+        case LINE_SECTION:
+            beginSection(ctx, r);
+            break;
+        case LINE_PACKED:
+            addPackedBlock(ctx, r);
+            break;
+        case LINE_BRANCH:{
+            //The skip goes over the jp when the branch is not taken
+            lineResult skip = *r;
+            skip.kind = LINE_INSTRUCTION;
+            skip.max = r->value != NULL ? 255 : 0;
+            skip.name = r->value;
+            skip.length = r->valueLength;
+            applyLine(ctx, &skip);
+
+            lineResult jump = {0};
+            jump.kind = LINE_INSTRUCTION;
+            jump.opcode = 0x1000;
+            jump.max = r->max;
+            jump.name = r->name;
+            jump.length = r->length;
+            size_t index = ctx->codeSize;
+            applyLine(ctx, &jump);
+            if(ctx->codeSize > index) ctx->code[index].branch = true;
+            break;
+        }
+        case LINE_INSTRUCTION:
+        case LINE_DATA:{
+            size_t end = ctx->programSize + r->size;
+            if(r->kind == LINE_INSTRUCTION) end = ctx->programSize + (ctx->programSize & 1) + 2;
+
+            //Without optimization nothing can shrink the program, so running out
+            //of room is reported at the line that does not fit
+            if(!ctx->options->optimize && end > CHIP8_PROGRAM_SPACE){
+                if(!ctx->overflowed) error(ctx, "Program does not fit in %i bytes", CHIP8_PROGRAM_SPACE);
+                ctx->overflowed = true;
+                break;
+            }
+            addInstruction(ctx, r);
+            ctx->programSize = end;
+            ctx->PC++;
+            break;
+        }
+    }
+}
+
+
+//Helper function to read the tokens of one line, a word and then its operands.
+//Returns the number of tokens, which can be more than fit in tokens. last is
+//the token that ended the line.
+static int readLine(lexer *lex, token *tokens, token *last){
+    int count = 0;
+    token t = nextToken(lex);
+    while(t.kind != TOKEN_NEWLINE && t.kind != TOKEN_END){
+        if(count < LINE_TOKENS) tokens[count] = t;
+        count++;
+        t = nextExpression(lex);
+    }
+    *last = t;
+    return count;
+}
+
+
+static bool assembleLine(assembler *ctx, const token *tokens, int count, size_t start, size_t next, lineResult *r);
+
+
+//Helper function to assemble text that is not the source file, such as a macro
+//expansion. Its lines report the line the text came from.
+static void assembleText(assembler *ctx, const char *text, size_t size){
+    const char *source = ctx->source;
+    size_t sourceSize = ctx->sourceSize;
+    int line = ctx->line;
+    ctx->source = text;
+    ctx->sourceSize = size;
+
+    lexer lex;
+    initLexer(&lex, text, size);
+
+    token tokens[LINE_TOKENS];
+    token t;
+    do{
+        size_t start = lex.position;
+        int count = readLine(&lex, tokens, &t);
+        ctx->line = line;
+
+        lineResult r;
+        assembleLine(ctx, tokens, count, start, lex.position, &r);
+    } while(t.kind != TOKEN_END && !ctx->outOfMemory);
+
+    ctx->source = source;
+    ctx->sourceSize = sourceSize;
+    ctx->line = line;
+}
+
+
+//Helper function to assemble one line from its tokens. start is where the line
+//begins in the text and next is where the line after it begins. Returns true
+//if r holds what the line assembles to and it can be cached.
+static bool assembleLine(assembler *ctx, const token *tokens, int count, size_t start, size_t next, lineResult *r){
+    if(ctx->defining){
+        readMacroLine(ctx, tokens, count, start);
+        return false;
+    }
+
+    if(count > 0 && tokens[0].kind == TOKEN_WORD){
+        const char *word = ctx->source + tokens[0].offset;
+        size_t length = tokens[0].length;
+
+        if(wordIs(word, length, "macro")){
+            beginMacro(ctx, tokens, count, next);
+            return false;
+        }
+        if(wordIs(word, length, "endm")){
+            error(ctx, "endm without macro");
+            return false;
+        }
+
+        int index = findMacro(ctx, word, length);
+        if(index != -1){
+            size_t size;
+            const char *text = expandMacro(ctx, index, tokens + 1, count - 1, &size);
+            if(text == NULL) return false;
+
+            ctx->macroDepth++;
+            assembleText(ctx, text, size);
+            ctx->macroDepth--;
+            return false;
+        }
+    }
+
+    if(!parseLine(ctx, tokens, count, r)) return false;
+    applyLine(ctx, r);
+
+    //Data points into this run's memory, constants are looked up by name and
+    //sections and virtual registers by both, so all of them are read again every
+    //time. So are branches that compare with a name, the cache only keeps one.
+    if(r->registers[0] != 0 || r->registers[1] != 0 || r->value != NULL) return false;
+    return r->kind != LINE_DATA && r->kind != LINE_CONSTANT && r->kind != LINE_SECTION && r->kind != LINE_PACKED;
+}
+
+
+//Helper function to assemble the source one line at a time with the lexer
+static void assembleSource(assembler *ctx){
+    chip8Stats *stats = ctx->stats;
+    double last = stats ? now() : 0;
+
+    lexer lex;
+    initLexer(&lex, ctx->source, ctx->sourceSize);
+
+    token tokens[LINE_TOKENS];
+    token t;
+    do{
+        ctx->line = lex.line;
+
+        size_t start = lex.position;
+        int count = readLine(&lex, tokens, &t);
+
+        double lexed = stats ? now() : 0;
+
+        lineResult r;
+        assembleLine(ctx, tokens, count, start, lex.position, &r);
+
+        if(stats){
+            double encoded = now();
+            stats->tokenizeTime += lexed - last;
+            stats->encodeTime += encoded - lexed;
+            last = encoded;
+        }
+    } while(t.kind != TOKEN_END && !ctx->outOfMemory);
+}
+
+
+//Helper function to assemble the source reusing every line the cache has seen before.
+//Only new or edited lines go through the lexer, the rest are placed straight from the cache.
+static void assembleCached(assembler *ctx, chip8Cache *cache){
+    chip8Stats *stats = ctx->stats;
+    double last = stats ? now() : 0;
+
+    lexer lex;
+    initLexer(&lex, ctx->source, ctx->sourceSize);
+
+    size_t position = 0;
+    int line = 1;
+    while(position < ctx->sourceSize && !ctx->outOfMemory){
+        const char *start = ctx->source + position;
+        const char *newline = memchr(start, '\n', ctx->sourceSize - position);
+        size_t length = newline ? (size_t)(newline - start) : ctx->sourceSize - position;
+        ctx->line = line;
+
+        //Blank lines and comments are cheaper to skip than to look up
+        size_t first = 0;
+        while(first < length && (start[first] == ' ' || start[first] == '\t' || start[first] == '\r')) first++;
+        if(first == length || start[first] == ';'){
+            position += length + 1;
+            line++;
+            continue;
+        }
+
+        //Lines of a macro body are not assembled, so they are never looked up
+        uint64_t hash = ctx->defining ? 0 : hashLine(start, length);
+        lineResult r;
+        if(!ctx->defining && findCachedLine(cache, hash, start, length, &r)){
+            double found = stats ? now() : 0;
+            applyLine(ctx, &r);
+
+            if(stats){
+                double encoded = now();
+                stats->cachedLines++;
+                stats->tokenizeTime += found - last;
+                stats->encodeTime += encoded - found;
+                last = encoded;
+            }
+        }
+        else{
+            seekLexer(&lex, position, line);
+
+            token tokens[LINE_TOKENS];
+            token t;
+            int count = readLine(&lex, tokens, &t);
+
+            double lexed = stats ? now() : 0;
+
+            if(assembleLine(ctx, tokens, count, position, lex.position, &r) && cacheLine(cache, hash, start, length, &r) != 0){
+                ctx->outOfMemory = true;
+            }
+
+            if(stats){
+                double encoded = now();
+                stats->tokenizeTime += lexed - last;
+                stats->encodeTime += encoded - lexed;
+                last = encoded;
+            }
+        }
+
+        position += length + 1;
+        line++;
+    }
+}
+
+
+//Helper function to fill in the counts of the stats once the image is complete
+static void finishStats(assembler *ctx){
+    chip8Stats *stats = ctx->stats;
+
+    //A last line without a newline still counts
+    const char *text = ctx->source;
+    const char *end = ctx->source + ctx->sourceSize;
+    stats->lines = ctx->sourceSize > 0 && end[-1] != '\n';
+    while((text = memchr(text, '\n', end - text)) != NULL){
+        stats->lines++;
+        text++;
+    }
+    stats->instructions = 0;
+    stats->labels = ctx->anchors->size;
+    stats->symbolLookups = ctx->symbolLookups;
+    stats->forwardReferences = ctx->forwardReferences;
+    stats->bytesUsed = ctx->imageSize;
+
+    //Count the instructions by mnemonic. Data is not counted.
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        if(ctx->code[i].data != NULL) continue;
+        stats->instructions++;
+
+        const opcodeEntry *form = decodeOpcode(ctx->code[i].opcode);
+        if(form == NULL) continue;
+
+        size_t j = 0;
+        while(j < stats->mnemonicCount && strcmp(stats->mnemonics[j].mnemonic, form->mnemonic) != 0) j++;
+        if(j == stats->mnemonicCount){
+            if(j == CHIP8_STATS_MNEMONICS) continue;
+            stats->mnemonics[j].mnemonic = form->mnemonic;
+            stats->mnemonics[j].count = 0;
+            stats->mnemonicCount++;
+        }
+        stats->mnemonics[j].count++;
+    }
+}
+
+
+//Helper function to put the diagnostics from a later pass back in line order.
+//Every pass reports in increasing line order, so the two runs are merged.
+static void mergeDiagnostics(assembler *ctx, size_t first, size_t middle){
+    chip8Diagnostics *d = ctx->diagnostics;
+    if(d == NULL || middle == first || middle == d->count) return;
+
+    size_t count = d->count - first;
+    chip8Diagnostic *merged = malloc(count * sizeof(merged[0]));
+    if(merged == NULL) return;
+
+    size_t a = first, b = middle, out = 0;
+    while(a < middle || b < d->count){
+        if(b == d->count || (a < middle && d->items[a].line <= d->items[b].line)) merged[out++] = d->items[a++];
+        else merged[out++] = d->items[b++];
+    }
+
+    memcpy(d->items + first, merged, count * sizeof(merged[0]));
+    free(merged);
+}
+
+
+#ifndef _WIN32
+static pthread_once_t opcodeTableOnce = PTHREAD_ONCE_INIT;
+static int opcodeTableResult;
+
+static void initOpcodeTableOnce(void){
+    opcodeTableResult = initOpcodeTable();
+}
+#endif
+
+//Build the shared opcode index exactly once, even with several threads assembling
+int initShared(void){
+#ifndef _WIN32
+    pthread_once(&opcodeTableOnce, initOpcodeTableOnce);
+    return opcodeTableResult;
+#else
+    return initOpcodeTable();
+#endif
+}
+
+
+void chip8_default_options(chip8Options *options){
+    memset(options, 0, sizeof(*options));
+}
+
+
+int chip8_assemble(const char *src, size_t len, const chip8Options *options,
+                   unsigned char *output, size_t outputCapacity, size_t *outputSize,
+                   chip8Diagnostics *diagnostics){
+    chip8Options defaults;
+    if(options == NULL){
+        chip8_default_options(&defaults);
+        options = &defaults;
+    }
+    if(outputSize) *outputSize = 0;
+    if(options->loops) memset(options->loops, 0, sizeof(*options->loops));
+    if(options->debug) memset(options->debug, 0, sizeof(*options->debug));
+
+    if(initShared() != 0) return CHIP8_ERROR_MEMORY;
+
+    assembler *ctx = calloc(1, sizeof(assembler));
+    if(ctx == NULL) return CHIP8_ERROR_MEMORY;
+
+    ctx->options = options;
+    ctx->source = src;
+    ctx->sourceSize = len;
+    ctx->diagnostics = diagnostics;
+    ctx->stats = options->stats;
+    ctx->anchors = newAnchorPointList();
+
+    int result = CHIP8_OK;
+    if(ctx->anchors == NULL){
+        result = CHIP8_ERROR_MEMORY;
+        goto done;
+    }
+
+    size_t firstDiagnostic = diagnostics ? diagnostics->count : 0;
+
+    if(options->cache){
+        beginCacheRun(options->cache);
+        assembleCached(ctx, options->cache);
+    }
+    else assembleSource(ctx);
+    endMacros(ctx);
+    endSections(ctx);
+
+    //Resolve anchor points now that every one is known
+    size_t resolveDiagnostic = diagnostics ? diagnostics->count : 0;
+    double resolveStart = ctx->stats ? now() : 0;
+    resolveReferences(ctx);
+    if(ctx->stats) ctx->stats->resolveTime += now() - resolveStart;
+    mergeDiagnostics(ctx, firstDiagnostic, resolveDiagnostic);
+
+    //A branch is only as long as where it goes needs it to be, optimized or not
+    if(ctx->errors == 0 && !ctx->outOfMemory){
+        size_t branchDiagnostic = diagnostics ? diagnostics->count : 0;
+        double branchStart = ctx->stats ? now() : 0;
+        collapseBranches(ctx);
+        if(ctx->stats) ctx->stats->resolveTime += now() - branchStart;
+        mergeDiagnostics(ctx, firstDiagnostic, branchDiagnostic);
+    }
+
+    //Virtual registers are given out before the optimizer, which removes the
+    //copies that end up between the same register
+    if(ctx->virtualSize > 0 && ctx->errors == 0 && !ctx->outOfMemory){
+        size_t allocateDiagnostic = diagnostics ? diagnostics->count : 0;
+        double allocateStart = ctx->stats ? now() : 0;
+        allocateRegisters(ctx);
+        if(ctx->stats) ctx->stats->optimizeTime += now() - allocateStart;
+        mergeDiagnostics(ctx, firstDiagnostic, allocateDiagnostic);
+    }
+
+    //Only a program without errors is worth optimizing
+    if(options->optimize && ctx->errors == 0 && !ctx->outOfMemory){
+        size_t optimizeDiagnostic = diagnostics ? diagnostics->count : 0;
+        double optimizeStart = ctx->stats ? now() : 0;
+        optimize(ctx);
+        if(ctx->stats) ctx->stats->optimizeTime += now() - optimizeStart;
+        mergeDiagnostics(ctx, firstDiagnostic, optimizeDiagnostic);
+    }
+
+    //Packing adds the unpacker in front of the program, after the optimizer so
+    //it is left as it is written
+    if(ctx->packSize > 0 && ctx->errors == 0 && !ctx->outOfMemory){
+        size_t packDiagnostic = diagnostics ? diagnostics->count : 0;
+        double packStart = ctx->stats ? now() : 0;
+        packBlocks(ctx);
+        if(ctx->stats) ctx->stats->optimizeTime += now() - packStart;
+        mergeDiagnostics(ctx, firstDiagnostic, packDiagnostic);
+    }
+
+    //The profile gives addresses of the program as it is now, so it is used
+    //once nothing else will move instructions
+    if(options->profile && ctx->errors == 0 && !ctx->outOfMemory){
+        size_t profileDiagnostic = diagnostics ? diagnostics->count : 0;
+        double profileStart = ctx->stats ? now() : 0;
+        profileLayout(ctx);
+        if(ctx->stats) ctx->stats->optimizeTime += now() - profileStart;
+        mergeDiagnostics(ctx, firstDiagnostic, profileDiagnostic);
+    }
+
+    //The loop report describes the program as it is written to the image
+    if(options->loops && ctx->errors == 0 && !ctx->outOfMemory) analyzeLoops(ctx);
+
+    size_t layoutDiagnostic = diagnostics ? diagnostics->count : 0;
+    resolveStart = ctx->stats ? now() : 0;
+    layout(ctx);
+    if(ctx->stats) ctx->stats->resolveTime += now() - resolveStart;
+    mergeDiagnostics(ctx, firstDiagnostic, layoutDiagnostic);
+
+    //End byte
+    emit(ctx, 0xFFFF);
+    emit(ctx, 0xFFFF);
+
+    if(ctx->outOfMemory){
+        result = CHIP8_ERROR_MEMORY;
+        goto done;
+    }
+    if(ctx->errors > 0){
+        result = CHIP8_ERROR_SOURCE;
+        goto done;
+    }
+    if(ctx->imageSize > outputCapacity){
+        result = CHIP8_ERROR_OUTPUT;
+        goto done;
+    }
+
+    if(ctx->stats) finishStats(ctx);
+    double outputStart = ctx->stats ? now() : 0;
+
+    memcpy(output, ctx->image, ctx->imageSize);
+    if(outputSize) *outputSize = ctx->imageSize;
+    if(ctx->stats) ctx->stats->outputTime += now() - outputStart;
+
+done:
+    freeAnchorPointList(ctx->anchors);
+    freeAnchorPointList(ctx->constantNames);
+    freeAnchorPointList(ctx->macroNames);
+    freeAnchorPointList(ctx->registerNames);
+    free(ctx->constants);
+    free(ctx->virtuals);
+    free(ctx->macros);
+    free(ctx->sections);
+    free(ctx->packs);
+    free(ctx->code);
+    for(size_t i = 0; i < ctx->includeSize; i++) closeSource(&ctx->includes[i]);
+    free(ctx->includes);
+    while(ctx->dataBlocks != NULL){
+        dataBlock *next = ctx->dataBlocks->next;
+        free(ctx->dataBlocks);
+        ctx->dataBlocks = next;
+    }
+    free(ctx);
+    return result;
+}
+
+
+void chip8_add_stats(chip8Stats *total, const chip8Stats *run){
+    total->tokenizeTime += run->tokenizeTime;
+    total->encodeTime += run->encodeTime;
+    total->resolveTime += run->resolveTime;
+    total->optimizeTime += run->optimizeTime;
+    total->outputTime += run->outputTime;
+
+    total->lines += run->lines;
+    total->cachedLines += run->cachedLines;
+    total->instructions += run->instructions;
+    total->labels += run->labels;
+    total->symbolLookups += run->symbolLookups;
+    total->forwardReferences += run->forwardReferences;
+    total->bytesUsed += run->bytesUsed;
+    total->removedInstructions += run->removedInstructions;
+    total->threadedJumps += run->threadedJumps;
+    total->sections += run->sections;
+    total->gapBytes += run->gapBytes;
+    if(run->largestFree > total->largestFree) total->largestFree = run->largestFree;
+    total->virtualRegisters += run->virtualRegisters;
+    total->spilledRegisters += run->spilledRegisters;
+    total->spillInstructions += run->spillInstructions;
+    total->profiledJumps += run->profiledJumps;
+    total->profileJumpsRemoved += run->profileJumpsRemoved;
+    total->flippedSkips += run->flippedSkips;
+    total->outlinedSequences += run->outlinedSequences;
+    total->mergedTails += run->mergedTails;
+    total->outlineSaved += run->outlineSaved;
+    total->collapsedBranches += run->collapsedBranches;
+    total->packedBytes += run->packedBytes;
+    total->packedSize += run->packedSize;
+    total->unpackerSize += run->unpackerSize;
+
+    for(size_t i = 0; i < run->mnemonicCount; i++){
+        size_t j = 0;
+        while(j < total->mnemonicCount && strcmp(total->mnemonics[j].mnemonic, run->mnemonics[i].mnemonic) != 0) j++;
+        if(j == total->mnemonicCount){
+            if(j == CHIP8_STATS_MNEMONICS) continue;
+            total->mnemonics[j].mnemonic = run->mnemonics[i].mnemonic;
+            total->mnemonics[j].count = 0;
+            total->mnemonicCount++;
+        }
+        total->mnemonics[j].count += run->mnemonics[i].count;
+    }
+}
+
+
+void chip8_default_cost_model(chip8CostModel *model){
+    memset(model, 0, sizeof(*model));
+    model->defaultCycles = 1;
+    chip8_set_cost(model, "drw", CHIP8_DRAW_CYCLES);
+}
+
+
+int chip8_set_cost(chip8CostModel *model, const char *mnemonic, unsigned cycles){
+    if(initShared() != 0) return 1;
+
+    const opcodeEntry *entry = findMnemonic(mnemonic, strlen(mnemonic));
+    if(entry == NULL) return 1;
+
+    //Costs are kept under the table's spelling of the mnemonic
+    size_t i = 0;
+    while(i < model->costCount && strcmp(model->costs[i].mnemonic, entry->mnemonic) != 0) i++;
+    if(i == CHIP8_STATS_MNEMONICS) return 1;
+    if(i == model->costCount){
+        snprintf(model->costs[i].mnemonic, sizeof(model->costs[i].mnemonic), "%s", entry->mnemonic);
+        model->costCount++;
+    }
+    model->costs[i].cycles = cycles;
+    return 0;
+}
+
+
+void chip8_free_loop_report(chip8LoopReport *report){
+    for(size_t i = 0; i < report->count; i++) free(report->loops[i].path);
+    free(report->loops);
+    memset(report, 0, sizeof(*report));
+}
+
+
+void chip8_free_diagnostics(chip8Diagnostics *diagnostics){
+    free(diagnostics->items);
+    memset(diagnostics, 0, sizeof(*diagnostics));
+}
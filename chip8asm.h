@@ -0,0 +1,322 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+//Public interface of the Chip-8 assembler library.
+//The assembler keeps all of its state in a context that lives for one call,
+//so it can be called from any number of threads at once and never exits the
+//process. Errors are reported through the return code and a list of
+//diagnostics.
+
+#ifndef CHIP8ASM_H
+#define CHIP8ASM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+//Size of the Chip-8 address space
+#define CHIP8_MEMORY_SIZE 4096
+
+//Programs are loaded at CHIP8_PROGRAM_START, below it is memory the interpreter
+//keeps for itself. An image holds the bytes from there on, so it is at most
+//CHIP8_PROGRAM_SPACE bytes, and every address in it is a Chip-8 byte address.
+#define CHIP8_PROGRAM_START 0x200
+#define CHIP8_PROGRAM_SPACE (CHIP8_MEMORY_SIZE - CHIP8_PROGRAM_START)
+
+//Return codes
+#define CHIP8_OK 0
+#define CHIP8_ERROR_SOURCE 1      //The program has errors, see the diagnostics
+#define CHIP8_ERROR_MEMORY 2      //Out of memory
+#define CHIP8_ERROR_OUTPUT 3      //The output buffer is too small
+#define CHIP8_ERROR_MISMATCH 4    //Assembling the disassembly of an image gave other bytes
+
+//Lines assembled in earlier runs, see chip8_cache_load
+typedef struct chip8Cache chip8Cache;
+
+#define CHIP8_STATS_MNEMONICS 32
+
+//Profile of one assembly run. Times are in seconds.
+typedef struct{
+    double tokenizeTime;        //Lexing lines into tokens
+    double encodeTime;          //Matching instruction forms and placing opcodes
+    double resolveTime;         //Resolving anchor points and laying out the image
+    double optimizeTime;        //Optimization passes
+    double outputTime;          //Copying the image to the output buffer
+
+    size_t lines;
+    size_t cachedLines;         //Lines reused from the cache instead of parsed
+    size_t instructions;
+    size_t labels;
+    size_t symbolLookups;
+    size_t forwardReferences;
+    size_t bytesUsed;           //Including the end marker
+    size_t removedInstructions; //Instructions the optimizer saved
+    size_t threadedJumps;       //Jumps and calls the optimizer sent straight to their final target
+    size_t sections;            //Sections laid out, the main one included
+    size_t gapBytes;            //Bytes left empty between sections in the image
+    size_t largestFree;         //Largest run of memory left free, in or after the image
+    size_t virtualRegisters;    //Virtual registers given a register or kept in memory
+    size_t spilledRegisters;    //Virtual registers kept in memory
+    size_t spillInstructions;   //Loads and stores added for the ones kept in memory
+    size_t profiledJumps;       //jps run on the profiled path before profile layout
+    size_t profileJumpsRemoved; //Of those, the ones profile layout saved
+    size_t flippedSkips;        //Skips turned around by profile layout
+    size_t outlinedSequences;   //Repeated sequences the outlining pass made into subroutines
+    size_t mergedTails;         //Copies of a sequence ending in jp or ret replaced by a jp to another copy
+    size_t outlineSaved;        //Bytes the outlining pass saved
+    size_t collapsedBranches;   //Branches that became a lone skip, or nothing
+    size_t packedBytes;         //Bytes of pack lines stored packed
+    size_t packedSize;          //Bytes they take packed, with the table of segments
+    size_t unpackerSize;        //Bytes of the unpacker
+
+    //Instructions in the image counted by mnemonic
+    struct{
+        const char *mnemonic;
+        size_t count;
+    } mnemonics[CHIP8_STATS_MNEMONICS];
+    size_t mnemonicCount;
+} chip8Stats;
+
+//Cycles each instruction takes, for the loop report. Costs are set per
+//mnemonic, and every mnemonic without one costs defaultCycles.
+typedef struct{
+    unsigned defaultCycles;
+    struct{
+        char mnemonic[8];
+        unsigned cycles;
+    } costs[CHIP8_STATS_MNEMONICS];
+    size_t costCount;
+} chip8CostModel;
+
+//A loop of the program and the most expensive way once round it
+typedef struct{
+    int line;                   //Line of the instruction the loop starts at
+    int depth;                  //1 for an outermost loop, 2 for a loop inside one and so on
+    unsigned long cycles;       //Cycles of the worst path, including subroutines it calls
+    size_t instructions;        //Instructions on the worst path, not counting subroutines
+    int *path;                  //Line each block on the worst path starts at
+    size_t pathLength;
+} chip8Loop;
+
+//Released with chip8_free_loop_report
+typedef struct{
+    chip8Loop *loops;           //Most expensive first
+    size_t count;
+} chip8LoopReport;
+
+//Where the program ended up, for listings and profilers
+typedef struct{
+    unsigned short address;
+    unsigned short size;        //Bytes of the instruction or data
+    int line;                   //Line it came from, or the line that used the macro it came from
+} chip8LineEntry;
+
+typedef struct{
+    const char *name;           //Lowercase
+    unsigned short address;
+} chip8Symbol;
+
+//Released with chip8_free_debug_info
+typedef struct{
+    chip8LineEntry *lines;      //Every instruction and piece of data, in address order
+    size_t lineCount;
+    chip8Symbol *symbols;       //Every anchor point, in address order
+    size_t symbolCount;
+    char *names;                //Holds the names of the symbols
+} chip8DebugInfo;
+
+//Optimization passes, combined in chip8Options.optimize
+#define CHIP8_OPTIMIZE_PEEPHOLE 1     //Remove redundant instructions in short sequences
+#define CHIP8_OPTIMIZE_JUMPS 2        //Thread jump chains and remove unreachable code
+#define CHIP8_OPTIMIZE_OUTLINE 4      //Share repeated sequences through subroutines and merged tails, smaller but slower
+#define CHIP8_OPTIMIZE_ALL 3          //Every pass that does not slow the program down
+#define CHIP8_OPTIMIZE_SIZE 7         //Every pass, outlining included
+
+typedef struct{
+    bool littleEndian;          //Write opcodes little-endian instead of the standard big-endian, data as it is
+    chip8Cache *cache;          //Reuse and update this cache, or NULL to assemble every line
+    const char *sourceName;     //Path of the source, files it includes are next to it. NULL for the working directory.
+    chip8Stats *stats;          //Fill in a profile of the run, or NULL
+    unsigned optimize;          //CHIP8_OPTIMIZE passes to run, 0 assembles exactly what is written
+    chip8LoopReport *loops;     //Fill in the loops of the program and what they cost, or NULL
+    const chip8CostModel *costModel;    //Costs for the loop report, or NULL for the defaults
+    chip8DebugInfo *debug;      //Fill in where every line and anchor point ended up, or NULL
+    const unsigned long long *profile;  //Times each address ran in a build of the same program, CHIP8_MEMORY_SIZE
+                                        //counts like chip8RunResult.counts, to lay out the hot paths without jps. Or NULL.
+} chip8Options;
+
+typedef enum{
+    CHIP8_NOTE,                 //Information, such as what the optimizer did
+    CHIP8_WARNING,
+    CHIP8_ERROR
+} chip8Severity;
+
+typedef struct{
+    chip8Severity severity;
+    int line;                   //1-based source line, or 0 if the diagnostic is not tied to one
+    char message[128];
+} chip8Diagnostic;
+
+//Diagnostics are appended by the assembler and released with chip8_free_diagnostics
+typedef struct{
+    chip8Diagnostic *items;
+    size_t count;
+    size_t capacity;
+    size_t errors;
+} chip8Diagnostics;
+
+//Fill options with the defaults
+void chip8_default_options(chip8Options *options);
+
+//Assemble len bytes of source text into output, which should hold
+//CHIP8_PROGRAM_SPACE bytes. The number of bytes written is stored in outputSize.
+//options and diagnostics may be NULL.
+int chip8_assemble(const char *src, size_t len, const chip8Options *options,
+                   unsigned char *output, size_t outputCapacity, size_t *outputSize,
+                   chip8Diagnostics *diagnostics);
+
+void chip8_free_diagnostics(chip8Diagnostics *diagnostics);
+
+//Add the counts and times of one run to a running total, for example over a batch
+void chip8_add_stats(chip8Stats *total, const chip8Stats *run);
+
+//Fill model with the default costs: 1 cycle for each instruction, and
+//CHIP8_DRAW_CYCLES for drw, which is by far the slowest on real hardware
+#define CHIP8_DRAW_CYCLES 4
+void chip8_default_cost_model(chip8CostModel *model);
+
+//Set the cost of an instruction. Returns 0 on success, 1 if the mnemonic is
+//not an instruction or the model is full.
+int chip8_set_cost(chip8CostModel *model, const char *mnemonic, unsigned cycles);
+
+void chip8_free_loop_report(chip8LoopReport *report);
+
+void chip8_free_debug_info(chip8DebugInfo *info);
+
+//Save the lines of debug info as a binary source map: a header with a magic,
+//a version and a count, then a fixed size record for each line entry in
+//address order. Returns 0 on success.
+int chip8_save_source_map(const chip8DebugInfo *info, const char *path);
+
+//Look up an address in size bytes of a source map, for example one mapped
+//with mmap, with a binary search. Returns the line of the instruction or data
+//that covers the address, 0 if nothing does, or -1 if map is not a source map.
+int chip8_source_map_line(const void *map, size_t size, unsigned address);
+
+//Execution profiles, the counts of chip8RunResult as text. Each line has an
+//address and the times the instruction there ran, such as "0x204 1500", and
+//anything after a ; is a comment. Counts for the same address add up.
+
+//Read a profile into CHIP8_MEMORY_SIZE counts. Returns 0 on success, -1 if the
+//file can not be read, or the number of the first line that is not valid.
+int chip8_load_profile(const char *path, unsigned long long *counts);
+
+//Write the addresses that ran. Returns 0 on success.
+int chip8_save_profile(const char *path, const unsigned long long *counts);
+
+//Reference interpreter. It loads an image at CHIP8_PROGRAM_START and runs it
+//from there, with the font below it.
+
+//Why a run stopped
+#define CHIP8_STOP_LIMIT 0        //Ran the cycles or frames asked for
+#define CHIP8_STOP_END 1          //Reached the end marker or something that is not an instruction
+#define CHIP8_STOP_HALT 2         //jp to itself, which can never go anywhere else
+#define CHIP8_STOP_KEY 3          //ld vx, k with no key held
+#define CHIP8_STOP_STACK 4        //call with a full stack or ret with an empty one
+#define CHIP8_STOP_ADDRESS 5      //Jumped or read outside of memory
+
+typedef struct{
+    unsigned long long maxCycles;   //Stop after this many cycles, 0 for no limit
+    unsigned long long maxFrames;   //Stop after this many frames, 0 for no limit
+    unsigned clock;                 //Cycles per second. A frame, where the timers count down, is a 60th of a second.
+    const chip8CostModel *costModel;    //Cycles of each instruction, or NULL for the defaults
+    unsigned keys;                  //Keys held down for the whole run, bit n for key n
+    unsigned seed;                  //Seed for rnd, so runs can be repeated
+    bool littleEndian;              //The image was written with --little-endian
+} chip8RunOptions;
+
+#define CHIP8_INSTRUCTIONS (CHIP8_MEMORY_SIZE / 2)
+
+typedef struct{
+    int stopReason;                 //CHIP8_STOP value
+    unsigned short pc;              //Address the run stopped at
+    unsigned short i;
+    unsigned char v[16];
+
+    unsigned long long instructions;
+    unsigned long long cycles;
+    unsigned long long frames;
+
+    unsigned long long counts[CHIP8_MEMORY_SIZE];   //Times the instruction at each address ran
+
+    //Instructions run counted by mnemonic
+    struct{
+        const char *mnemonic;
+        unsigned long long count;
+    } mnemonics[CHIP8_STATS_MNEMONICS];
+    size_t mnemonicCount;
+} chip8RunResult;
+
+//Fill options with the defaults: no limits, 600 cycles per second and the default cost model
+void chip8_default_run_options(chip8RunOptions *options);
+
+//Run size bytes of image until a limit is reached or the program stops.
+//Returns CHIP8_OK, or CHIP8_ERROR_MEMORY.
+int chip8_run(const unsigned char *image, size_t size, const chip8RunOptions *options, chip8RunResult *result);
+
+//Disassembler. It writes an image back as source in this assembler's syntax,
+//one instruction per word. Words that are not instructions become dw, and
+//every jump, call and ld i inside the program gets a label, so assembling the
+//source gives back the same image.
+
+//Largest disassembly of an image of CHIP8_PROGRAM_SPACE bytes
+#define CHIP8_DISASSEMBLY_SIZE (CHIP8_INSTRUCTIONS * 32 + 32)
+
+//Write the source of size bytes of image to output, which should hold
+//CHIP8_DISASSEMBLY_SIZE bytes. The number of bytes written is stored in outputSize.
+//Returns CHIP8_ERROR_SOURCE if the image is larger than CHIP8_PROGRAM_SPACE or
+//has an odd number of bytes.
+int chip8_disassemble(const unsigned char *image, size_t size, bool littleEndian,
+                      char *output, size_t outputCapacity, size_t *outputSize);
+
+//Disassemble an image, assemble the source again and compare the two, leaving
+//out the end marker. Returns CHIP8_OK if they match, or CHIP8_ERROR_MISMATCH
+//with the offset of the first byte that differs stored in mismatch.
+int chip8_verify_image(const unsigned char *image, size_t size, bool littleEndian, size_t *mismatch);
+
+//Incremental assembly. A cache remembers what every line it has seen assembles
+//to, keyed by a hash of the line's text. When a cache is passed in the options,
+//only lines that are not in it are parsed again; anchor points are always laid
+//out and resolved from scratch, so references to moved anchor points stay
+//correct. A cache must not be used by two calls at the same time.
+chip8Cache *chip8_cache_create(void);
+
+//Load a cache saved by chip8_cache_save. A missing or unreadable file gives an
+//empty cache. Returns NULL only if out of memory.
+chip8Cache *chip8_cache_load(const char *path);
+
+//Save the lines used by the most recent assembly. Returns 0 on success.
+int chip8_cache_save(const chip8Cache *cache, const char *path);
+
+void chip8_cache_free(chip8Cache *cache);
+
+#endif
@@ -0,0 +1,152 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "debuginfo.h"
+
+//The source map file is the header followed by one record for each
+//instruction or piece of data, in address order, so a profiler can map the
+//file and search it without parsing anything
+#define SOURCE_MAP_MAGIC "C8SRCMAP"
+#define SOURCE_MAP_VERSION 1
+
+typedef struct{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} sourceMapHeader;
+
+typedef struct{
+    uint16_t address;
+    uint16_t size;
+    uint32_t line;
+} sourceMapRecord;
+
+
+//Helper function to order line entries by address
+static int compareLines(const void *a, const void *b){
+    const chip8LineEntry *x = a, *y = b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+
+//Helper function to order symbols by address, then by name
+static int compareSymbols(const void *a, const void *b){
+    const chip8Symbol *x = a, *y = b;
+    if(x->address != y->address) return x->address < y->address ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+
+void collectDebugInfo(assembler *ctx, const size_t *offsets){
+    chip8DebugInfo *info = ctx->options->debug;
+    const anchorPointList *anchors = ctx->anchors;
+
+    info->lines = malloc((ctx->codeSize ? ctx->codeSize : 1) * sizeof(chip8LineEntry));
+    info->symbols = malloc((anchors->size ? anchors->size : 1) * sizeof(chip8Symbol));
+    info->names = malloc(anchors->arenaSize ? anchors->arenaSize : 1);
+    if(info->lines == NULL || info->symbols == NULL || info->names == NULL){
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    //Sections are not laid out in the order they are in the instruction list,
+    //and the empty data that ends part of a section takes up no address
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        const instruction *ins = &ctx->code[i];
+        if(ins->data != NULL && ins->size == 0) continue;
+
+        chip8LineEntry *entry = &info->lines[info->lineCount++];
+        entry->address = offsets[i];
+        entry->size = ins->data ? ins->size : 2;
+        entry->line = ins->line;
+    }
+    if(ctx->sectionSize > 0) qsort(info->lines, info->lineCount, sizeof(chip8LineEntry), compareLines);
+
+    //Names are copied once, and every symbol points into the copy
+    memcpy(info->names, anchors->arena, anchors->arenaSize);
+    for(size_t i = 0; i < anchors->capacity; i++){
+        const anchorPoint *p = &anchors->values[i];
+        if(p->nameLength == 0) continue;
+
+        chip8Symbol *symbol = &info->symbols[info->symbolCount++];
+        symbol->name = info->names + p->nameOffset;
+        symbol->address = offsets[p->place];
+    }
+    qsort(info->symbols, info->symbolCount, sizeof(chip8Symbol), compareSymbols);
+}
+
+
+void chip8_free_debug_info(chip8DebugInfo *info){
+    free(info->lines);
+    free(info->symbols);
+    free(info->names);
+    memset(info, 0, sizeof(*info));
+}
+
+
+int chip8_save_source_map(const chip8DebugInfo *info, const char *path){
+    FILE *f = fopen(path, "wb");
+    if(f == NULL) return 1;
+
+    sourceMapHeader header = {SOURCE_MAP_MAGIC, SOURCE_MAP_VERSION, info->lineCount};
+    int result = fwrite(&header, sizeof(header), 1, f) != 1;
+
+    for(size_t i = 0; i < info->lineCount && result == 0; i++){
+        const chip8LineEntry *entry = &info->lines[i];
+        sourceMapRecord record = {entry->address, entry->size, entry->line};
+        if(fwrite(&record, sizeof(record), 1, f) != 1) result = 1;
+    }
+
+    if(fclose(f) != 0) result = 1;
+    return result;
+}
+
+
+int chip8_source_map_line(const void *map, size_t size, unsigned address){
+    sourceMapHeader header;
+    if(size < sizeof(header)) return -1;
+    memcpy(&header, map, sizeof(header));
+    if(memcmp(header.magic, SOURCE_MAP_MAGIC, 8) != 0 || header.version != SOURCE_MAP_VERSION) return -1;
+    if(header.count > (size - sizeof(header)) / sizeof(sourceMapRecord)) return -1;
+
+    //Find the last record that starts at or before the address
+    const unsigned char *records = (const unsigned char *)map + sizeof(header);
+    sourceMapRecord record;
+    size_t low = 0, high = header.count;
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+        memcpy(&record, records + middle * sizeof(record), sizeof(record));
+        if(record.address <= address) low = middle + 1;
+        else high = middle;
+    }
+    if(low == 0) return 0;
+
+    memcpy(&record, records + (low - 1) * sizeof(record), sizeof(record));
+    return address < (unsigned)record.address + record.size ? (int)record.line : 0;
+}
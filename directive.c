@@ -0,0 +1,401 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#include "directive.h"
+
+
+//Helper function to start reading the operands that follow a directive
+static void startOperands(assembler *ctx, token name, lexer *l){
+    initLexer(l, ctx->source, ctx->sourceSize);
+    seekLexer(l, name.offset + name.length, ctx->line);
+}
+
+
+//Helper function to get the next operand of a directive. Returns false at the end of the line.
+static bool nextOperand(lexer *l, token *t){
+    *t = nextExpression(l);
+    return t->kind == TOKEN_WORD || t->kind == TOKEN_ANCHOR;
+}
+
+
+//Helper function to evaluate the values of a data line into bytes, each width
+//bytes big-endian like opcodes. Returns false if a value has an error.
+static bool readValues(assembler *ctx, const char *text, size_t length, int width, unsigned char *bytes, int mode, const addressMap *addresses){
+    int max = width == 1 ? 255 : 65535;
+    lexer l;
+    token t;
+    initLexer(&l, text, length);
+
+    bool valid = true;
+    size_t size = 0;
+    while(nextOperand(&l, &t)){
+        int value = 0;
+        if(evaluate(ctx, tokenText(&l, t), t.length, mode, addresses, &value) != EXPRESSION_OK) valid = false;
+        else if(value < 0 || value > max){
+            error(ctx, "Value must be between 0 and %i", max);
+            valid = false;
+        }
+
+        if(width == 2) bytes[size++] = value >> 8;
+        bytes[size++] = value & 0xFF;
+    }
+    return valid;
+}
+
+
+//Helper function to read the values after db or dw into the program. Values
+//with names are filled in at layout, when every anchor point has its address.
+static bool defineData(assembler *ctx, token name, lineResult *r, int width){
+    lexer l;
+    token t;
+
+    //Count the values first, so they can be read straight into run memory
+    size_t count = 0;
+    size_t first = 0, end = 0;
+    startOperands(ctx, name, &l);
+    while(nextOperand(&l, &t)){
+        if(count++ == 0) first = t.offset;
+        end = t.offset + t.length;
+    }
+    if(count == 0){
+        error(ctx, "Expected data after %.*s", (int)name.length, ctx->source + name.offset);
+        return false;
+    }
+
+    unsigned char *bytes = allocateData(ctx, count * width);
+    if(bytes == NULL){
+        ctx->outOfMemory = true;
+        return false;
+    }
+
+    const char *text = ctx->source + first;
+    size_t length = end - first;
+    r->kind = LINE_DATA;
+    r->data = bytes;
+    r->size = count * width;
+    if(usesNames(text, length)){
+        r->max = width == 1 ? 255 : 65535;
+        r->name = text;
+        r->length = length;
+        return true;
+    }
+    return readValues(ctx, text, length, width, bytes, EVALUATE_LITERALS, NULL);
+}
+
+
+void fillData(assembler *ctx, const instruction *ins, const addressMap *addresses){
+    readValues(ctx, ins->name, ins->length, ins->max == 255 ? 1 : 2, (unsigned char *)ins->data, EVALUATE_LAYOUT, addresses);
+}
+
+
+//db 1, 2, 3 puts bytes in the program
+static bool defineBytes(assembler *ctx, token name, lineResult *r){
+    return defineData(ctx, name, r, 1);
+}
+
+
+//dw 1000, 2000 puts 16 bit words in the program
+static bool defineWords(assembler *ctx, token name, lineResult *r){
+    return defineData(ctx, name, r, 2);
+}
+
+
+//Helper function to get the path of a file named in the source. Relative paths
+//are next to the source file when its name is known. Returns NULL if out of memory.
+static char *includePath(assembler *ctx, const char *name, size_t length){
+    const char *source = ctx->options->sourceName;
+    size_t directory = 0;
+
+    bool absolute = length > 0 && (name[0] == '/' || name[0] == '\\');
+#ifdef _WIN32
+    absolute = absolute || (length > 1 && name[1] == ':');
+#endif
+    if(source != NULL && !absolute){
+        for(size_t i = 0; source[i] != '\0'; i++){
+            if(source[i] == '/' || source[i] == '\\') directory = i + 1;
+        }
+    }
+
+    char *path = malloc(directory + length + 1);
+    if(path == NULL) return NULL;
+    if(directory > 0) memcpy(path, source, directory);
+    memcpy(path + directory, name, length);
+    path[directory + length] = '\0';
+    return path;
+}
+
+
+//Helper function to map the part of a binary file that operands name: the
+//file, then an offset and a length, which default to the whole file. The
+//numbers have to be known straight away, so only constants defined before
+//directive can be used. Returns false if the operands have errors.
+static bool mapBinary(assembler *ctx, const token *operands, int count, const char *directive, const unsigned char **data, size_t *size){
+    int numbers[2] = {0, -1};
+    for(int i = 1; i < count; i++){
+        const char *text = ctx->source + operands[i].offset;
+        int result = evaluate(ctx, text, operands[i].length, EVALUATE_CONSTANTS, NULL, &numbers[i - 1]);
+        if(result == EXPRESSION_LATER) error(ctx, "Expected number, %.*s is not known before %s", (int)operands[i].length, text, directive);
+        if(result != EXPRESSION_OK) return false;
+        if(numbers[i - 1] < 0){
+            error(ctx, "%s offset and length can not be negative", directive);
+            return false;
+        }
+    }
+
+    //The file name may be in quotes
+    const char *file = ctx->source + operands[0].offset;
+    size_t length = operands[0].length;
+    if(length >= 2 && file[0] == '"' && file[length - 1] == '"'){
+        file++;
+        length -= 2;
+    }
+
+    if(ctx->includeSize == ctx->includeCapacity){
+        size_t newCapacity = ctx->includeCapacity ? ctx->includeCapacity * 2 : 8;
+        sourceFile *temp = realloc(ctx->includes, newCapacity * sizeof(ctx->includes[0]));
+        if(temp == NULL){
+            ctx->outOfMemory = true;
+            return false;
+        }
+        ctx->includes = temp;
+        ctx->includeCapacity = newCapacity;
+    }
+
+    char *path = includePath(ctx, file, length);
+    if(path == NULL){
+        ctx->outOfMemory = true;
+        return false;
+    }
+    sourceFile *binary = &ctx->includes[ctx->includeSize];
+    int opened = openSource(path, binary);
+    free(path);
+    if(opened != 0){
+        error(ctx, "Could not read %.*s", (int)length, file);
+        return false;
+    }
+    ctx->includeSize++;
+
+    size_t offset = numbers[0];
+    *size = numbers[1] == -1 && offset <= binary->size ? binary->size - offset : (size_t)numbers[1];
+    if(offset > binary->size || *size > binary->size - offset){
+        error(ctx, "%s reads past the end of %.*s", directive, (int)length, file);
+        return false;
+    }
+    *data = (const unsigned char *)binary->text + offset;
+    return true;
+}
+
+
+//incbin "file", offset, length maps a binary file and puts length bytes of it,
+//starting at offset, in the program. Without a length it takes the rest of the file.
+static bool includeBinary(assembler *ctx, token name, lineResult *r){
+    lexer l;
+    token t;
+    token operands[3];
+    int count = 0;
+
+    startOperands(ctx, name, &l);
+    while(nextOperand(&l, &t)){
+        if(count < 3) operands[count] = t;
+        count++;
+    }
+    if(count < 1 || count > 3){
+        error(ctx, "Expected incbin \"file\", offset, length");
+        return false;
+    }
+
+    if(!mapBinary(ctx, operands, count, "incbin", &r->data, &r->size)) return false;
+    r->kind = LINE_DATA;
+    return true;
+}
+
+
+//pack address, "file", offset, length or pack address, 1, 2, 3 stores bytes
+//compressed, to be unpacked to address when the program starts. The bytes
+//and the address have to be known straight away, since they are packed once
+//the whole program has been read.
+static bool packBytes(assembler *ctx, token name, lineResult *r){
+    lexer l;
+    token t, address = {0};
+    token operands[3];
+    int count = 0;
+    size_t first = 0, end = 0;
+
+    startOperands(ctx, name, &l);
+    while(nextOperand(&l, &t)){
+        if(count == 0) address = t;
+        else if(count == 1) first = t.offset;
+        if(count > 0 && count < 4) operands[count - 1] = t;
+        if(count > 0) end = t.offset + t.length;
+        count++;
+    }
+    if(count < 2){
+        error(ctx, "Expected pack address, \"file\" or pack address, bytes");
+        return false;
+    }
+
+    int value;
+    const char *text = ctx->source + address.offset;
+    int result = evaluate(ctx, text, address.length, EVALUATE_CONSTANTS, NULL, &value);
+    if(result == EXPRESSION_LATER) error(ctx, "Expected number, %.*s is not known before pack", (int)address.length, text);
+    if(result != EXPRESSION_OK) return false;
+
+    //A file, or the bytes themselves
+    if(ctx->source[operands[0].offset] == '"'){
+        if(count > 4){
+            error(ctx, "Expected pack address, \"file\", offset, length");
+            return false;
+        }
+        if(!mapBinary(ctx, operands, count - 1, "pack", &r->data, &r->size)) return false;
+    }
+    else{
+        unsigned char *bytes = allocateData(ctx, count - 1);
+        if(bytes == NULL){
+            ctx->outOfMemory = true;
+            return false;
+        }
+
+        size_t size = 0;
+        initLexer(&l, ctx->source + first, end - first);
+        while(nextOperand(&l, &t)){
+            const char *byte = tokenText(&l, t);
+            int byteValue;
+            int byteResult = evaluate(ctx, byte, t.length, EVALUATE_CONSTANTS, NULL, &byteValue);
+            if(byteResult == EXPRESSION_LATER) error(ctx, "Expected number, %.*s is not known before pack", (int)t.length, byte);
+            if(byteResult != EXPRESSION_OK) return false;
+            if(byteValue < 0 || byteValue > 255){
+                error(ctx, "Value must be between 0 and 255");
+                return false;
+            }
+            bytes[size++] = byteValue;
+        }
+        r->data = bytes;
+        r->size = size;
+    }
+
+    if(value < CHIP8_PROGRAM_START || value >= CHIP8_MEMORY_SIZE || r->size > (size_t)(CHIP8_MEMORY_SIZE - value)){
+        error(ctx, "pack address must leave room for %zu bytes between 0x%X and 0x%X", r->size, CHIP8_PROGRAM_START, CHIP8_MEMORY_SIZE - 1);
+        return false;
+    }
+    r->kind = LINE_PACKED;
+    r->address = value;
+    return true;
+}
+
+
+//org address puts the lines after it at a fixed address. The address has to
+//be known straight away, like the numbers of incbin.
+static bool setOrigin(assembler *ctx, token name, lineResult *r){
+    lexer l;
+    token t, address;
+    int count = 0;
+
+    startOperands(ctx, name, &l);
+    while(nextOperand(&l, &t)){
+        if(count == 0) address = t;
+        count++;
+    }
+    if(count != 1){
+        error(ctx, "Expected org address");
+        return false;
+    }
+
+    int value;
+    const char *text = ctx->source + address.offset;
+    int result = evaluate(ctx, text, address.length, EVALUATE_CONSTANTS, NULL, &value);
+    if(result == EXPRESSION_LATER) error(ctx, "Expected number, %.*s is not known before org", (int)address.length, text);
+    if(result != EXPRESSION_OK) return false;
+    if(value < CHIP8_PROGRAM_START || value >= CHIP8_MEMORY_SIZE || (value & 1)){
+        error(ctx, "org address must be even and between 0x%X and 0x%X", CHIP8_PROGRAM_START, CHIP8_MEMORY_SIZE - 1);
+        return false;
+    }
+
+    r->kind = LINE_SECTION;
+    r->size = value;
+    return true;
+}
+
+
+//section name puts the lines after it in a section of that name, which the
+//layout places wherever it fits. main is the section the program starts in.
+static bool startSection(assembler *ctx, token name, lineResult *r){
+    lexer l;
+    token t, sectionName = {0};
+    int count = 0;
+
+    startOperands(ctx, name, &l);
+    while(nextOperand(&l, &t)){
+        if(count == 0) sectionName = t;
+        count++;
+    }
+
+    if(count != 1 || sectionName.kind != TOKEN_WORD){
+        error(ctx, "Expected section name");
+        return false;
+    }
+
+    const char *text = ctx->source + sectionName.offset;
+    bool valid = isalpha((unsigned char)text[0]) || text[0] == '_';
+    for(size_t i = 1; valid && i < sectionName.length; i++) valid = isalnum((unsigned char)text[i]) || text[i] == '_';
+    if(!valid){
+        error(ctx, "Expected section name");
+        return false;
+    }
+
+    r->kind = LINE_SECTION;
+    r->name = text;
+    r->length = sectionName.length;
+    return true;
+}
+
+
+static const struct{
+    const char *name;
+    directiveHandler handler;
+} directives[] = {
+    {"db", defineBytes},
+    {"dw", defineWords},
+    {"incbin", includeBinary},
+    {"org", setOrigin},
+    {"pack", packBytes},
+    {"section", startSection},
+};
+
+
+
+directiveHandler findDirective(const char *name, size_t length){
+    for(size_t i = 0; i < sizeof(directives) / sizeof(directives[0]); i++){
+        const char *directive = directives[i].name;
+        size_t j = 0;
+        while(j < length && directive[j] != '\0' && tolower((unsigned char)name[j]) == directive[j]) j++;
+        if(j == length && directive[j] == '\0') return directives[i].handler;
+    }
+    return NULL;
+}
@@ -0,0 +1,47 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Directives: lines that put something other than an instruction in the program
+
+#ifndef DIRECTIVE_H
+#define DIRECTIVE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "assembler.h"
+#include "lexer.h"
+#include "expr.h"
+
+//A directive reads the rest of its line itself, since it can have any number
+//of operands. Returns false if the line has errors.
+typedef bool (*directiveHandler)(assembler *ctx, token name, lineResult *r);
+
+//Get the handler of a directive, or NULL if the word is not one
+directiveHandler findDirective(const char *name, size_t length);
+
+//Work out the values of data whose max says they use names, once anchor points have addresses
+void fillData(assembler *ctx, const instruction *ins, const addressMap *addresses);
+
+#endif
@@ -0,0 +1,214 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "assembler.h"
+#include "opcodes.h"
+
+//Kinds of label an address can get, the first one set names it
+#define LABEL_CALL 1
+#define LABEL_JUMP 2
+#define LABEL_DATA 4
+
+//Source text being written to the caller's buffer
+typedef struct{
+    char *text;
+    size_t capacity;
+    size_t size;
+    bool full;
+} writer;
+
+
+//Helper function to add a line to the source
+static void writeLine(writer *w, const char *line, int length){
+    if(length < 0 || w->size + length + 1 > w->capacity){
+        w->full = true;
+        return;
+    }
+    memcpy(w->text + w->size, line, length);
+    w->text[w->size + length] = '\n';
+    w->size += length + 1;
+}
+
+
+//Helper function to read the word at a byte offset of the image
+static unsigned short wordAt(const unsigned char *image, size_t offset, bool littleEndian){
+    if(littleEndian) return image[offset + 1] << 8 | image[offset];
+    return image[offset] << 8 | image[offset + 1];
+}
+
+
+//Helper function to get the offset into the image an address operand points
+//to, or -1 if it can not have a label. Labels only go on the even offsets
+//words start at, up to the end of the program.
+static int labelOffset(unsigned short opcode, size_t end){
+    unsigned short group = opcode & 0xF000;
+    size_t address = opcode & 0xFFF;
+    if(group != 0x1000 && group != 0x2000 && group != 0xA000 && group != 0xB000) return -1;
+    if(address < CHIP8_PROGRAM_START || (address & 1)) return -1;
+    size_t offset = address - CHIP8_PROGRAM_START;
+    return offset <= end ? (int)offset : -1;
+}
+
+
+//Helper function to write the name of the label at an offset, after the address it is at
+static int labelName(char *name, size_t size, const unsigned char *labels, int offset){
+    int address = offset + CHIP8_PROGRAM_START;
+    if(labels[offset] & LABEL_CALL) return snprintf(name, size, "sub_%03X", address);
+    if(labels[offset] & LABEL_JUMP) return snprintf(name, size, "L%03X", address);
+    return snprintf(name, size, "data_%03X", address);
+}
+
+
+//Helper function to write one word of the image as an instruction, or as dw
+//of raw, the word in the order data is stored, if it is not one
+static int formatWord(char *line, size_t size, unsigned short opcode, unsigned short raw, const opcodeEntry *form, const unsigned char *labels, size_t end){
+    static const char *keywords[] = {
+        [OPERAND_I] = "i", [OPERAND_DT] = "dt", [OPERAND_ST] = "st", [OPERAND_K] = "k",
+        [OPERAND_F] = "f", [OPERAND_B] = "b", [OPERAND_MEMORY] = "[i]",
+    };
+
+    if(form == NULL) return snprintf(line, size, "    dw 0x%04X", raw);
+
+    int length = snprintf(line, size, "    %s", form->mnemonic);
+    int registerShift = 8;
+    for(int i = 0; i < form->operandCount; i++){
+        length += snprintf(line + length, size - length, i ? ", " : " ");
+
+        switch(form->operands[i]){
+            case OPERAND_REGISTER:
+                length += snprintf(line + length, size - length, "v%i", opcode >> registerShift & 0xF);
+                registerShift -= 4;
+                break;
+            case OPERAND_V0:
+                length += snprintf(line + length, size - length, "v0");
+                break;
+            case OPERAND_BYTE:
+                length += snprintf(line + length, size - length, "%i", opcode & 0xFF);
+                break;
+            case OPERAND_NIBBLE:
+                length += snprintf(line + length, size - length, "%i", opcode & 0xF);
+                break;
+            case OPERAND_ADDR:{
+                int offset = labelOffset(opcode, end);
+                if(offset == -1) length += snprintf(line + length, size - length, "0x%03X", opcode & 0xFFF);
+                else length += labelName(line + length, size - length, labels, offset);
+                break;
+            }
+            default:
+                length += snprintf(line + length, size - length, "%s", keywords[form->operands[i]]);
+                break;
+        }
+    }
+    return length;
+}
+
+
+int chip8_disassemble(const unsigned char *image, size_t size, bool littleEndian,
+                      char *output, size_t outputCapacity, size_t *outputSize){
+    if(outputSize) *outputSize = 0;
+    if(size > CHIP8_PROGRAM_SPACE) return CHIP8_ERROR_SOURCE;
+    if(initShared() != 0) return CHIP8_ERROR_MEMORY;
+
+    //The end marker the assembler adds is not part of the program
+    size_t end = size;
+    if(end >= 4 && memcmp(image + end - 4, "\xFF\xFF\xFF\xFF", 4) == 0) end -= 4;
+    size_t words = end / 2;
+
+    //The assembler starts the end marker on an even byte, so a program of an
+    //odd length can not come back out of it
+    if(end & 1) return CHIP8_ERROR_SOURCE;
+
+    //Labels go wherever a jump, call or ld i points inside the program
+    unsigned char labels[CHIP8_PROGRAM_SPACE + 1] = {0};
+    for(size_t i = 0; i < words; i++){
+        unsigned short opcode = wordAt(image, i * 2, littleEndian);
+        if(decodeOpcode(opcode) == NULL) continue;
+
+        int offset = labelOffset(opcode, end);
+        if(offset == -1) continue;
+        unsigned short group = opcode & 0xF000;
+        labels[offset] |= group == 0x2000 ? LABEL_CALL : group == 0xA000 ? LABEL_DATA : LABEL_JUMP;
+    }
+
+    writer w = {output, outputCapacity, 0, false};
+    char line[64];
+    for(size_t i = 0; i <= words; i++){
+        size_t offset = i * 2;
+        if(labels[offset]){
+            line[0] = '.';
+            writeLine(&w, line, 1 + labelName(line + 1, sizeof(line) - 1, labels, offset));
+        }
+        if(i == words) break;
+
+        //Only instructions are swapped for a little-endian image, so a word
+        //that is not one goes back as the bytes it is
+        unsigned short opcode = wordAt(image, offset, littleEndian);
+        unsigned short raw = wordAt(image, offset, false);
+        writeLine(&w, line, formatWord(line, sizeof(line), opcode, raw, decodeOpcode(opcode), labels, end));
+    }
+
+    if(w.full) return CHIP8_ERROR_OUTPUT;
+    if(outputSize) *outputSize = w.size;
+    return CHIP8_OK;
+}
+
+
+int chip8_verify_image(const unsigned char *image, size_t size, bool littleEndian, size_t *mismatch){
+    if(mismatch) *mismatch = 0;
+
+    char *source = malloc(CHIP8_DISASSEMBLY_SIZE);
+    if(source == NULL) return CHIP8_ERROR_MEMORY;
+
+    size_t sourceSize;
+    int result = chip8_disassemble(image, size, littleEndian, source, CHIP8_DISASSEMBLY_SIZE, &sourceSize);
+    if(result != CHIP8_OK){
+        free(source);
+        return result;
+    }
+
+    chip8Options options;
+    chip8_default_options(&options);
+    options.littleEndian = littleEndian;
+
+    unsigned char again[CHIP8_PROGRAM_SPACE];
+    size_t againSize;
+    result = chip8_assemble(source, sourceSize, &options, again, sizeof(again), &againSize, NULL);
+    free(source);
+    if(result != CHIP8_OK) return result;
+
+    //Both are compared without the end marker, which the assembler always adds
+    size_t end = size;
+    if(end >= 4 && memcmp(image + end - 4, "\xFF\xFF\xFF\xFF", 4) == 0) end -= 4;
+    againSize -= 4;
+
+    size_t i = 0;
+    while(i < end && i < againSize && image[i] == again[i]) i++;
+    if(mismatch) *mismatch = i;
+    return i == end && i == againSize ? CHIP8_OK : CHIP8_ERROR_MISMATCH;
+}
@@ -0,0 +1,397 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Reference interpreter for the assembler's instruction set. The instruction at
+//every address in memory is decoded ahead of time into a small record, so
+//running one is a single switch, and only instructions the program writes over
+//are decoded again.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chip8asm.h"
+#include "assembler.h"
+#include "opcodes.h"
+#include "analyze.h"
+
+//Where the hexadecimal font sits, in the interpreter's memory below the program
+#define FONT_ADDRESS 0x050
+
+static const unsigned char font[80] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0,   //0
+    0x20, 0x60, 0x20, 0x20, 0x70,   //1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0,   //2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0,   //3
+    0x90, 0x90, 0xF0, 0x10, 0x10,   //4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0,   //5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0,   //6
+    0xF0, 0x10, 0x20, 0x40, 0x40,   //7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0,   //8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0,   //9
+    0xF0, 0x90, 0xF0, 0x90, 0x90,   //A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0,   //B
+    0xF0, 0x80, 0x80, 0x80, 0xF0,   //C
+    0xE0, 0x90, 0x90, 0x90, 0xE0,   //D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0,   //E
+    0xF0, 0x80, 0xF0, 0x80, 0x80,   //F
+};
+
+//Operations of the decoded instructions
+enum{
+    OP_END, OP_CLS, OP_RET, OP_JP, OP_JP_V0, OP_CALL,
+    OP_SE, OP_SE_V, OP_SNE, OP_SNE_V,
+    OP_LD, OP_LD_V, OP_LD_DT, OP_LD_K, OP_LD_MEMORY, OP_LD_I_V, OP_LD_I,
+    OP_SET_DT, OP_SET_ST, OP_LD_F, OP_LD_B, OP_STORE,
+    OP_ADD, OP_ADD_V, OP_ADD_I, OP_OR, OP_AND, OP_XOR, OP_SUB, OP_SHR, OP_SUBN, OP_SHL,
+    OP_RND, OP_DRW, OP_SKP, OP_SKNP
+};
+
+//An instruction decoded ahead of time
+typedef struct{
+    unsigned char op;
+    unsigned char x;
+    unsigned char y;
+    unsigned char n;
+    unsigned short nnn;         //nnn, or kk
+    unsigned short cycles;
+} decoded;
+
+typedef struct{
+    unsigned char memory[CHIP8_MEMORY_SIZE];
+    decoded code[CHIP8_MEMORY_SIZE];
+    uint64_t display[32];       //One row per word, the leftmost pixel in the top bit
+    unsigned short stack[16];
+    int sp;
+    uint32_t random;
+    const chip8CostModel *model;
+    bool littleEndian;          //Instructions are stored low byte first
+} machine;
+
+
+//Helper function to decode the instruction at an address. The last byte of
+//memory has no room for one.
+static void decode(machine *m, unsigned pc){
+    unsigned short opcode = 0xFFFF;
+    if(pc + 1 < CHIP8_MEMORY_SIZE){
+        opcode = m->memory[pc] << 8 | m->memory[pc + 1];
+        if(m->littleEndian) opcode = m->memory[pc + 1] << 8 | m->memory[pc];
+    }
+    decoded *d = &m->code[pc];
+    d->x = opcode >> 8 & 0xF;
+    d->y = opcode >> 4 & 0xF;
+    d->n = opcode & 0xF;
+    d->nnn = opcode & 0xFFF;
+    d->cycles = instructionCycles(m->model, opcode);
+    d->op = OP_END;
+
+    const opcodeEntry *form = decodeOpcode(opcode);
+    if(form == NULL) return;
+
+    switch(form->opcode){
+        case 0x00E0: d->op = OP_CLS; break;
+        case 0x00EE: d->op = OP_RET; break;
+        case 0x1000: d->op = OP_JP; break;
+        case 0xB000: d->op = OP_JP_V0; break;
+        case 0x2000: d->op = OP_CALL; break;
+        case 0x3000: d->op = OP_SE; break;
+        case 0x5000: d->op = OP_SE_V; break;
+        case 0x4000: d->op = OP_SNE; break;
+        case 0x9000: d->op = OP_SNE_V; break;
+        case 0x8000: d->op = OP_LD_V; break;
+        case 0xF007: d->op = OP_LD_DT; break;
+        case 0xF00A: d->op = OP_LD_K; break;
+        case 0xF041: d->op = OP_LD_MEMORY; break;
+        case 0x6000: d->op = OP_LD; break;
+        case 0xF030: d->op = OP_LD_I_V; break;
+        case 0xA000: d->op = OP_LD_I; break;
+        case 0xF00F: d->op = OP_SET_DT; break;
+        case 0xF012: d->op = OP_SET_ST; break;
+        case 0xF01D: d->op = OP_LD_F; break;
+        case 0xF021: d->op = OP_LD_B; break;
+        case 0xF037: d->op = OP_STORE; break;
+        case 0x8004: d->op = OP_ADD_V; break;
+        case 0x7000: d->op = OP_ADD; break;
+        case 0xF01E: d->op = OP_ADD_I; break;
+        case 0x8001: d->op = OP_OR; break;
+        case 0x8002: d->op = OP_AND; break;
+        case 0x8003: d->op = OP_XOR; break;
+        case 0x8005: d->op = OP_SUB; break;
+        case 0x8006: d->op = OP_SHR; break;
+        case 0x8007: d->op = OP_SUBN; break;
+        case 0x800E: d->op = OP_SHL; break;
+        case 0xC000: d->op = OP_RND; break;
+        case 0xD000: d->op = OP_DRW; break;
+        case 0xE09E: d->op = OP_SKP; break;
+        case 0xE0A1: d->op = OP_SKNP; break;
+    }
+}
+
+
+//Helper function to write a byte of memory, decoding the two instructions it is part of again
+static void store(machine *m, unsigned address, unsigned char value){
+    m->memory[address] = value;
+    decode(m, address);
+    if(address > 0) decode(m, address - 1);
+}
+
+
+//Helper function to get the next number from the xorshift generator behind rnd
+static unsigned char nextRandom(machine *m){
+    uint32_t x = m->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    m->random = x;
+    return x >> 24;
+}
+
+
+void chip8_default_run_options(chip8RunOptions *options){
+    memset(options, 0, sizeof(*options));
+    options->clock = 600;
+    options->seed = 1;
+}
+
+
+int chip8_run(const unsigned char *image, size_t size, const chip8RunOptions *options, chip8RunResult *result){
+    memset(result, 0, sizeof(*result));
+    if(initShared() != 0) return CHIP8_ERROR_MEMORY;
+
+    machine *m = calloc(1, sizeof(machine));
+    if(m == NULL) return CHIP8_ERROR_MEMORY;
+
+    chip8CostModel defaults;
+    m->model = options->costModel;
+    if(m->model == NULL){
+        chip8_default_cost_model(&defaults);
+        m->model = &defaults;
+    }
+    m->random = options->seed ? options->seed : 1;
+
+    //The image goes where programs are loaded, above the font
+    memcpy(m->memory + FONT_ADDRESS, font, sizeof(font));
+    if(size > CHIP8_PROGRAM_SPACE) size = CHIP8_PROGRAM_SPACE;
+    //Only instructions are in the host's byte order, so it is used when they are decoded
+    memcpy(m->memory + CHIP8_PROGRAM_START, image, size);
+    m->littleEndian = options->littleEndian;
+    for(unsigned pc = 0; pc < CHIP8_MEMORY_SIZE; pc++) decode(m, pc);
+
+    unsigned char *v = result->v;
+    unsigned i = 0;
+    unsigned pc = CHIP8_PROGRAM_START;
+    unsigned dt = 0;
+    unsigned long long cycles = 0;
+    unsigned long long frames = 0;
+    unsigned long long instructions = 0;
+    unsigned long long cyclesPerFrame = options->clock >= 60 ? options->clock / 60 : 1;
+    unsigned long long nextFrame = cyclesPerFrame;
+    int stop = CHIP8_STOP_LIMIT;
+
+    while(true){
+        if(options->maxCycles && cycles >= options->maxCycles) break;
+        if(pc >= CHIP8_MEMORY_SIZE){
+            stop = CHIP8_STOP_ADDRESS;
+            break;
+        }
+
+        const decoded *d = &m->code[pc];
+        unsigned char *vx = &v[d->x];
+        unsigned char vy = v[d->y];
+        unsigned next = pc + 2;
+
+        switch(d->op){
+            case OP_END:
+                stop = CHIP8_STOP_END;
+                goto stopped;
+            case OP_CLS:
+                memset(m->display, 0, sizeof(m->display));
+                break;
+            case OP_RET:
+                if(m->sp == 0){
+                    stop = CHIP8_STOP_STACK;
+                    goto stopped;
+                }
+                next = m->stack[--m->sp];
+                break;
+            case OP_JP:
+                if(d->nnn == pc){
+                    stop = CHIP8_STOP_HALT;
+                    goto stopped;
+                }
+                next = d->nnn;
+                break;
+            case OP_JP_V0: next = d->nnn + v[0]; break;
+            case OP_CALL:
+                if(m->sp == 16){
+                    stop = CHIP8_STOP_STACK;
+                    goto stopped;
+                }
+                m->stack[m->sp++] = next;
+                next = d->nnn;
+                break;
+            case OP_SE: if(*vx == (d->nnn & 0xFF)) next += 2; break;
+            case OP_SE_V: if(*vx == vy) next += 2; break;
+            case OP_SNE: if(*vx != (d->nnn & 0xFF)) next += 2; break;
+            case OP_SNE_V: if(*vx != vy) next += 2; break;
+            case OP_LD: *vx = d->nnn & 0xFF; break;
+            case OP_LD_V: *vx = vy; break;
+            case OP_LD_DT: *vx = dt; break;
+            case OP_LD_K:
+                if(options->keys == 0){
+                    stop = CHIP8_STOP_KEY;
+                    goto stopped;
+                }
+                for(*vx = 0; !(options->keys >> *vx & 1); (*vx)++);
+                break;
+            case OP_LD_MEMORY:
+                if(i + d->x >= CHIP8_MEMORY_SIZE){
+                    stop = CHIP8_STOP_ADDRESS;
+                    goto stopped;
+                }
+                memcpy(v, m->memory + i, d->x + 1);
+                break;
+            case OP_LD_I_V: i = *vx; break;
+            case OP_LD_I: i = d->nnn; break;
+            case OP_SET_DT: dt = *vx; break;
+            case OP_SET_ST: break;      //There is no sound to play when headless
+            case OP_LD_F: i = FONT_ADDRESS + (*vx & 0xF) * 5; break;
+            case OP_LD_B:
+                if(i + 2 >= CHIP8_MEMORY_SIZE){
+                    stop = CHIP8_STOP_ADDRESS;
+                    goto stopped;
+                }
+                store(m, i, *vx / 100);
+                store(m, i + 1, *vx / 10 % 10);
+                store(m, i + 2, *vx % 10);
+                break;
+            case OP_STORE:
+                if(i + d->x >= CHIP8_MEMORY_SIZE){
+                    stop = CHIP8_STOP_ADDRESS;
+                    goto stopped;
+                }
+                for(int r = 0; r <= d->x; r++) store(m, i + r, v[r]);
+                break;
+            case OP_ADD: *vx += d->nnn & 0xFF; break;
+            case OP_ADD_V:{
+                unsigned sum = *vx + vy;
+                *vx = sum;
+                v[15] = sum > 0xFF;
+                break;
+            }
+            case OP_ADD_I: i = (i + *vx) & 0xFFF; break;
+            case OP_OR: *vx |= vy; break;
+            case OP_AND: *vx &= vy; break;
+            case OP_XOR: *vx ^= vy; break;
+            case OP_SUB:{
+                unsigned char flag = *vx >= vy;
+                *vx -= vy;
+                v[15] = flag;
+                break;
+            }
+            case OP_SHR:{
+                unsigned char flag = *vx & 1;
+                *vx >>= 1;
+                v[15] = flag;
+                break;
+            }
+            case OP_SUBN:{
+                unsigned char flag = vy >= *vx;
+                *vx = vy - *vx;
+                v[15] = flag;
+                break;
+            }
+            case OP_SHL:{
+                unsigned char flag = *vx >> 7;
+                *vx <<= 1;
+                v[15] = flag;
+                break;
+            }
+            case OP_RND: *vx = nextRandom(m) & d->nnn; break;
+            case OP_DRW:{
+                if(i + d->n > CHIP8_MEMORY_SIZE){
+                    stop = CHIP8_STOP_ADDRESS;
+                    goto stopped;
+                }
+
+                //Sprites start at a wrapped position and are cut off at the edges
+                unsigned x = *vx & 63;
+                unsigned y = vy & 31;
+                unsigned char collision = 0;
+                for(unsigned row = 0; row < d->n && y + row < 32; row++){
+                    uint64_t bits = ((uint64_t)m->memory[i + row] << 56) >> x;
+                    if(m->display[y + row] & bits) collision = 1;
+                    m->display[y + row] ^= bits;
+                }
+                v[15] = collision;
+                break;
+            }
+            case OP_SKP: if(options->keys >> (*vx & 0xF) & 1) next += 2; break;
+            case OP_SKNP: if(!(options->keys >> (*vx & 0xF) & 1)) next += 2; break;
+        }
+
+        result->counts[pc]++;
+        instructions++;
+        cycles += d->cycles;
+        pc = next;
+
+        //The timers count down once a frame
+        if(cycles >= nextFrame){
+            while(cycles >= nextFrame){
+                frames++;
+                if(dt > 0) dt--;
+                nextFrame += cyclesPerFrame;
+            }
+            if(options->maxFrames && frames >= options->maxFrames) break;
+        }
+    }
+
+stopped:
+    result->stopReason = stop;
+    result->pc = pc;
+    result->i = i;
+    result->instructions = instructions;
+    result->cycles = cycles;
+    result->frames = frames;
+
+    //Count what ran by mnemonic, from memory as the program left it
+    for(unsigned a = 0; a + 1 < CHIP8_MEMORY_SIZE; a++){
+        if(result->counts[a] == 0) continue;
+        const opcodeEntry *form = decodeOpcode(m->memory[a] << 8 | m->memory[a + 1]);
+        if(form == NULL) continue;
+
+        size_t j = 0;
+        while(j < result->mnemonicCount && strcmp(result->mnemonics[j].mnemonic, form->mnemonic) != 0) j++;
+        if(j == result->mnemonicCount){
+            if(j == CHIP8_STATS_MNEMONICS) continue;
+            result->mnemonics[j].mnemonic = form->mnemonic;
+            result->mnemonicCount++;
+        }
+        result->mnemonics[j].count += result->counts[a];
+    }
+
+    free(m);
+    return CHIP8_OK;
+}
@@ -0,0 +1,388 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#include "expr.h"
+
+//State of one expression being read. The first error is kept rather than
+//reported, because a name for later can make it not an error after all.
+typedef struct{
+    assembler *ctx;
+    const char *text;
+    size_t length;
+    size_t position;
+    int mode;
+    const addressMap *addresses;
+
+    bool later;             //A name was left for later
+    bool anchored;          //The value depends on where an anchor point is
+    bool failed;
+    bool reported;          //The error was reported already, by a constant
+    char message[96];
+} expression;
+
+
+//Helper function to keep the first error of an expression
+static void fail(expression *e, const char *message, ...){
+    if(e->failed) return;
+    e->failed = true;
+
+    va_list args;
+    va_start(args, message);
+    vsnprintf(e->message, sizeof(e->message), message, args);
+    va_end(args);
+}
+
+
+//Helper function to keep values in the range of an int, so large numbers still
+//fail range checks instead of wrapping
+static long long saturate(long long value){
+    if(value > 0x7FFFFFFF) return 0x7FFFFFFF;
+    if(value < -0x7FFFFFFF) return -0x7FFFFFFF;
+    return value;
+}
+
+
+static bool isNameStart(char c){
+    return isalpha((unsigned char)c) || c == '_' || c == '@' || c == '.';
+}
+
+
+static bool isNameChar(char c){
+    return isNameStart(c) || isdigit((unsigned char)c);
+}
+
+
+//Helper function to skip spaces and look at the next character, or 0 at the end
+static char peek(expression *e){
+    while(e->position < e->length && (e->text[e->position] == ' ' || e->text[e->position] == '\t' || e->text[e->position] == '\r')) e->position++;
+    return e->position < e->length ? e->text[e->position] : 0;
+}
+
+
+//Helper function to take an operator of one or two characters if it is next
+static bool take(expression *e, const char *op){
+    size_t length = strlen(op);
+    peek(e);
+    if(e->position + length > e->length || memcmp(e->text + e->position, op, length) != 0) return false;
+
+    //<< is not < followed by <
+    if(length == 1 && e->position + 1 < e->length && (op[0] == '<' || op[0] == '>') && e->text[e->position + 1] == op[0]) return false;
+    e->position += length;
+    return true;
+}
+
+
+static long long parseOr(expression *e);
+
+
+//Helper function to read a number in decimal, or in hex or binary after 0x or 0b
+static long long parseLiteral(expression *e){
+    const char *text = e->text + e->position;
+    size_t end = e->position;
+    while(end < e->length && isNameChar(e->text[end])) end++;
+    size_t length = end - e->position;
+    e->position = end;
+
+    int base = 10;
+    size_t i = 0;
+    if(length > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')){
+        base = 16;
+        i = 2;
+    }
+    else if(length > 2 && text[0] == '0' && (text[1] == 'b' || text[1] == 'B')){
+        base = 2;
+        i = 2;
+    }
+
+    long long value = 0;
+    for(; i < length; i++){
+        int c = tolower((unsigned char)text[i]);
+        int digit = isdigit(c) ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : base;
+        if(digit >= base){
+            fail(e, "Invalid number %.*s", (int)length, text);
+            return 0;
+        }
+        value = saturate(value * base + digit);
+    }
+    return value;
+}
+
+
+//Helper function to get the value of a constant, working it out the first time.
+//A value that depends on an anchor point is worked out again every time.
+static long long constantValue(expression *e, int index, const char *name, size_t length){
+    assembler *ctx = e->ctx;
+    constant *c = &ctx->constants[index];
+
+    switch(c->state){
+        case CONSTANT_KNOWN:
+            return c->value;
+        case CONSTANT_FAILED:
+            e->failed = e->reported = true;
+            return 0;
+        case CONSTANT_BUSY:
+            fail(e, "Constant %.*s is defined in terms of itself", (int)length, name);
+            return 0;
+    }
+
+    expression inner = {.ctx = ctx, .text = c->text, .length = c->length, .mode = e->mode, .addresses = e->addresses};
+    c->state = CONSTANT_BUSY;
+    long long value = parseOr(&inner);
+    if(!inner.failed && peek(&inner) != 0) fail(&inner, "Unexpected %c in %.*s", inner.text[inner.position], (int)inner.length, inner.text);
+
+    //Errors belong to the equ line, and are only reported once
+    if(inner.failed && !(inner.later && e->mode < EVALUATE_RESOLVE)){
+        if(!inner.reported){
+            int line = ctx->line;
+            ctx->line = c->line;
+            error(ctx, "%s", inner.message);
+            ctx->line = line;
+        }
+        c->state = CONSTANT_FAILED;
+        e->failed = e->reported = true;
+        return 0;
+    }
+
+    c->state = CONSTANT_UNKNOWN;
+    e->later |= inner.later;
+    e->anchored |= inner.anchored;
+    if(!inner.later && !inner.anchored){
+        c->state = CONSTANT_KNOWN;
+        c->value = value;
+    }
+    return value;
+}
+
+
+//Helper function to get the value of a constant or anchor point
+static long long nameValue(expression *e){
+    assembler *ctx = e->ctx;
+    const char *name = e->text + e->position;
+    size_t length = 0;
+    while(e->position + length < e->length && isNameChar(name[length])) length++;
+    e->position += length;
+
+    if(e->mode == EVALUATE_LITERALS){
+        e->later = true;
+        return 0;
+    }
+
+    if(ctx->constantNames != NULL){
+        int index = getPCFromAnchorpoint(name, length, ctx->constantNames);
+        if(index != -1) return constantValue(e, index, name, length);
+    }
+
+    int place = getPCFromAnchorpoint(name, length, ctx->anchors);
+    ctx->symbolLookups++;
+    if(place != -1){
+        if(e->mode != EVALUATE_LAYOUT){
+            e->later = true;
+            return 0;
+        }
+        e->anchored = true;
+        return e->addresses->offsets[place];
+    }
+
+    //Reading the source, the name can still be defined further on
+    if(e->mode == EVALUATE_CONSTANTS){
+        e->later = true;
+        return 0;
+    }
+    fail(e, "Expected value, %.*s is not an anchor point or constant", (int)length, name);
+    return 0;
+}
+
+
+//Helper function to read a number, name, bracketed expression or unary operator
+static long long parseUnary(expression *e){
+    char c = peek(e);
+
+    if(take(e, "-")) return saturate(-parseUnary(e));
+    if(take(e, "+")) return parseUnary(e);
+    if(take(e, "~")) return ~parseUnary(e);
+    if(take(e, "(")){
+        long long value = parseOr(e);
+        if(!take(e, ")")) fail(e, "Expected ) in %.*s", (int)e->length, e->text);
+        return value;
+    }
+    if(isdigit((unsigned char)c)) return parseLiteral(e);
+    if(isNameStart(c)) return nameValue(e);
+
+    if(c == 0) fail(e, "Expected value at the end of %.*s", (int)e->length, e->text);
+    else fail(e, "Unexpected %c in %.*s", c, (int)e->length, e->text);
+    e->position = e->length;
+    return 0;
+}
+
+
+static long long parseProduct(expression *e){
+    long long value = parseUnary(e);
+    while(1){
+        bool divide;
+        if(take(e, "*")){
+            value = saturate(value * parseUnary(e));
+            continue;
+        }
+        else if(take(e, "/")) divide = true;
+        else if(take(e, "%")) divide = false;
+        else return value;
+
+        //A name for later stands in as 0, so only a real 0 is an error
+        long long right = parseUnary(e);
+        if(right == 0){
+            if(!e->later) fail(e, "Division by zero in %.*s", (int)e->length, e->text);
+            continue;
+        }
+        value = divide ? value / right : value % right;
+    }
+}
+
+
+static long long parseSum(expression *e){
+    long long value = parseProduct(e);
+    while(1){
+        if(take(e, "+")) value = saturate(value + parseProduct(e));
+        else if(take(e, "-")) value = saturate(value - parseProduct(e));
+        else return value;
+    }
+}
+
+
+static long long parseShift(expression *e){
+    long long value = parseSum(e);
+    while(1){
+        bool left = take(e, "<<");
+        if(!left && !take(e, ">>")) return value;
+
+        long long amount = parseSum(e);
+        if(amount < 0 || amount > 31){
+            fail(e, "Shift must be between 0 and 31 in %.*s", (int)e->length, e->text);
+            continue;
+        }
+        value = left ? saturate(value * (1LL << amount)) : value >> amount;
+    }
+}
+
+
+static long long parseAnd(expression *e){
+    long long value = parseShift(e);
+    while(take(e, "&")) value &= parseShift(e);
+    return value;
+}
+
+
+static long long parseXor(expression *e){
+    long long value = parseAnd(e);
+    while(take(e, "^")) value ^= parseAnd(e);
+    return value;
+}
+
+
+static long long parseOr(expression *e){
+    long long value = parseXor(e);
+    while(take(e, "|")) value |= parseXor(e);
+    return value;
+}
+
+
+int evaluate(assembler *ctx, const char *text, size_t length, int mode, const addressMap *addresses, int *value){
+    expression e = {.ctx = ctx, .text = text, .length = length, .mode = mode, .addresses = addresses};
+
+    long long result = parseOr(&e);
+    if(!e.failed && peek(&e) != 0) fail(&e, "Unexpected %c in %.*s", text[e.position], (int)length, text);
+
+    //Before every name is known, an error can be down to a name that is not
+    //one yet, so it is left for later as well
+    if(e.later && mode < EVALUATE_RESOLVE) return EXPRESSION_LATER;
+    if(e.failed){
+        if(!e.reported) error(ctx, "%s", e.message);
+        return EXPRESSION_ERROR;
+    }
+    if(e.later) return EXPRESSION_LATER;
+
+    *value = result;
+    return EXPRESSION_OK;
+}
+
+
+bool usesNames(const char *text, size_t length){
+    for(size_t i = 0; i < length; i++){
+        if(isdigit((unsigned char)text[i])){
+            while(i + 1 < length && isNameChar(text[i + 1])) i++;
+        }
+        else if(isNameStart(text[i])) return true;
+    }
+    return false;
+}
+
+
+void defineConstant(assembler *ctx, const char *name, size_t length, const char *value, size_t valueLength){
+    if(ctx->constantNames == NULL){
+        ctx->constantNames = newAnchorPointList();
+        if(ctx->constantNames == NULL){
+            ctx->outOfMemory = true;
+            return;
+        }
+    }
+
+    if(getPCFromAnchorpoint(name, length, ctx->anchors) != -1){
+        error(ctx, "%.*s is already an anchor point", (int)length, name);
+        return;
+    }
+
+    if(ctx->constantSize == ctx->constantCapacity){
+        size_t newCapacity = ctx->constantCapacity ? ctx->constantCapacity * 2 : 16;
+        constant *temp = realloc(ctx->constants, newCapacity * sizeof(ctx->constants[0]));
+        if(temp == NULL){
+            ctx->outOfMemory = true;
+            return;
+        }
+        ctx->constants = temp;
+        ctx->constantCapacity = newCapacity;
+    }
+
+    int result = addAnchorPoint(ctx->constantNames, name, length, ctx->constantSize);
+    if(result == ANCHOR_DUPLICATE){
+        error(ctx, "Constant %.*s is already defined", (int)length, name);
+        return;
+    }
+    if(result != ANCHOR_OK){
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    constant *c = &ctx->constants[ctx->constantSize++];
+    c->text = value;
+    c->length = valueLength;
+    c->line = ctx->line;
+    c->value = 0;
+    c->state = CONSTANT_UNKNOWN;
+}
@@ -0,0 +1,61 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Integer expressions in operands, and the constants equ lines define
+
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "assembler.h"
+
+//How much is known when an expression is evaluated
+#define EVALUATE_LITERALS 0     //Only numbers, any name is left for later
+#define EVALUATE_CONSTANTS 1    //Constants defined so far, other names are left for later
+#define EVALUATE_RESOLVE 2      //Every name is defined, anchor points are left for later
+#define EVALUATE_LAYOUT 3       //Anchor points have addresses
+
+//Results of evaluate
+#define EXPRESSION_OK 0
+#define EXPRESSION_ERROR 1      //The error has been reported
+#define EXPRESSION_LATER 2      //Uses a name that is not known yet
+
+//Where anchor points are in the image, for EVALUATE_LAYOUT
+typedef struct{
+    const size_t *offsets;      //Address of every instruction and piece of data
+} addressMap;
+
+//Evaluate an expression such as sprites + 5 * row. Numbers are decimal, or hex
+//and binary with 0x and 0b. addresses is only used with EVALUATE_LAYOUT.
+int evaluate(assembler *ctx, const char *text, size_t length, int mode, const addressMap *addresses, int *value);
+
+//See if an expression uses a name, so its value may not be known until layout
+bool usesNames(const char *text, size_t length);
+
+//Define a constant from an equ line. Its value is worked out when it is first used.
+void defineConstant(assembler *ctx, const char *name, size_t length, const char *value, size_t valueLength);
+
+#endif
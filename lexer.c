@@ -0,0 +1,287 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#define NO_MMAP
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "lexer.h"
+
+//Character classes used by the lexer
+#define CHAR_WORD 0
+#define CHAR_SEPARATOR 1
+#define CHAR_NEWLINE 2
+#define CHAR_COMMENT 3
+#define CHAR_END 4
+
+static const unsigned char charClass[256] = {
+    [' '] = CHAR_SEPARATOR,
+    ['\t'] = CHAR_SEPARATOR,
+    ['\r'] = CHAR_SEPARATOR,
+    [','] = CHAR_SEPARATOR,
+    ['\n'] = CHAR_NEWLINE,
+    [';'] = CHAR_COMMENT,
+    ['\0'] = CHAR_SEPARATOR,
+};
+
+
+#ifdef NO_MMAP
+//Without mmap the whole file is read into one buffer instead
+int openSource(const char *path, sourceFile *source){
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) return 1;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *text = malloc(size > 0 ? size : 1);
+    if(text == NULL || fread(text, 1, size, f) != (size_t)size){
+        free(text);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    source->text = text;
+    source->size = size;
+    source->mapped = false;
+    source->allocated = true;
+    return 0;
+}
+#else
+int openSource(const char *path, sourceFile *source){
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) return 1;
+
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        close(fd);
+        return 1;
+    }
+
+    //Tokens store 32 bit offsets
+    if((uint64_t)st.st_size > UINT32_MAX){
+        close(fd);
+        return 1;
+    }
+
+    source->size = st.st_size;
+    source->mapped = st.st_size > 0;
+    source->allocated = false;
+    source->text = "";
+
+    if(source->mapped){
+        void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(text == MAP_FAILED){
+            close(fd);
+            return 1;
+        }
+        madvise(text, st.st_size, MADV_SEQUENTIAL);
+        source->text = text;
+    }
+
+    close(fd);
+    return 0;
+}
+
+#endif
+
+
+int readSource(FILE *stream, sourceFile *source){
+    size_t size = 0;
+    size_t capacity = 65536;
+    char *text = malloc(capacity);
+    if(text == NULL) return 1;
+
+    size_t got;
+    while((got = fread(text + size, 1, capacity - size, stream)) > 0){
+        size += got;
+        if(size == capacity){
+            //Tokens store 32 bit offsets
+            if(capacity > UINT32_MAX / 2){
+                free(text);
+                return 1;
+            }
+
+            char *temp = realloc(text, capacity * 2);
+            if(temp == NULL){
+                free(text);
+                return 1;
+            }
+            text = temp;
+            capacity *= 2;
+        }
+    }
+    if(ferror(stream)){
+        free(text);
+        return 1;
+    }
+
+    source->text = text;
+    source->size = size;
+    source->mapped = false;
+    source->allocated = true;
+    return 0;
+}
+
+
+void closeSource(sourceFile *source){
+#ifndef NO_MMAP
+    if(source->mapped) munmap((void*)source->text, source->size);
+#endif
+    if(source->allocated) free((char*)source->text);
+    source->text = NULL;
+}
+
+
+void initLexer(lexer *l, const char *text, size_t size){
+    l->text = text;
+    l->size = size;
+    l->position = 0;
+    l->line = 1;
+    l->lineStart = true;
+}
+
+void seekLexer(lexer *l, size_t position, int line){
+    l->position = position;
+    l->line = line;
+    l->lineStart = true;
+}
+
+//Get the class of the character at position, treating the end of the text as CHAR_END
+static inline unsigned char classAt(const lexer *l, size_t position){
+    if(position >= l->size) return CHAR_END;
+    return charClass[(unsigned char)l->text[position]];
+}
+
+token nextToken(lexer *l){
+    token t;
+
+    while(1){
+        unsigned char c = classAt(l, l->position);
+
+        if(c == CHAR_SEPARATOR){
+            l->position++;
+        }
+        else if(c == CHAR_COMMENT){
+            while(classAt(l, l->position) != CHAR_NEWLINE && classAt(l, l->position) != CHAR_END) l->position++;
+        }
+        else if(c == CHAR_NEWLINE){
+            t.offset = l->position++;
+            t.length = 1;
+            t.kind = TOKEN_NEWLINE;
+            l->line++;
+            l->lineStart = true;
+            return t;
+        }
+        else if(c == CHAR_END){
+            t.offset = l->position;
+            t.length = 0;
+            t.kind = TOKEN_END;
+            return t;
+        }
+        else break;
+    }
+
+    size_t start = l->position;
+    while(classAt(l, l->position) == CHAR_WORD) l->position++;
+
+    t.kind = TOKEN_WORD;
+    if(l->lineStart && l->text[start] == '.'){
+        t.kind = TOKEN_ANCHOR;
+        start++;
+    }
+
+    t.offset = start;
+    t.length = l->position - start;
+    l->lineStart = false;
+    return t;
+}
+
+
+bool wordIs(const char *word, size_t length, const char *keyword){
+    size_t i = 0;
+    while(i < length && keyword[i] != '\0' && tolower((unsigned char)word[i]) == keyword[i]) i++;
+    return i == length && keyword[i] == '\0';
+}
+
+
+//Helper function to see if a character is an operator or bracket of an expression
+static bool isOperator(char c){
+    return c != '\0' && strchr("+-*/%&|^~<>()", c) != NULL;
+}
+
+token nextExpression(lexer *l){
+    token t = nextToken(l);
+    if(t.kind != TOKEN_WORD) return t;
+
+    int depth = 0;
+    bool counted = false;
+    while(1){
+        //Most operands end at a comma or the end of the line, which is cheaper
+        //to see than to lex
+        size_t p = l->position;
+        while(p < l->size && (l->text[p] == ' ' || l->text[p] == '\t' || l->text[p] == '\r')) p++;
+        if(p >= l->size || l->text[p] == ',' || l->text[p] == '\n' || l->text[p] == ';') break;
+
+        if(!counted){
+            counted = true;
+            for(uint32_t i = 0; i < t.length; i++) depth += (l->text[t.offset + i] == '(') - (l->text[t.offset + i] == ')');
+        }
+
+        //A word is part of the expression if the expression so far is not finished,
+        //or the word goes on with a binary operator. -1 or %tmp after a word is a new operand.
+        char last = l->text[t.offset + t.length - 1];
+        bool unfinished = depth > 0 || (isOperator(last) && last != ')');
+        if(!unfinished && !isOperator(l->text[p])) break;
+
+        lexer next = *l;
+        token u = nextToken(&next);
+        if(u.kind != TOKEN_WORD) break;
+
+        const char *word = l->text + u.offset;
+        bool operatorOnly = true;
+        for(uint32_t i = 0; i < u.length; i++) operatorOnly = operatorOnly && isOperator(word[i]) && word[i] != '(';
+        bool virtualRegister = word[0] == '%' && u.length > 1;
+        bool continues = word[0] != '(' && word[0] != '~' && !virtualRegister && (operatorOnly || (word[0] != '-' && word[0] != '+'));
+        if(!unfinished && !continues) break;
+
+        for(uint32_t i = 0; i < u.length; i++) depth += (word[i] == '(') - (word[i] == ')');
+        t.length = u.offset + u.length - t.offset;
+        *l = next;
+    }
+    return t;
+}
@@ -0,0 +1,90 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+//Kinds of token the lexer produces. Separators (spaces, tabs and commas)
+//and comments never become tokens.
+typedef enum{
+    TOKEN_END,
+    TOKEN_NEWLINE,
+    TOKEN_WORD,
+    TOKEN_ANCHOR        //.name at the start of a line, the slice excludes the '.'
+} tokenKind;
+
+//A token is a slice of the source text, it is never copied
+typedef struct{
+    uint32_t offset;
+    uint32_t length;
+    tokenKind kind;
+} token;
+
+typedef struct{
+    const char *text;
+    size_t size;
+    size_t position;
+    int line;
+    bool lineStart;
+} lexer;
+
+//A source file mapped into memory
+typedef struct{
+    const char *text;
+    size_t size;
+    bool mapped;
+    bool allocated;
+} sourceFile;
+
+//Map a source file read-only. Returns 0 on success.
+int openSource(const char *path, sourceFile *source);
+
+//Read a whole stream that cannot be mapped, such as a pipe on stdin. Returns 0 on success.
+int readSource(FILE *stream, sourceFile *source);
+void closeSource(sourceFile *source);
+
+void initLexer(lexer *l, const char *text, size_t size);
+
+//Continue lexing from the start of a line somewhere else in the text
+void seekLexer(lexer *l, size_t position, int line);
+
+//Get the next token. The line count is advanced when a TOKEN_NEWLINE is returned.
+token nextToken(lexer *l);
+
+//Get the next token, joining the words of an expression such as base + 5 * row
+//into one TOKEN_WORD. Words are joined across spaces but never across a comma.
+token nextExpression(lexer *l);
+
+//See if a word is a keyword, ignoring case
+bool wordIs(const char *word, size_t length, const char *keyword);
+
+static inline const char *tokenText(const lexer *l, token t){
+    return l->text + t.offset;
+}
+
+#endif
@@ -0,0 +1,242 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#include "macro.h"
+#include "opcodes.h"
+#include "directive.h"
+
+
+//Helper function to see if a word can name a macro or parameter
+static bool isName(const char *word, size_t length){
+    if(length == 0 || !(isalpha((unsigned char)word[0]) || word[0] == '_')) return false;
+    for(size_t i = 1; i < length; i++){
+        if(!isalnum((unsigned char)word[i]) && word[i] != '_') return false;
+    }
+    return true;
+}
+
+
+//Helper function to compare two names of the same length, ignoring case
+static bool sameName(const char *a, const char *b, size_t length){
+    size_t i = 0;
+    while(i < length && tolower((unsigned char)a[i]) == tolower((unsigned char)b[i])) i++;
+    return i == length;
+}
+
+
+//Helper function to see if a character is part of a word that can be replaced in a macro body
+static bool isBodyChar(char c){
+    return isalnum((unsigned char)c) || c == '_' || c == '@';
+}
+
+
+void beginMacro(assembler *ctx, const token *tokens, int count, size_t bodyStart){
+    if(ctx->macroDepth > 0){
+        error(ctx, "Macros can not be defined inside a macro");
+        return;
+    }
+
+    if(ctx->macroSize == ctx->macroCapacity){
+        size_t newCapacity = ctx->macroCapacity ? ctx->macroCapacity * 2 : 16;
+        macro *temp = realloc(ctx->macros, newCapacity * sizeof(ctx->macros[0]));
+        if(temp == NULL){
+            ctx->outOfMemory = true;
+            return;
+        }
+        ctx->macros = temp;
+        ctx->macroCapacity = newCapacity;
+    }
+
+    //The body is read up to endm even when the macro line is wrong, so its
+    //lines are not taken for instructions
+    macro *m = &ctx->macros[ctx->macroSize++];
+    memset(m, 0, sizeof(*m));
+    m->line = ctx->line;
+    m->body = ctx->source + bodyStart;
+    ctx->defining = true;
+
+    if(count < 2){
+        error(ctx, "Expected macro name");
+        return;
+    }
+    const char *name = ctx->source + tokens[1].offset;
+    size_t length = tokens[1].length;
+    m->name = name;
+    m->nameLength = length;
+
+    if(!isName(name, length) || findMnemonic(name, length) != NULL || findDirective(name, length) != NULL
+       || wordIs(name, length, "macro") || wordIs(name, length, "endm") || wordIs(name, length, "equ")){
+        error(ctx, "%.*s can not be the name of a macro", (int)length, name);
+        return;
+    }
+    if(count - 2 > MACRO_PARAMETERS){
+        error(ctx, "Macros can have at most %i parameters", MACRO_PARAMETERS);
+        return;
+    }
+
+    for(int i = 2; i < count; i++){
+        const char *parameter = ctx->source + tokens[i].offset;
+        size_t parameterLength = tokens[i].length;
+        if(!isName(parameter, parameterLength)){
+            error(ctx, "Expected parameter name, %.*s is not one", (int)parameterLength, parameter);
+            return;
+        }
+        for(int j = 0; j < m->parameterCount; j++){
+            if(m->parameterLengths[j] == parameterLength && sameName(m->parameters[j], parameter, parameterLength)){
+                error(ctx, "Parameter %.*s is repeated", (int)parameterLength, parameter);
+                return;
+            }
+        }
+        m->parameters[m->parameterCount] = parameter;
+        m->parameterLengths[m->parameterCount] = parameterLength;
+        m->parameterCount++;
+    }
+
+    if(ctx->macroNames == NULL){
+        ctx->macroNames = newAnchorPointList();
+        if(ctx->macroNames == NULL){
+            ctx->outOfMemory = true;
+            return;
+        }
+    }
+    int result = addAnchorPoint(ctx->macroNames, name, length, ctx->macroSize - 1);
+    if(result == ANCHOR_DUPLICATE) error(ctx, "Macro %.*s is already defined", (int)length, name);
+    else if(result != ANCHOR_OK) ctx->outOfMemory = true;
+}
+
+
+void readMacroLine(assembler *ctx, const token *tokens, int count, size_t lineStart){
+    if(count == 0 || tokens[0].kind != TOKEN_WORD) return;
+
+    const char *word = ctx->source + tokens[0].offset;
+    if(wordIs(word, tokens[0].length, "macro")){
+        error(ctx, "Macros can not be defined inside a macro");
+    }
+    else if(wordIs(word, tokens[0].length, "endm")){
+        macro *m = &ctx->macros[ctx->macroSize - 1];
+        m->bodyLength = ctx->source + lineStart - m->body;
+        ctx->defining = false;
+        if(count > 1) error(ctx, "Unexpected token after endm");
+    }
+}
+
+
+void endMacros(assembler *ctx){
+    if(!ctx->defining) return;
+
+    const macro *m = &ctx->macros[ctx->macroSize - 1];
+    ctx->line = m->line;
+    error(ctx, "Macro %.*s has no endm", (int)m->nameLength, m->name);
+    ctx->defining = false;
+}
+
+
+int findMacro(const assembler *ctx, const char *name, size_t length){
+    if(ctx->macroNames == NULL) return -1;
+    return getPCFromAnchorpoint(name, length, ctx->macroNames);
+}
+
+
+//Helper function to add text to an expansion, or only count it when out is NULL
+static void put(char *out, size_t *size, const char *text, size_t length){
+    if(out != NULL) memcpy(out + *size, text, length);
+    *size += length;
+}
+
+
+//Helper function to write the expansion of a macro to out, or only work out
+//its size when out is NULL. Returns the size.
+static size_t substitute(const assembler *ctx, const macro *m, const token *arguments, int expansion, char *out){
+    char suffix[16];
+    int suffixLength = snprintf(suffix, sizeof(suffix), "@%i", expansion);
+
+    size_t size = 0;
+    size_t i = 0;
+    while(i < m->bodyLength){
+        const char *word = m->body + i;
+        size_t length = 0;
+        while(i + length < m->bodyLength && isBodyChar(word[length])) length++;
+        if(length == 0){
+            put(out, &size, word, 1);
+            i++;
+            continue;
+        }
+        i += length;
+
+        int parameter = -1;
+        if(!isdigit((unsigned char)word[0])){
+            for(int j = 0; j < m->parameterCount && parameter == -1; j++){
+                if(m->parameterLengths[j] == length && sameName(m->parameters[j], word, length)) parameter = j;
+            }
+        }
+
+        if(parameter != -1){
+            //An expression keeps its meaning next to other operators
+            const char *argument = ctx->source + arguments[parameter].offset;
+            size_t argumentLength = arguments[parameter].length;
+            //The % of a virtual register is not an operator
+            bool bracket = false;
+            for(size_t j = argument[0] == '%'; j < argumentLength; j++) bracket = bracket || strchr("+-*/%&|^~<> ", argument[j]) != NULL;
+            if(bracket) put(out, &size, "(", 1);
+            put(out, &size, argument, argumentLength);
+            if(bracket) put(out, &size, ")", 1);
+        }
+        else{
+            put(out, &size, word, length);
+            if(word[0] == '@') put(out, &size, suffix, suffixLength);
+        }
+    }
+    return size;
+}
+
+
+const char *expandMacro(assembler *ctx, int index, const token *arguments, int count, size_t *size){
+    const macro *m = &ctx->macros[index];
+    if(count != m->parameterCount){
+        error(ctx, "Macro %.*s takes %i argument%s", (int)m->nameLength, m->name, m->parameterCount, m->parameterCount == 1 ? "" : "s");
+        return NULL;
+    }
+    if(ctx->macroDepth >= MACRO_DEPTH){
+        error(ctx, "Macros expand inside each other more than %i deep", MACRO_DEPTH);
+        return NULL;
+    }
+
+    int expansion = ++ctx->expansions;
+    size_t length = substitute(ctx, m, arguments, expansion, NULL);
+    char *text = (char *)allocateData(ctx, length);
+    if(text == NULL){
+        ctx->outOfMemory = true;
+        return NULL;
+    }
+    substitute(ctx, m, arguments, expansion, text);
+
+    *size = length;
+    return text;
+}
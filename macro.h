@@ -0,0 +1,56 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Macros: named blocks of source with parameters, expanded where they are used
+
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "assembler.h"
+#include "lexer.h"
+
+//Macros can use macros, up to this many expansions deep
+#define MACRO_DEPTH 32
+
+//Start a macro from a line macro name, parameters. Its body is the source from
+//bodyStart up to the endm line.
+void beginMacro(assembler *ctx, const token *tokens, int count, size_t bodyStart);
+
+//Read a line of a macro's body. lineStart is where the line begins in the source.
+void readMacroLine(assembler *ctx, const token *tokens, int count, size_t lineStart);
+
+//Report a macro that is still open at the end of the source
+void endMacros(assembler *ctx);
+
+//Get the macro a word names, or -1 if there is none
+int findMacro(const assembler *ctx, const char *name, size_t length);
+
+//Get the body of a macro with its parameters replaced by the arguments, and its
+//local @anchor points renamed for this expansion. Returns NULL on error.
+const char *expandMacro(assembler *ctx, int index, const token *arguments, int count, size_t *size);
+
+#endif
@@ -0,0 +1,289 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "opcodes.h"
+
+#define R OPERAND_REGISTER
+#define V0 OPERAND_V0
+#define KK OPERAND_BYTE
+#define NNN OPERAND_ADDR
+#define N OPERAND_NIBBLE
+
+//Every form of every instruction. Forms of the same mnemonic must be adjacent.
+const opcodeEntry opcodeTable[] = {
+    {"sys",  0, {0},                       0x0000, OPCODE_IGNORED},
+    {"cls",  0, {0},                       0x00E0, 0},
+    {"ret",  0, {0},                       0x00EE, 0},
+    {"jp",   1, {NNN},                     0x1000, 0},
+    {"jp",   2, {V0, NNN},                 0xB000, 0},
+    {"call", 1, {NNN},                     0x2000, 0},
+    {"se",   2, {R, KK},                   0x3000, 0},
+    {"se",   2, {R, R},                    0x5000, 0},
+    {"sne",  2, {R, KK},                   0x4000, 0},
+    {"sne",  2, {R, R},                    0x9000, 0},
+    {"ld",   2, {R, R},                    0x8000, 0},
+    {"ld",   2, {R, OPERAND_DT},           0xF007, 0},
+    {"ld",   2, {R, OPERAND_K},            0xF00A, 0},
+    {"ld",   2, {R, OPERAND_MEMORY},       0xF041, 0},
+    {"ld",   2, {R, KK},                   0x6000, 0},
+    {"ld",   2, {OPERAND_I, R},            0xF030, 0},
+    {"ld",   2, {OPERAND_I, NNN},          0xA000, 0},
+    {"ld",   2, {OPERAND_DT, R},           0xF00F, 0},
+    {"ld",   2, {OPERAND_ST, R},           0xF012, 0},
+    {"ld",   2, {OPERAND_F, R},            0xF01D, 0},
+    {"ld",   2, {OPERAND_B, R},            0xF021, 0},
+    {"ld",   2, {OPERAND_MEMORY, R},       0xF037, 0},
+    {"add",  2, {R, R},                    0x8004, 0},
+    {"add",  2, {R, KK},                   0x7000, 0},
+    {"add",  2, {OPERAND_I, R},            0xF01E, 0},
+    {"or",   2, {R, R},                    0x8001, 0},
+    {"and",  2, {R, R},                    0x8002, 0},
+    {"xor",  2, {R, R},                    0x8003, 0},
+    {"sub",  2, {R, R},                    0x8005, 0},
+    {"shr",  1, {R},                       0x8006, 0},
+    {"subn", 2, {R, R},                    0x8007, 0},
+    {"shl",  1, {R},                       0x800E, 0},
+    {"rnd",  2, {R, KK},                   0xC000, 0},
+    {"drw",  3, {R, R, N},                 0xD000, 0},
+    {"skp",  1, {R},                       0xE09E, 0},
+    {"sknp", 1, {R},                       0xE0A1, 0},
+    {"jeq",  3, {R, KK, NNN},              0x4000, OPCODE_BRANCH},
+    {"jeq",  3, {R, R, NNN},               0x9000, OPCODE_BRANCH},
+    {"jne",  3, {R, KK, NNN},              0x3000, OPCODE_BRANCH},
+    {"jne",  3, {R, R, NNN},               0x5000, OPCODE_BRANCH},
+    {"jkey", 2, {R, NNN},                  0xE0A1, OPCODE_BRANCH},
+    {"jnkey", 2, {R, NNN},                 0xE09E, OPCODE_BRANCH},
+};
+
+const int opcodeCount = sizeof(opcodeTable) / sizeof(opcodeTable[0]);
+
+#undef R
+#undef V0
+#undef KK
+#undef NNN
+#undef N
+
+//Mnemonics are at most 8 characters, so each one packs into a 64 bit key.
+//The index is a perfect hash of those keys, with the multiplier picked when
+//the table is built so that no two mnemonics share a slot.
+#define MAX_MNEMONIC 8
+#define INDEX_BITS 7
+#define INDEX_SIZE (1 << INDEX_BITS)
+
+typedef struct{
+    uint64_t key;
+    short first;
+} mnemonicSlot;
+
+static mnemonicSlot mnemonicIndex[INDEX_SIZE];
+static uint64_t indexMultiplier = 0;
+
+//One past the last form of the mnemonic whose first form is at each index
+static short formEnd[sizeof(opcodeTable) / sizeof(opcodeTable[0])];
+
+//Form that every possible opcode decodes to, as an index + 1, or 0 if none does
+static unsigned char decodeIndex[65536];
+
+
+//Pack a lowercase copy of a name into a key, or return 0 if it is too long
+static uint64_t packName(const char *name, size_t length){
+    if(length == 0 || length > MAX_MNEMONIC) return 0;
+
+    uint64_t key = 0;
+    for(size_t i = 0; i < length; i++){
+        unsigned char c = name[i];
+        if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        key = (key << 8) | c;
+    }
+    return key;
+}
+
+static inline size_t slotFor(uint64_t key, uint64_t multiplier){
+    return (key * multiplier) >> (64 - INDEX_BITS);
+}
+
+
+int initOpcodeTable(void){
+    if(indexMultiplier) return 0;
+
+    //Try odd multipliers until every mnemonic lands in its own slot
+    uint64_t multiplier;
+    for(multiplier = 0x9E3779B97F4A7C15ull; ; multiplier += 2){
+        memset(mnemonicIndex, 0, sizeof(mnemonicIndex));
+        bool collision = false;
+
+        for(int i = 0; i < opcodeCount && !collision; i++){
+            const char *name = opcodeTable[i].mnemonic;
+            uint64_t key = packName(name, strlen(name));
+            mnemonicSlot *slot = &mnemonicIndex[slotFor(key, multiplier)];
+
+            if(slot->key == key){
+                formEnd[slot->first] = i + 1;
+            }
+            else if(slot->key == 0){
+                slot->key = key;
+                slot->first = i;
+                formEnd[i] = i + 1;
+            }
+            else collision = true;
+        }
+
+        if(!collision) break;
+    }
+
+    //Fill in every opcode each form can produce by walking the subsets of its free bits.
+    //A branch is never in the image as itself.
+    for(int i = 0; i < opcodeCount; i++){
+        if(opcodeTable[i].flags & (OPCODE_IGNORED | OPCODE_BRANCH)) continue;
+
+        unsigned short fixed = opcodeMask(&opcodeTable[i]);
+        unsigned short free = ~fixed;
+        unsigned short sub = free;
+        while(1){
+            unsigned short opcode = opcodeTable[i].opcode | sub;
+            if(decodeIndex[opcode] == 0) decodeIndex[opcode] = i + 1;
+            if(sub == 0) break;
+            sub = (sub - 1) & free;
+        }
+    }
+
+    indexMultiplier = multiplier;
+    return 0;
+}
+
+const opcodeEntry *findMnemonic(const char *name, size_t length){
+    uint64_t key = packName(name, length);
+    if(key == 0) return NULL;
+
+    const mnemonicSlot *slot = &mnemonicIndex[slotFor(key, indexMultiplier)];
+    return slot->key == key ? &opcodeTable[slot->first] : NULL;
+}
+
+operandKind classifyOperand(const char *word, size_t length){
+    //A virtual register such as %tmp
+    if(length >= 2 && word[0] == '%') return OPERAND_REGISTER;
+
+    if(length >= 2 && length <= 3 && (word[0] == 'v' || word[0] == 'V')){
+        bool digits = true;
+        for(size_t i = 1; i < length; i++){
+            if(!isdigit((unsigned char)word[i])) digits = false;
+        }
+        if(digits) return OPERAND_REGISTER;
+    }
+
+    switch(length){
+        case 1:
+            switch(tolower((unsigned char)word[0])){
+                case 'i': return OPERAND_I;
+                case 'k': return OPERAND_K;
+                case 'f': return OPERAND_F;
+                case 'b': return OPERAND_B;
+            }
+            break;
+        case 2:
+            if(strncasecmp(word, "dt", 2) == 0) return OPERAND_DT;
+            if(strncasecmp(word, "st", 2) == 0) return OPERAND_ST;
+            break;
+        case 3:
+            if(strncasecmp(word, "[i]", 3) == 0) return OPERAND_MEMORY;
+            break;
+    }
+    return OPERAND_VALUE;
+}
+
+//Check whether an operand class can be used where a form expects kind. With
+//keywordValues, a bare keyword such as b or dt can also be an anchor point name.
+static bool operandMatches(unsigned char kind, operandKind class, bool keywordValues){
+    switch(kind){
+        case OPERAND_V0:
+            return class == OPERAND_REGISTER;
+        case OPERAND_BYTE:
+        case OPERAND_ADDR:
+        case OPERAND_NIBBLE:
+            if(keywordValues && class >= OPERAND_I && class <= OPERAND_B) return true;
+            return class == OPERAND_VALUE;
+        default:
+            return kind == class;
+    }
+}
+
+const opcodeEntry *matchOperands(const opcodeEntry *first, const operandKind *kinds, int count){
+    const opcodeEntry *end = &opcodeTable[formEnd[first - opcodeTable]];
+
+    //Keywords pick their own forms first, and are only names when no form takes them
+    for(int pass = 0; pass < 2; pass++){
+        for(const opcodeEntry *e = first; e < end; e++){
+            if(e->operandCount != count) continue;
+
+            bool matches = true;
+            for(int i = 0; i < count; i++){
+                if(!operandMatches(e->operands[i], kinds[i], pass == 1)) matches = false;
+            }
+            if(matches) return e;
+        }
+    }
+    return NULL;
+}
+
+int operandMax(operandKind kind){
+    switch(kind){
+        case OPERAND_REGISTER: return 15;
+        case OPERAND_BYTE: return 255;
+        case OPERAND_ADDR: return 4095;
+        case OPERAND_NIBBLE: return 15;
+        default: return 0;
+    }
+}
+
+unsigned short opcodeMask(const opcodeEntry *form){
+    unsigned short mask = 0xFFFF;
+    int registerShift = 8;
+
+    for(int i = 0; i < form->operandCount; i++){
+        switch(form->operands[i]){
+            case OPERAND_REGISTER:
+                mask &= ~(0xF << registerShift);
+                registerShift -= 4;
+                break;
+            case OPERAND_BYTE:
+            case OPERAND_ADDR:
+            case OPERAND_NIBBLE:
+                mask &= ~operandMax(form->operands[i]);
+                break;
+            default:
+                break;
+        }
+    }
+    return mask;
+}
+
+const opcodeEntry *decodeOpcode(unsigned short opcode){
+    unsigned char index = decodeIndex[opcode];
+    return index ? &opcodeTable[index - 1] : NULL;
+}
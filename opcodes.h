@@ -0,0 +1,90 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#include <stddef.h>
+
+//Kinds of operand an instruction form can take. Register and value kinds are
+//encoded into the opcode, keyword kinds only select the form.
+typedef enum{
+    OPERAND_REGISTER,   //vx, the first register goes in x and the second in y
+    OPERAND_V0,         //Must be v0, not encoded
+    OPERAND_BYTE,       //kk, 0-255
+    OPERAND_ADDR,       //nnn, 0-4095
+    OPERAND_NIBBLE,     //n, 0-15
+    OPERAND_VALUE,      //Class of any number or anchor point, matches the three above
+    OPERAND_I,
+    OPERAND_DT,
+    OPERAND_ST,
+    OPERAND_K,
+    OPERAND_F,
+    OPERAND_B,
+    OPERAND_MEMORY      //[i]
+} operandKind;
+
+//Instruction is accepted but nothing is emitted for it
+#define OPCODE_IGNORED 1
+//Branch pseudo-instruction. The opcode is the skip that goes over a jp to the
+//last operand, so the jp is taken when the condition holds.
+#define OPCODE_BRANCH 2
+
+//One form of an instruction: mnemonic, operand signature and the opcode
+//template that its operands are ORed into
+typedef struct{
+    const char *mnemonic;
+    unsigned char operandCount;
+    unsigned char operands[3];
+    unsigned short opcode;
+    unsigned char flags;
+} opcodeEntry;
+
+extern const opcodeEntry opcodeTable[];
+extern const int opcodeCount;
+
+//Build the mnemonic and opcode indices. Must be called once before findMnemonic
+//or decodeOpcode.
+int initOpcodeTable(void);
+
+//Get the first form of a mnemonic, or NULL if it is unknown
+const opcodeEntry *findMnemonic(const char *name, size_t length);
+
+//Get the class of an operand word: OPERAND_REGISTER, a keyword kind or OPERAND_VALUE
+operandKind classifyOperand(const char *word, size_t length);
+
+//Get the form of first's mnemonic whose signature matches the operand classes,
+//or NULL if there is none. A keyword that no form takes is matched as a value,
+//since it can be the name of an anchor point.
+const opcodeEntry *matchOperands(const opcodeEntry *first, const operandKind *kinds, int count);
+
+//Largest value an operand kind can hold
+int operandMax(operandKind kind);
+
+//Bits of an opcode that are the same for every instance of a form
+unsigned short opcodeMask(const opcodeEntry *form);
+
+//Get the form an opcode was encoded from, or NULL if it is not an instruction
+const opcodeEntry *decodeOpcode(unsigned short opcode);
+
+#endif
@@ -0,0 +1,520 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "optimize.h"
+#include "symtab.h"
+#include "cfg.h"
+#include "outline.h"
+
+
+//Helper function to see if an opcode leaves I with a value that is not known
+//from the program text: jumps, calls and returns as well as writes to I
+static bool forgetsI(unsigned short opcode){
+    switch(opcode & 0xF000){
+        case 0x0000:
+        case 0x1000:
+        case 0x2000:
+        case 0xA000:
+        case 0xB000:
+            return true;
+        case 0xF000:
+            switch(opcode & 0xFF){
+                case 0x1D:
+                case 0x1E:
+                case 0x30:
+                case 0x37:
+                case 0x41:
+                    return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+
+const instruction *findPinned(const assembler *ctx){
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        const instruction *ins = &ctx->code[i];
+        if(ins->data != NULL) continue;
+        unsigned short group = ins->opcode & 0xF000;
+
+        if(group == 0xB000) return ins;
+        if((group == 0x1000 || group == 0x2000) && ins->target < 0) return ins;
+        if(group == 0xA000 && ins->max == 0 && (ins->opcode & 0xFFF) >= CHIP8_PROGRAM_START) return ins;
+    }
+    return NULL;
+}
+
+
+//What the peephole rules can see of the program around an instruction
+typedef struct{
+    const instruction *ins;
+    const instruction *prev;        //Instruction kept before ins, or NULL
+    const instruction *prev2;       //Instruction kept before prev, or NULL
+    bool labelled;                  //A reference points at ins, so it can be reached from elsewhere
+    int next;                       //Index of the instruction after ins, -1 at the end of a section
+
+    //Value of I before ins, if it is known
+    bool knowI;
+    unsigned short iOpcode;
+    int iTarget;
+} peephole;
+
+//A rule removes an instruction matching pattern under mask when removable
+//says it does nothing
+typedef struct{
+    const char *name;
+    unsigned short mask;
+    unsigned short pattern;
+    bool (*removable)(const peephole *p);
+} peepholeRule;
+
+
+//ld vx, vx
+static bool copiesToItself(const peephole *p){
+    return (p->ins->opcode >> 8 & 0xF) == (p->ins->opcode >> 4 & 0xF);
+}
+
+
+//ld vy, vx straight after ld vx, vy. The copy back is only a no-op if it
+//can not be reached without running the first copy.
+static bool copiesBack(const peephole *p){
+    if(p->labelled || p->prev == NULL) return false;
+    if(p->prev2 != NULL && isSkipOpcode(p->prev2->opcode)) return false;
+
+    unsigned short opcode = p->ins->opcode;
+    return p->prev->opcode == (0x8000 | (opcode & 0x0F0) << 4 | (opcode & 0xF00) >> 4);
+}
+
+
+//add vx, 0, which unlike 8xy4 does not touch vf. A 0 from an anchor point
+//does not count, it would change if the anchor point moved.
+static bool addsZero(const peephole *p){
+    return p->ins->max == 0;
+}
+
+
+//jp to the instruction right after it
+static bool jumpsToNext(const peephole *p){
+    return p->ins->max > 0 && p->ins->target == p->next;
+}
+
+
+//ld i with the value I already holds. An expression left for layout is never
+//known to be the same.
+static bool reloadsI(const peephole *p){
+    if(p->ins->max != 0 && p->ins->target < 0) return false;
+    return !p->labelled && p->knowI && p->ins->opcode == p->iOpcode && p->ins->target == p->iTarget;
+}
+
+
+static const peepholeRule peepholeRules[] = {
+    {"ld vx, vx",                   0xF00F, 0x8000, copiesToItself},
+    {"ld vy, vx after ld vx, vy",   0xF00F, 0x8000, copiesBack},
+    {"add vx, 0",                   0xF0FF, 0x7000, addsZero},
+    {"jp to the next instruction",  0xF000, 0x1000, jumpsToNext},
+    {"ld i with the value I holds", 0xF000, 0xA000, reloadsI},
+};
+
+#define PEEPHOLE_RULES (int)(sizeof(peepholeRules) / sizeof(peepholeRules[0]))
+
+//Count of skips removed with the instruction after them, kept after the rules' counts
+#define SKIPS_NOTHING PEEPHOLE_RULES
+
+
+//Helper function to take out every instruction marked in removed. Anchor points
+//and references to a removed instruction move to the next one that stays.
+//Returns the number of instructions removed.
+static size_t removeInstructions(assembler *ctx, const bool *removed){
+    size_t size = ctx->codeSize;
+    int *places = malloc((size + 1) * sizeof(int));
+    if(places == NULL){
+        ctx->outOfMemory = true;
+        return 0;
+    }
+
+    size_t kept = 0;
+    for(size_t i = 0; i < size; i++){
+        places[i] = kept;
+        if(!removed[i]) ctx->code[kept++] = ctx->code[i];
+    }
+    places[size] = kept;
+
+    for(size_t i = 0; i < kept; i++){
+        if(ctx->code[i].target >= 0) ctx->code[i].target = places[ctx->code[i].target];
+    }
+    moveAnchorPoints(ctx->anchors, places);
+    ctx->codeSize = kept;
+    ctx->PC = kept;
+
+    free(places);
+    return size - kept;
+}
+
+
+//Helper function to see if the instruction at index is right where the one at
+//from ends, with nothing but the empty data that ends part of a section between them
+static bool endsAt(const assembler *ctx, size_t from, int index){
+    const instruction *code = ctx->code;
+    if(index <= (int)from || (size_t)index >= ctx->codeSize || code[index].section != code[from].section) return false;
+    for(int i = from + 1; i < index; i++){
+        if(code[i].data == NULL || code[i].size > 0) return false;
+    }
+    return true;
+}
+
+
+//Helper function to see if the instruction at index comes right after a skip
+static bool followsSkip(const assembler *ctx, size_t index){
+    const instruction *code = ctx->code;
+    return index > 0 && code[index - 1].data == NULL && code[index - 1].section == code[index].section && isSkipOpcode(code[index - 1].opcode);
+}
+
+
+//Helper function to collapse the branches that can be as the program is now.
+//Returns the number collapsed.
+static size_t collapseRound(assembler *ctx){
+    size_t size = ctx->codeSize;
+    instruction *code = ctx->code;
+
+    bool *removed = calloc(size + 1, sizeof(bool));
+    if(removed == NULL){
+        ctx->outOfMemory = true;
+        return 0;
+    }
+
+    size_t collapsed = 0;
+    for(size_t i = 1; i < size; i++){
+        instruction *jump = &code[i];
+        if(!jump->branch || jump->target < 0) continue;
+
+        //A branch to the next instruction does nothing. If a skip before it can
+        //skip it, the jp stays on its own so the skip still goes over one instruction.
+        if(endsAt(ctx, i, jump->target)){
+            removed[i - 1] = true;
+            removed[i] = !followsSkip(ctx, i - 1);
+            jump->branch = false;
+            collapsed++;
+            continue;
+        }
+
+        //A branch followed by a jp to the same place goes there either way. The
+        //jp of the branch stays if a skip before it can land on it.
+        if(i + 1 < size && code[i + 1].data == NULL && (code[i + 1].opcode & 0xF000) == 0x1000 && code[i + 1].target == jump->target){
+            removed[i - 1] = true;
+            removed[i] = !followsSkip(ctx, i - 1);
+            jump->branch = false;
+            collapsed++;
+            continue;
+        }
+
+        //A branch over one instruction is the opposite skip, unless a skip
+        //before it would then go over the opposite skip instead of to the jp
+        if(i + 1 < size && code[i + 1].data == NULL && code[i + 1].section == jump->section && endsAt(ctx, i + 1, jump->target) && !followsSkip(ctx, i - 1)){
+            code[i - 1].opcode = invertSkip(code[i - 1].opcode);
+            removed[i] = true;
+            collapsed++;
+        }
+    }
+
+    if(collapsed > 0) removeInstructions(ctx, removed);
+    free(removed);
+    return collapsed;
+}
+
+
+void collapseBranches(assembler *ctx){
+    //Dropping a branch can leave the one before it going to the next instruction
+    size_t collapsed = 0, round;
+    do{
+        round = collapseRound(ctx);
+        collapsed += round;
+    } while(round > 0 && !ctx->outOfMemory);
+    if(ctx->stats) ctx->stats->collapsedBranches += collapsed;
+
+    //A skip in front of a branch skips all of it once it is one instruction
+    for(size_t i = 1; i < ctx->codeSize; i++){
+        const instruction *jump = &ctx->code[i];
+        if(jump->branch && followsSkip(ctx, i - 1)){
+            ctx->line = jump->line;
+            warning(ctx, "The skip before this branch only skips the first of its two instructions");
+        }
+    }
+}
+
+
+//Helper function to run the peephole rules over the program once, removing
+//every instruction a rule matches. Returns the number of instructions removed.
+static size_t peepholePass(assembler *ctx, size_t *counts){
+    size_t size = ctx->codeSize;
+    const instruction *code = ctx->code;
+
+    bool *removed = calloc(size + 1, sizeof(bool));
+    bool *labelled = calloc(size + 1, sizeof(bool));
+    if(removed == NULL || labelled == NULL){
+        free(removed);
+        free(labelled);
+        ctx->outOfMemory = true;
+        return 0;
+    }
+    for(size_t i = 0; i < size; i++){
+        if(code[i].target >= 0) labelled[code[i].target] = true;
+    }
+
+    //Rules see the program as it is after the removals so far
+    peephole p = {0};
+    bool movedLabel = false;
+    size_t prevIndex = 0;
+    for(size_t i = 0; i < size; i++){
+        const instruction *ins = &code[i];
+        //The empty data that ends part of a section takes no room, so the
+        //instructions on either side of it are next to each other
+        if(ins->data != NULL && ins->size == 0){
+            movedLabel = movedLabel || labelled[i];
+            continue;
+        }
+
+        p.ins = ins;
+        p.labelled = labelled[i] || movedLabel;
+        p.next = i + 1 < size && code[i + 1].section != ins->section ? -1 : (int)i + 1;
+        if(p.labelled) p.knowI = false;
+
+        //The instruction after a skip is what gets skipped, so it always stays
+        bool conditional = p.prev != NULL && isSkipOpcode(p.prev->opcode);
+
+        int rule = PEEPHOLE_RULES;
+        if(!conditional){
+            for(rule = 0; rule < PEEPHOLE_RULES; rule++){
+                const peepholeRule *r = &peepholeRules[rule];
+                if((ins->opcode & r->mask) == r->pattern && r->removable(&p)) break;
+            }
+        }
+
+        //A skip over ld vx, vx or add vx, 0 does nothing either, unless another
+        //skip can skip it. Nothing is known about what came before them then.
+        else if(p.prev2 == NULL || !isSkipOpcode(p.prev2->opcode)){
+            bool nothing = ((ins->opcode & 0xF00F) == 0x8000 && copiesToItself(&p)) || ((ins->opcode & 0xF0FF) == 0x7000 && addsZero(&p));
+            if(nothing){
+                counts[SKIPS_NOTHING]++;
+                removed[i] = true;
+                removed[prevIndex] = true;
+                movedLabel = p.labelled || labelled[prevIndex];
+                p.prev = p.prev2 = NULL;
+                continue;
+            }
+        }
+
+        //A removed instruction does nothing, so what is known about I stays the same
+        if(rule < PEEPHOLE_RULES){
+            counts[rule]++;
+            removed[i] = true;
+            movedLabel = p.labelled;
+            continue;
+        }
+        movedLabel = false;
+
+        if(forgetsI(ins->opcode)){
+            p.knowI = !conditional && (ins->opcode & 0xF000) == 0xA000 && (ins->max == 0 || ins->target >= 0);
+            p.iOpcode = ins->opcode;
+            p.iTarget = ins->target;
+        }
+        p.prev2 = p.prev;
+        p.prev = ins;
+        prevIndex = i;
+    }
+
+    size_t count = removeInstructions(ctx, removed);
+    free(removed);
+    free(labelled);
+    return count;
+}
+
+
+//Helper function to run the peephole pass until it finds nothing more to remove.
+//Removing one instruction can expose another, like a jp to the next instruction
+//once the add vx, 0 between them is gone.
+static void peepholeOptimize(assembler *ctx){
+    size_t counts[PEEPHOLE_RULES + 1] = {0};
+    size_t removed = 0;
+
+    size_t pass;
+    do{
+        pass = peepholePass(ctx, counts);
+        removed += pass;
+    } while(pass > 0);
+
+    if(ctx->stats) ctx->stats->removedInstructions += removed;
+    if(removed == 0) return;
+
+    ctx->line = 0;
+    note(ctx, "Peephole pass removed %zu instructions (%zu bytes)", removed, removed * 2);
+    for(int i = 0; i < PEEPHOLE_RULES; i++){
+        if(counts[i] > 0) note(ctx, "%zu x %s", counts[i], peepholeRules[i].name);
+    }
+    if(counts[SKIPS_NOTHING] > 0) note(ctx, "%zu x skip over ld vx, vx or add vx, 0", counts[SKIPS_NOTHING]);
+}
+
+
+//Helper function to point every jp and call with an anchor point at the end of
+//the chain of jps it starts, and to turn a jp to ret into ret.
+//Returns the number of instructions changed.
+static size_t threadJumps(assembler *ctx){
+    size_t size = ctx->codeSize;
+    size_t changed = 0;
+
+    for(size_t i = 0; i < size; i++){
+        instruction *ins = &ctx->code[i];
+        unsigned short group = ins->opcode & 0xF000;
+        if((group != 0x1000 && group != 0x2000) || ins->target < 0) continue;
+
+        //A chain that loops back on itself is followed at most once round
+        int target = ins->target;
+        for(size_t steps = 0; steps < size && (size_t)target < size; steps++){
+            const instruction *next = &ctx->code[target];
+            if((next->opcode & 0xF000) != 0x1000 || next->target < 0 || next->target == target) break;
+            target = next->target;
+        }
+
+        bool returns = group == 0x1000 && (size_t)target < size && ctx->code[target].opcode == 0x00EE;
+        if(returns){
+            ins->opcode = 0x00EE;
+            ins->max = 0;
+            ins->target = -1;
+        }
+        else if(target != ins->target) ins->target = target;
+        else continue;
+        changed++;
+    }
+    return changed;
+}
+
+
+//Helper function to remove every block that can not be reached from the start
+//of the program. Returns the number of instructions removed.
+static size_t removeUnreachable(assembler *ctx){
+    controlFlowGraph g;
+    if(buildControlFlowGraph(ctx->code, ctx->codeSize, &g) != 0){
+        ctx->outOfMemory = true;
+        return 0;
+    }
+
+    bool *reached = calloc(g.count + 1, sizeof(bool));
+    int *stack = malloc((g.count + 1) * sizeof(int));
+    bool *removed = malloc((ctx->codeSize + 1) * sizeof(bool));
+    if(reached == NULL || stack == NULL || removed == NULL){
+        ctx->outOfMemory = true;
+        free(reached);
+        free(stack);
+        free(removed);
+        freeControlFlowGraph(&g);
+        return 0;
+    }
+
+    size_t stackSize = 0;
+    if(g.count > 0){
+        reached[0] = true;
+        stack[stackSize++] = 0;
+    }
+
+    while(stackSize > 0){
+        const basicBlock *bb = &g.blocks[stack[--stackSize]];
+
+        int successors[3] = {-1, -1, -1};
+        if(bb->exit == BLOCK_FALLS || bb->exit == BLOCK_SKIPS || bb->exit == BLOCK_CALLS) successors[0] = bb->next;
+        if(bb->exit == BLOCK_JUMPS || bb->exit == BLOCK_SKIPS || bb->exit == BLOCK_CALLS) successors[1] = bb->branch;
+
+        //An anchor point used as a value, like ld i, keeps what it marks
+        for(int i = bb->first; i < bb->end; i++){
+            int target = ctx->code[i].target;
+            if(target >= 0 && (size_t)target < ctx->codeSize && !reached[g.blockOf[target]]){
+                reached[g.blockOf[target]] = true;
+                stack[stackSize++] = g.blockOf[target];
+            }
+        }
+
+        for(int i = 0; i < 2; i++){
+            if(successors[i] >= 0 && !reached[successors[i]]){
+                reached[successors[i]] = true;
+                stack[stackSize++] = successors[i];
+            }
+        }
+    }
+
+    //Data stays, it may be read through an address worked out at run time
+    for(size_t i = 0; i < ctx->codeSize; i++) removed[i] = !reached[g.blockOf[i]] && ctx->code[i].data == NULL;
+    size_t count = removeInstructions(ctx, removed);
+
+    free(reached);
+    free(stack);
+    free(removed);
+    freeControlFlowGraph(&g);
+    return count;
+}
+
+
+//Helper function to thread jumps and drop the code they leave unreachable
+static void jumpOptimize(assembler *ctx){
+    size_t threaded = threadJumps(ctx);
+    size_t removed = removeUnreachable(ctx);
+
+    if(ctx->stats){
+        ctx->stats->threadedJumps += threaded;
+        ctx->stats->removedInstructions += removed;
+    }
+
+    ctx->line = 0;
+    if(threaded > 0) note(ctx, "Jump threading shortened %zu jumps", threaded);
+    if(removed > 0) note(ctx, "Removed %zu unreachable instructions (%zu bytes)", removed, removed * 2);
+}
+
+
+void warnPinned(assembler *ctx, const instruction *pinned, const char *pass){
+    ctx->line = pinned->line;
+    if((pinned->opcode & 0xF000) == 0xB000) warning(ctx, "%s skipped, jp v0 can jump to any instruction", pass);
+    else if((pinned->opcode & 0xF000) == 0xA000) warning(ctx, "%s skipped, the program can not move while ld i points into it by number", pass);
+    else if(pinned->max != 0) warning(ctx, "%s skipped, instructions can not move while a jump goes to an expression", pass);
+    else warning(ctx, "%s skipped, instructions can not move while a jump goes to a number", pass);
+}
+
+
+void optimize(assembler *ctx){
+    //Passes that move instructions would break numbered jump targets
+    const instruction *pinned = findPinned(ctx);
+    if(pinned != NULL){
+        warnPinned(ctx, pinned, "Optimization");
+        return;
+    }
+
+    //Threading first, it can leave jps to the next instruction for the peephole pass
+    if(ctx->options->optimize & CHIP8_OPTIMIZE_JUMPS) jumpOptimize(ctx);
+    if(ctx->options->optimize & CHIP8_OPTIMIZE_PEEPHOLE) peepholeOptimize(ctx);
+
+    //Outlining last, so it only shares what the other passes left
+    if(ctx->options->optimize & CHIP8_OPTIMIZE_OUTLINE) outlineOptimize(ctx);
+}
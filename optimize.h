@@ -0,0 +1,51 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Optimization passes over the instruction list. They run after anchor points
+//are resolved and before the image is laid out, and keep every anchor point
+//and reference pointing at the same instruction.
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "assembler.h"
+
+//Run the passes selected in ctx->options->optimize
+void optimize(assembler *ctx);
+
+//Lower every branch that only goes over the instruction after it to a lone
+//skip, and drop every branch to the next instruction. Runs whether the
+//program is optimized or not, once anchor points are resolved.
+void collapseBranches(assembler *ctx);
+
+//Find an instruction that stops instructions from moving: a jump or call to a
+//numbered address or an expression, jp v0 whose targets can not be known, or
+//ld i with a numbered address where programs are loaded. Returns NULL if the
+//program can be rearranged.
+const instruction *findPinned(const assembler *ctx);
+
+//Warn that pass was skipped because of the instruction findPinned found
+void warnPinned(assembler *ctx, const instruction *pinned, const char *pass);
+
+#endif
@@ -0,0 +1,501 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "outline.h"
+#include "symtab.h"
+#include "cfg.h"
+
+//Longest sequence looked for. Longer repeats are still shared, a piece at a time.
+#define OUTLINE_LENGTH 16
+
+//Ways the copies of a sequence can share one
+#define SHARE_CALL 0        //Every copy becomes a call to a subroutine at the end of its section
+#define SHARE_TAIL 1        //The sequence ends in jp or ret, so every copy but the first jumps to the first
+
+//A sequence worth sharing and where its copies start
+typedef struct{
+    unsigned char kind;
+    int length;
+    int section;
+    size_t first;           //First copy in outlineState.starts
+    size_t count;
+    size_t saved;           //Bytes the image shrinks by
+} candidate;
+
+//A sequence of instructions by its rolling hash
+typedef struct{
+    uint64_t hash;
+    int start;
+} window;
+
+//State of one round of outlining
+typedef struct{
+    assembler *ctx;
+    size_t size;
+    uint64_t *prefix;       //Rolling hash of the instructions before each one
+    uint64_t *powers;       //Powers of the hash base
+    int *barriers;          //Instructions before each one that no sequence can hold
+    bool *labelled;         //Something points at the instruction, so it can only start a copy
+    int *bodyPlace;         //Where the subroutines of each section go, -1 if the section runs off its end
+    window *windows;
+    int *starts;            //Copies of every candidate
+    size_t startSize;
+    size_t startCapacity;
+    candidate *candidates;
+    size_t candidateSize;
+    size_t candidateCapacity;
+} outlineState;
+
+#define HASH_BASE 0x100000001B3ull
+
+
+//Helper function to see if an instruction can be part of a shared sequence.
+//Data and values worked out at layout depend on where they end up.
+static bool canShare(const instruction *ins){
+    if(ins->data != NULL || (ins->max != 0 && ins->target < 0)) return false;
+    return (ins->opcode & 0xF000) != 0xB000;
+}
+
+
+//Helper function to see if a subroutine can run an instruction for its caller
+static bool canCall(const instruction *ins){
+    unsigned short group = ins->opcode & 0xF000;
+    return group != 0x1000 && group != 0x2000 && ins->opcode != 0x00EE;
+}
+
+
+//Helper function to see if an instruction never runs on into the next one
+static bool endsTail(const instruction *ins){
+    return ((ins->opcode & 0xF000) == 0x1000 && ins->target >= 0) || ins->opcode == 0x00EE;
+}
+
+
+static bool sameInstruction(const instruction *a, const instruction *b){
+    return a->opcode == b->opcode && a->max == b->max && a->target == b->target;
+}
+
+
+static uint64_t hashInstruction(const instruction *ins){
+    uint64_t h = ins->opcode | (uint64_t)ins->max << 16 | (uint64_t)(uint32_t)(ins->target + 1) << 32;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+
+//Helper function to find where each section can take subroutines: after its
+//last instruction or data, as long as code can not run on into them
+static void findBodyPlaces(outlineState *s){
+    const instruction *code = s->ctx->code;
+    size_t sections = s->ctx->sectionSize ? s->ctx->sectionSize : 1;
+    for(size_t i = 0; i < sections; i++) s->bodyPlace[i] = -1;
+
+    size_t start = 0;
+    while(start < s->size){
+        size_t end = start;
+        while(end < s->size && code[end].section == code[start].section) end++;
+
+        //The empty data that closes a section marks its end, so it stays after the subroutines
+        size_t last = end;
+        while(last > start && code[last - 1].data != NULL && code[last - 1].size == 0) last--;
+        if(last > start){
+            const instruction *ins = &code[last - 1];
+            bool runsOn = ins->data == NULL && (ins->opcode & 0xF000) != 0x1000 && (ins->opcode & 0xF000) != 0xB000 && ins->opcode != 0x00EE;
+            if(last - 1 > start && code[last - 2].data == NULL && isSkipOpcode(code[last - 2].opcode)) runsOn = true;
+            if(!runsOn) s->bodyPlace[code[start].section] = last;
+        }
+        start = end;
+    }
+}
+
+
+//Helper function to set up a round. Returns 0 on success.
+static int initState(outlineState *s, assembler *ctx){
+    memset(s, 0, sizeof(*s));
+    s->ctx = ctx;
+    s->size = ctx->codeSize;
+    size_t size = s->size;
+
+    s->prefix = malloc((size + 1) * sizeof(uint64_t));
+    s->powers = malloc((OUTLINE_LENGTH + 1) * sizeof(uint64_t));
+    s->barriers = malloc((size + 1) * sizeof(int));
+    s->labelled = calloc(size + 1, sizeof(bool));
+    s->bodyPlace = malloc((ctx->sectionSize + 1) * sizeof(int));
+    s->windows = malloc((size + 1) * sizeof(window));
+    if(!s->prefix || !s->powers || !s->barriers || !s->labelled || !s->bodyPlace || !s->windows) return 1;
+
+    s->powers[0] = 1;
+    for(int i = 1; i <= OUTLINE_LENGTH; i++) s->powers[i] = s->powers[i - 1] * HASH_BASE;
+
+    const instruction *code = ctx->code;
+    s->prefix[0] = 0;
+    s->barriers[0] = 0;
+    for(size_t i = 0; i < size; i++){
+        s->prefix[i + 1] = s->prefix[i] * HASH_BASE + hashInstruction(&code[i]);
+        s->barriers[i + 1] = s->barriers[i] + !canShare(&code[i]);
+        if(code[i].target >= 0) s->labelled[code[i].target] = true;
+    }
+
+    //Anchor points can also be used in values worked out at layout
+    const anchorPointList *anchors = ctx->anchors;
+    for(size_t i = 0; i < anchors->capacity; i++){
+        if(anchors->values[i].nameLength > 0) s->labelled[anchors->values[i].place] = true;
+    }
+
+    findBodyPlaces(s);
+    return 0;
+}
+
+
+static void freeState(outlineState *s){
+    free(s->prefix);
+    free(s->powers);
+    free(s->barriers);
+    free(s->labelled);
+    free(s->bodyPlace);
+    free(s->windows);
+    free(s->starts);
+    free(s->candidates);
+}
+
+
+static int compareWindows(const void *a, const void *b){
+    const window *x = a, *y = b;
+    if(x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->start - y->start;
+}
+
+
+static bool sameSequence(const instruction *code, int a, int b, int length){
+    for(int k = 0; k < length; k++){
+        if(!sameInstruction(&code[a + k], &code[b + k])) return false;
+    }
+    return true;
+}
+
+
+//Helper function to see if the copy at start can be replaced by one
+//instruction: nothing may jump into its middle, and no skip may skip only its start
+static bool canReplace(const outlineState *s, int start, int length){
+    const instruction *code = s->ctx->code;
+    if(start > 0 && code[start - 1].data == NULL && isSkipOpcode(code[start - 1].opcode)) return false;
+    for(int k = 1; k < length; k++){
+        if(s->labelled[start + k]) return false;
+    }
+    return true;
+}
+
+
+//Helper function to get the bytes sharing count copies of a sequence saves
+static size_t savedBytes(unsigned char kind, int length, size_t count){
+    if(count < 2) return 0;
+    if(kind == SHARE_TAIL) return (count - 1) * (length - 1) * 2;
+
+    //Each copy becomes a call, and the subroutine needs a ret
+    size_t removed = count * length;
+    size_t added = count + length + 1;
+    return removed > added ? (removed - added) * 2 : 0;
+}
+
+
+//Helper function to add a candidate. Returns 0 on success.
+static int addCandidate(outlineState *s, const candidate *c){
+    if(s->candidateSize == s->candidateCapacity){
+        size_t newCapacity = s->candidateCapacity ? s->candidateCapacity * 2 : 32;
+        candidate *temp = realloc(s->candidates, newCapacity * sizeof(candidate));
+        if(temp == NULL) return 1;
+        s->candidates = temp;
+        s->candidateCapacity = newCapacity;
+    }
+    s->candidates[s->candidateSize++] = *c;
+    return 0;
+}
+
+
+//Helper function to look at the sequences in windows[first..end), which have
+//the same hash, and add the copies of the first one that can be shared.
+//Returns 0 on success.
+static int addGroup(outlineState *s, size_t first, size_t end, int length){
+    const instruction *code = s->ctx->code;
+    int leader = s->windows[first].start;
+
+    if(s->startSize + (end - first) > s->startCapacity){
+        size_t newCapacity = s->startCapacity ? s->startCapacity * 2 : 256;
+        while(newCapacity < s->startSize + (end - first)) newCapacity *= 2;
+        int *temp = realloc(s->starts, newCapacity * sizeof(int));
+        if(temp == NULL) return 1;
+        s->starts = temp;
+        s->startCapacity = newCapacity;
+    }
+    const instruction *last = &code[leader + length - 1];
+
+    //A skip in front of the jp or ret would run on past the copy, or into the ret of a subroutine
+    candidate c = {0};
+    c.length = length;
+    c.kind = endsTail(last) ? SHARE_TAIL : SHARE_CALL;
+    if(isSkipOpcode(code[leader + length - (c.kind == SHARE_TAIL ? 2 : 1)].opcode)) return 0;
+    if(c.kind == SHARE_CALL){
+        for(int k = 0; k < length; k++){
+            if(!canCall(&code[leader + k])) return 0;
+        }
+    }
+
+    //Copies may overlap, like in a run of the same instruction, so only ones after the last are taken
+    c.section = code[leader].section;
+    c.first = s->startSize;
+    int taken = -length;
+    for(size_t w = first; w < end; w++){
+        int start = s->windows[w].start;
+        if(start < taken + length || !canReplace(s, start, length)) continue;
+        if(!sameSequence(code, leader, start, length)) continue;
+        if(c.kind == SHARE_CALL && code[start].section != c.section) continue;
+        s->starts[s->startSize + c.count++] = start;
+        taken = start;
+    }
+
+    if(c.kind == SHARE_CALL && s->bodyPlace[c.section] < 0) return 0;
+    c.saved = savedBytes(c.kind, length, c.count);
+    if(c.saved == 0) return 0;
+
+    s->startSize += c.count;
+    return addCandidate(s, &c);
+}
+
+
+//Helper function to find every sequence that would save room if its copies
+//were shared. Sequences of each length are sorted by their rolling hash, so
+//copies end up next to each other. Returns 0 on success.
+static int findCandidates(outlineState *s){
+    const instruction *code = s->ctx->code;
+    for(int length = 2; length <= OUTLINE_LENGTH; length++){
+        size_t count = 0;
+        for(size_t i = 0; i + length <= s->size; i++){
+            if(s->barriers[i + length] != s->barriers[i] || code[i].section != code[i + length - 1].section) continue;
+            s->windows[count].hash = s->prefix[i + length] - s->prefix[i] * s->powers[length];
+            s->windows[count].start = i;
+            count++;
+        }
+        qsort(s->windows, count, sizeof(window), compareWindows);
+
+        for(size_t first = 0; first < count;){
+            size_t end = first + 1;
+            while(end < count && s->windows[end].hash == s->windows[first].hash) end++;
+            if(end - first > 1 && addGroup(s, first, end, length) != 0) return 1;
+            first = end;
+        }
+    }
+    return 0;
+}
+
+
+//Helper function to put the candidates that save the most first
+static int compareCandidates(const void *a, const void *b){
+    const candidate *x = a, *y = b;
+    if(x->saved != y->saved) return x->saved > y->saved ? -1 : 1;
+    if(x->length != y->length) return y->length - x->length;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+
+//Helper function to pick the candidates to share, most saved first. Copies
+//that overlap one already picked are dropped, and a candidate is only kept
+//while what is left of it still saves room. Returns the number picked, which
+//are moved to the front of the list.
+static size_t pickCandidates(outlineState *s){
+    bool *used = calloc(s->size + 1, sizeof(bool));
+    if(used == NULL){
+        s->ctx->outOfMemory = true;
+        return 0;
+    }
+    qsort(s->candidates, s->candidateSize, sizeof(candidate), compareCandidates);
+
+    size_t picked = 0;
+    for(size_t i = 0; i < s->candidateSize; i++){
+        candidate c = s->candidates[i];
+        int *starts = s->starts + c.first;
+
+        size_t count = 0;
+        for(size_t k = 0; k < c.count; k++){
+            bool open = true;
+            for(int n = 0; n < c.length && open; n++) open = !used[starts[k] + n];
+            if(open) starts[count++] = starts[k];
+        }
+        c.count = count;
+        c.saved = savedBytes(c.kind, c.length, count);
+        if(c.saved == 0) continue;
+
+        for(size_t k = 0; k < count; k++){
+            for(int n = 0; n < c.length; n++) used[starts[k] + n] = true;
+        }
+        s->candidates[picked++] = c;
+    }
+
+    free(used);
+    return picked;
+}
+
+
+//Helper function to share the copies of the first count candidates. Each
+//subroutine goes at the place found for its section, and anchor points that
+//marked the middle of a copy that is gone move to the instruction after it.
+static void shareCandidates(outlineState *s, size_t count){
+    assembler *ctx = s->ctx;
+    size_t size = s->size;
+
+    int *places = malloc((size + 1) * sizeof(int));
+    int *replaced = calloc(size + 1, sizeof(int));
+    int *bodies = malloc((count + 1) * sizeof(int));
+    if(places == NULL || replaced == NULL || bodies == NULL){
+        free(places);
+        free(replaced);
+        free(bodies);
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    //replaced holds the candidate + 1 of every copy that becomes a jp or call.
+    //The first copy of a merged tail is the one that stays.
+    for(size_t c = 0; c < count; c++){
+        const candidate *cand = &s->candidates[c];
+        for(size_t k = cand->kind == SHARE_TAIL ? 1 : 0; k < cand->count; k++) replaced[s->starts[cand->first + k]] = c + 1;
+    }
+
+    //Work out where everything goes
+    size_t newSize = 0;
+    for(size_t i = 0; i <= size; i++){
+        for(size_t c = 0; c < count; c++){
+            const candidate *cand = &s->candidates[c];
+            if(cand->kind != SHARE_CALL || s->bodyPlace[cand->section] != (int)i) continue;
+            bodies[c] = newSize;
+            newSize += cand->length + 1;
+        }
+        places[i] = newSize;
+        if(i == size) break;
+
+        newSize++;
+        if(replaced[i]){
+            int length = s->candidates[replaced[i] - 1].length;
+            for(int n = 1; n < length; n++) places[i + n] = newSize;
+            i += length - 1;
+        }
+    }
+
+    instruction *code = malloc((newSize + 1) * sizeof(instruction));
+    if(code == NULL){
+        free(places);
+        free(replaced);
+        free(bodies);
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    size_t out = 0;
+    for(size_t i = 0; i <= size; i++){
+        for(size_t c = 0; c < count; c++){
+            const candidate *cand = &s->candidates[c];
+            if(cand->kind != SHARE_CALL || s->bodyPlace[cand->section] != (int)i) continue;
+
+            const instruction *from = &ctx->code[s->starts[cand->first]];
+            for(int n = 0; n < cand->length; n++){
+                code[out] = from[n];
+                if(code[out].target >= 0) code[out].target = places[code[out].target];
+                out++;
+            }
+            instruction *ret = &code[out++];
+            memset(ret, 0, sizeof(*ret));
+            ret->opcode = 0x00EE;
+            ret->target = -1;
+            ret->line = from[cand->length - 1].line;
+            ret->section = cand->section;
+        }
+        if(i == size) break;
+
+        instruction *ins = &code[out++];
+        *ins = ctx->code[i];
+        if(replaced[i]){
+            const candidate *cand = &s->candidates[replaced[i] - 1];
+            bool tail = cand->kind == SHARE_TAIL;
+            memset(ins, 0, sizeof(*ins));
+            ins->opcode = tail ? 0x1000 : 0x2000;
+            ins->max = 4095;
+            ins->target = tail ? places[s->starts[cand->first]] : bodies[replaced[i] - 1];
+            ins->line = ctx->code[i].line;
+            ins->section = ctx->code[i].section;
+            i += cand->length - 1;
+        }
+        else if(ins->target >= 0) ins->target = places[ins->target];
+    }
+    moveAnchorPoints(ctx->anchors, places);
+
+    free(ctx->code);
+    ctx->code = code;
+    ctx->codeSize = newSize;
+    ctx->codeCapacity = newSize + 1;
+    ctx->PC = newSize;
+    free(places);
+    free(replaced);
+    free(bodies);
+}
+
+
+void outlineOptimize(assembler *ctx){
+    size_t subroutines = 0, merged = 0, saved = 0;
+
+    //Sharing turns copies into calls and jps, which can make longer repeats
+    //out of the code around them, so rounds go on until nothing is saved
+    while(!ctx->outOfMemory){
+        outlineState s;
+        if(initState(&s, ctx) != 0 || findCandidates(&s) != 0){
+            freeState(&s);
+            ctx->outOfMemory = true;
+            break;
+        }
+
+        size_t count = pickCandidates(&s);
+        for(size_t c = 0; c < count; c++){
+            const candidate *cand = &s.candidates[c];
+            if(cand->kind == SHARE_CALL) subroutines++;
+            else merged += cand->count - 1;
+            saved += cand->saved;
+        }
+        if(count > 0) shareCandidates(&s, count);
+        freeState(&s);
+        if(count == 0) break;
+    }
+
+    if(ctx->stats){
+        ctx->stats->outlinedSequences += subroutines;
+        ctx->stats->mergedTails += merged;
+        ctx->stats->outlineSaved += saved;
+    }
+
+    ctx->line = 0;
+    if(saved > 0) note(ctx, "Outlining saved %zu bytes with %zu new subroutine%s and %zu cop%s merged into a shared tail",
+                       saved, subroutines, subroutines == 1 ? "" : "s", merged, merged == 1 ? "y" : "ies");
+}
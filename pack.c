@@ -0,0 +1,531 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "pack.h"
+#include "section.h"
+#include "optimize.h"
+#include "symtab.h"
+
+#define PACK_SEGMENT 256    //Bytes a segment unpacks to, and the most it can take packed
+#define PACK_WINDOW 255     //Farthest back a copy can reach
+#define PACK_SEGMENTS 63    //Segments the table can list, its offsets are kept in a register
+#define TABLE_END 16        //Zero bytes that end the table, which the unpacker clears every register with
+#define LITERAL_MAX 127
+#define MATCH_MIN 3
+#define MATCH_MAX 130
+#define CHAIN_DEPTH 32      //Earlier places with the same hash looked at for a copy
+#define HASH_SIZE 4096
+
+//Where an unpacker instruction points, besides another instruction of it
+#define TO_NOTHING -1
+#define TO_TABLE -2         //The table of segments after the unpacker
+#define TO_PROGRAM -3       //The program's own first instruction
+
+//The unpacker. Each segment in the table is the opcodes ld i, packed and
+//ld i, address, which are written over the ld i instructions that read the
+//packed bytes and write the unpacked ones, and then read with add i offsets.
+//v4 is the offset in the packed segment, v5 in the unpacked one, v6 counts
+//the bytes of a token, v7 is where a copy reads from and v10 is the offset in
+//the table.
+static const struct{
+    unsigned short opcode;
+    int target;
+} unpacker[] = {
+    {0x6A00, TO_NOTHING},   //     ld v10, 0
+    {0xA000, TO_TABLE},     // 1 segment: ld i, table
+    {0xFA1E, TO_NOTHING},   //     add i, v10
+    {0xF341, TO_NOTHING},   //     ld v3, [i]
+    {0x3000, TO_NOTHING},   //     se v0, 0
+    {0x1000, 9},            //     jp start
+    {0xFF41, TO_NOTHING},   //     ld v15, [i]
+    {0xA000, TO_NOTHING},   //     ld i, 0
+    {0x1000, TO_PROGRAM},   //     jp program
+    {0x7A04, TO_NOTHING},   // 9 start: add v10, 4
+    {0xA000, 62},           //     ld i, fetch
+    {0xF137, TO_NOTHING},   //     ld [i], v1
+    {0xA000, 32},           //     ld i, literal
+    {0xF137, TO_NOTHING},   //     ld [i], v1
+    {0x8020, TO_NOTHING},   //     ld v0, v2
+    {0x8130, TO_NOTHING},   //     ld v1, v3
+    {0xA000, 36},           //     ld i, literal + 4
+    {0xF137, TO_NOTHING},   //     ld [i], v1
+    {0xA000, 50},           //     ld i, copy
+    {0xF137, TO_NOTHING},   //     ld [i], v1
+    {0xA000, 54},           //     ld i, copy + 4
+    {0xF137, TO_NOTHING},   //     ld [i], v1
+    {0x6400, TO_NOTHING},   //     ld v4, 0
+    {0x6500, TO_NOTHING},   //     ld v5, 0
+    {0x2000, 62},           //24 token: call fetch
+    {0x3000, TO_NOTHING},   //     se v0, 0
+    {0x1000, 28},           //     jp run
+    {0x1000, 1},            //     jp segment
+    {0x8600, TO_NOTHING},   //28 run: ld v6, v0
+    {0x800E, TO_NOTHING},   //     shl v0
+    {0x3F00, TO_NOTHING},   //     se v15, 0
+    {0x1000, 44},           //     jp match
+    {0xA000, TO_NOTHING},   //32 literal: ld i, packed
+    {0xF41E, TO_NOTHING},   //     add i, v4
+    {0xF041, TO_NOTHING},   //     ld v0, [i]
+    {0x7401, TO_NOTHING},   //     add v4, 1
+    {0xA000, TO_NOTHING},   //     ld i, address
+    {0xF51E, TO_NOTHING},   //     add i, v5
+    {0xF037, TO_NOTHING},   //     ld [i], v0
+    {0x7501, TO_NOTHING},   //     add v5, 1
+    {0x76FF, TO_NOTHING},   //     add v6, 255
+    {0x3600, TO_NOTHING},   //     se v6, 0
+    {0x1000, 32},           //     jp literal
+    {0x1000, 24},           //     jp token
+    {0x8006, TO_NOTHING},   //44 match: shr v0
+    {0x7003, TO_NOTHING},   //     add v0, 3
+    {0x8600, TO_NOTHING},   //     ld v6, v0
+    {0x2000, 62},           //     call fetch
+    {0x8750, TO_NOTHING},   //     ld v7, v5
+    {0x8705, TO_NOTHING},   //     sub v7, v0
+    {0xA000, TO_NOTHING},   //50 copy: ld i, address
+    {0xF71E, TO_NOTHING},   //     add i, v7
+    {0xF041, TO_NOTHING},   //     ld v0, [i]
+    {0x7701, TO_NOTHING},   //     add v7, 1
+    {0xA000, TO_NOTHING},   //     ld i, address
+    {0xF51E, TO_NOTHING},   //     add i, v5
+    {0xF037, TO_NOTHING},   //     ld [i], v0
+    {0x7501, TO_NOTHING},   //     add v5, 1
+    {0x76FF, TO_NOTHING},   //     add v6, 255
+    {0x3600, TO_NOTHING},   //     se v6, 0
+    {0x1000, 50},           //     jp copy
+    {0x1000, 24},           //     jp token
+    {0xA000, TO_NOTHING},   //62 fetch: ld i, packed
+    {0xF41E, TO_NOTHING},   //     add i, v4
+    {0xF041, TO_NOTHING},   //     ld v0, [i]
+    {0x7401, TO_NOTHING},   //     add v4, 1
+    {0x00EE, TO_NOTHING},   //     ret
+};
+
+#define UNPACKER_SIZE (int)(sizeof(unpacker) / sizeof(unpacker[0]))
+
+//The se that finds the end of the table. The table holds opcodes, so in a
+//little-endian image the high byte it checks is the second one, in v1.
+#define TABLE_CHECK 4
+
+//Earlier places in the bytes being packed, by the hash of the 3 bytes there
+typedef struct{
+    const unsigned char *data;
+    size_t size;
+    int *head;              //Last place with each hash, -1 if there is none
+    int *previous;          //Place before each one with the same hash
+    size_t added;           //Places added so far
+} matcher;
+
+
+void addPackedBlock(assembler *ctx, const lineResult *r){
+    if(ctx->packSize == ctx->packCapacity){
+        size_t newCapacity = ctx->packCapacity ? ctx->packCapacity * 2 : 8;
+        packedBlock *temp = realloc(ctx->packs, newCapacity * sizeof(ctx->packs[0]));
+        if(temp == NULL){
+            ctx->outOfMemory = true;
+            return;
+        }
+        ctx->packs = temp;
+        ctx->packCapacity = newCapacity;
+    }
+
+    packedBlock *block = &ctx->packs[ctx->packSize++];
+    memset(block, 0, sizeof(*block));
+    block->data = r->data;
+    block->size = r->size;
+    block->address = r->address;
+    block->line = ctx->line;
+}
+
+
+static unsigned hashPlace(const unsigned char *p){
+    return (p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u >> 20 & (HASH_SIZE - 1);
+}
+
+
+//Helper function to find the longest copy of the bytes at p that starts
+//earlier in the segment and ends by end. Returns its length, or 0 if it is
+//too short to be worth a token.
+static size_t findMatch(matcher *m, size_t p, size_t start, size_t end, size_t *distance){
+    for(; m->added < p; m->added++){
+        if(m->added + MATCH_MIN > m->size) continue;
+        unsigned h = hashPlace(m->data + m->added);
+        m->previous[m->added] = m->head[h];
+        m->head[h] = m->added;
+    }
+    if(p + MATCH_MIN > end) return 0;
+
+    size_t longest = end - p < MATCH_MAX ? end - p : MATCH_MAX;
+    size_t best = 0;
+    int depth = CHAIN_DEPTH;
+    for(int q = m->head[hashPlace(m->data + p)]; q >= 0 && (size_t)q >= start && p - q <= PACK_WINDOW && depth-- > 0; q = m->previous[q]){
+        size_t length = 0;
+        while(length < longest && m->data[q + length] == m->data[p + length]) length++;
+        if(length > best){
+            best = length;
+            *distance = p - q;
+            if(best == longest) break;
+        }
+    }
+    return best >= MATCH_MIN ? best : 0;
+}
+
+
+//Helper function to get the packed size of count bytes copied as they are
+static size_t literalSize(size_t count){
+    return count + (count + LITERAL_MAX - 1) / LITERAL_MAX;
+}
+
+
+static size_t putLiterals(const unsigned char *data, size_t count, unsigned char *out){
+    size_t size = 0;
+    while(count > 0){
+        size_t run = count < LITERAL_MAX ? count : LITERAL_MAX;
+        out[size++] = run;
+        memcpy(out + size, data, run);
+        size += run;
+        data += run;
+        count -= run;
+    }
+    return size;
+}
+
+
+//Helper function to pack one segment, starting at start, into out. A copy
+//is only taken if the next place does not start a longer one. The segment
+//ends after PACK_SEGMENT bytes, or once the next token would not fit in
+//PACK_SEGMENT packed bytes. Returns the packed size and sets end to where
+//the next segment starts.
+static size_t packSegment(matcher *m, size_t start, unsigned char *out, size_t *end){
+    size_t limit = m->size - start < PACK_SEGMENT ? m->size : start + PACK_SEGMENT;
+    size_t p = start, literals = start, size = 0;
+
+    while(p < limit){
+        size_t distance, next;
+        size_t length = findMatch(m, p, start, limit, &distance);
+        if(length > 0 && p + 1 < limit && findMatch(m, p + 1, start, limit, &next) > length) length = 0;
+
+        //One byte is always left for the token that ends the segment
+        if(length > 0){
+            if(size + literalSize(p - literals) + 2 + 1 > PACK_SEGMENT) break;
+            size += putLiterals(m->data + literals, p - literals, out + size);
+            out[size++] = 0x80 | (length - MATCH_MIN);
+            out[size++] = distance;
+            p += length;
+            literals = p;
+        }
+        else{
+            if(size + literalSize(p + 1 - literals) + 1 > PACK_SEGMENT) break;
+            p++;
+        }
+    }
+
+    size += putLiterals(m->data + literals, p - literals, out + size);
+    out[size++] = 0;
+    *end = p;
+    return size;
+}
+
+
+//Helper function to pack a block's bytes into memory that lasts the run.
+//Returns 0 on success.
+static int packBlock(assembler *ctx, packedBlock *block, size_t *segments){
+    size_t size = block->size;
+    matcher m = {block->data, size, NULL, NULL, 0};
+    m.head = malloc(HASH_SIZE * sizeof(int));
+    m.previous = malloc((size + 1) * sizeof(int));
+
+    //Every segment but the last unpacks to at least 250 bytes
+    size_t capacity = size + size / 64 + 16;
+    unsigned char *out = malloc(capacity);
+    if(m.head == NULL || m.previous == NULL || out == NULL){
+        free(m.head);
+        free(m.previous);
+        free(out);
+        return 1;
+    }
+    for(int i = 0; i < HASH_SIZE; i++) m.head[i] = -1;
+
+    size_t packed = 0;
+    *segments = 0;
+    for(size_t start = 0; start < size; (*segments)++) packed += packSegment(&m, start, out + packed, &start);
+
+    block->packed = allocateData(ctx, packed);
+    if(block->packed != NULL){
+        memcpy((unsigned char *)block->packed, out, packed);
+        block->packedSize = packed;
+    }
+    free(m.head);
+    free(m.previous);
+    free(out);
+    return block->packed == NULL;
+}
+
+
+//Helper function to store a block as it is, at its address
+static void storeBlock(assembler *ctx, packedBlock *block){
+    block->packed = NULL;
+    ctx->line = block->line;
+    int index = addFixedSection(ctx, block->address, block->line);
+    if(index == -1){
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    lineResult r = {0};
+    r.kind = LINE_DATA;
+    r.data = block->data;
+    r.size = block->size;
+    ctx->currentSection = index;
+    addInstruction(ctx, &r);
+    ctx->PC++;
+}
+
+
+//Helper function to find an instruction that stops the program from moving,
+//like findPinned, except that ld i may point into the memory a block unpacks to
+static const instruction *findMoved(const assembler *ctx){
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        const instruction *ins = &ctx->code[i];
+        if(ins->data != NULL) continue;
+        unsigned short group = ins->opcode & 0xF000;
+
+        if(group == 0xB000) return ins;
+        if((group == 0x1000 || group == 0x2000) && ins->target < 0) return ins;
+        if(group != 0xA000 || ins->max != 0 || (ins->opcode & 0xFFF) < CHIP8_PROGRAM_START) continue;
+
+        int address = ins->opcode & 0xFFF;
+        bool unpacked = false;
+        for(size_t j = 0; j < ctx->packSize && !unpacked; j++){
+            const packedBlock *block = &ctx->packs[j];
+            unpacked = address >= block->address && address < block->address + (int)block->size;
+        }
+        if(!unpacked) return ins;
+    }
+    return NULL;
+}
+
+
+//Helper function to put the unpacker, the table and the packed blocks in
+//front of the program's first instruction. Anchor points and references to
+//the start of the program still point at its own first instruction.
+static void addUnpacker(assembler *ctx, size_t tableSize, int line){
+    size_t size = ctx->codeSize;
+    size_t packed = 0;
+    for(size_t i = 0; i < ctx->packSize; i++) packed += ctx->packs[i].packed != NULL;
+    size_t added = UNPACKER_SIZE + 1 + packed;
+
+    int *places = malloc((size + 1) * sizeof(int));
+    instruction *code = malloc((size + added + 1) * sizeof(instruction));
+    ctx->packTable = allocateData(ctx, tableSize);
+    if(places == NULL || code == NULL || ctx->packTable == NULL){
+        free(places);
+        free(code);
+        ctx->outOfMemory = true;
+        return;
+    }
+    memset(ctx->packTable, 0, tableSize);
+    memset(code, 0, added * sizeof(instruction));
+
+    for(int i = 0; i < UNPACKER_SIZE; i++){
+        instruction *ins = &code[i];
+        int target = unpacker[i].target;
+        if(target == TO_TABLE) target = UNPACKER_SIZE;
+        else if(target == TO_PROGRAM) target = added;
+
+        ins->opcode = unpacker[i].opcode;
+        if(i == TABLE_CHECK && ctx->options->littleEndian) ins->opcode = 0x3100;
+        ins->max = target >= 0 ? 4095 : 0;
+        ins->target = target;
+        ins->line = line;
+    }
+
+    instruction *table = &code[UNPACKER_SIZE];
+    table->target = -1;
+    table->line = line;
+    table->data = ctx->packTable;
+    table->size = tableSize;
+
+    size_t next = UNPACKER_SIZE + 1;
+    for(size_t i = 0; i < ctx->packSize; i++){
+        const packedBlock *block = &ctx->packs[i];
+        if(block->packed == NULL) continue;
+        instruction *ins = &code[next++];
+        ins->target = -1;
+        ins->line = block->line;
+        ins->data = block->packed;
+        ins->size = block->packedSize;
+    }
+
+    for(size_t i = 0; i <= size; i++) places[i] = i + added;
+    for(size_t i = 0; i < size; i++){
+        instruction *ins = &code[added + i];
+        *ins = ctx->code[i];
+        if(ins->target >= 0) ins->target = places[ins->target];
+    }
+    moveAnchorPoints(ctx->anchors, places);
+
+    free(ctx->code);
+    ctx->code = code;
+    ctx->codeSize = size + added;
+    ctx->codeCapacity = size + added + 1;
+    ctx->PC = ctx->codeSize;
+    free(places);
+}
+
+
+void packBlocks(assembler *ctx){
+    packedBlock *packs = ctx->packs;
+    size_t count = ctx->packSize;
+
+    //Blocks are unpacked one after another, so they can not share memory
+    for(size_t i = 0; i < count; i++){
+        for(size_t j = 0; j < i; j++){
+            if(packs[i].address < packs[j].address + (int)packs[j].size && packs[j].address < packs[i].address + (int)packs[i].size){
+                ctx->line = packs[i].line;
+                error(ctx, "pack at 0x%03X overlaps the one on line %i", packs[i].address, packs[j].line);
+                return;
+            }
+        }
+    }
+
+    //The unpacker goes in front of the program, which moves every instruction
+    const instruction *pinned = findMoved(ctx);
+    if(pinned != NULL) warnPinned(ctx, pinned, "Packing");
+
+    //Each block is packed if that saves room, counting its segments in the table
+    size_t segments = 0, unpacked = 0, packed = 0;
+    for(size_t i = 0; i < count && pinned == NULL; i++){
+        packedBlock *block = &packs[i];
+        size_t blockSegments;
+        if(packBlock(ctx, block, &blockSegments) != 0){
+            ctx->outOfMemory = true;
+            return;
+        }
+
+        size_t size = block->packedSize + 4 * blockSegments;
+        ctx->line = block->line;
+        if(size < block->size && segments + blockSegments <= PACK_SEGMENTS){
+            note(ctx, "Packed %zu bytes into %zu (%.1f%%)", block->size, size, 100.0 * size / block->size);
+            segments += blockSegments;
+            unpacked += block->size;
+            packed += size;
+        }
+        else{
+            note(ctx, "Stored %zu bytes as they are, packed they would take %zu", block->size, size);
+            block->packed = NULL;
+        }
+    }
+
+    //The unpacker has to pay for itself
+    size_t unpackerSize = UNPACKER_SIZE * 2 + TABLE_END;
+    ctx->line = 0;
+    if(segments > 0 && unpacked - packed <= unpackerSize){
+        note(ctx, "Stored every pack as it is, the %zu bytes packing saves do not pay for the %zu byte unpacker", unpacked - packed, unpackerSize);
+        segments = 0;
+    }
+
+    if(segments > 0){
+        addUnpacker(ctx, segments * 4 + TABLE_END, packs[0].line);
+        note(ctx, "Packing saved %zu bytes, %zu bytes take %zu packed and the unpacker takes %zu",
+             unpacked - packed - unpackerSize, unpacked, packed, unpackerSize);
+        if(ctx->stats){
+            ctx->stats->packedBytes += unpacked;
+            ctx->stats->packedSize += packed + TABLE_END;
+            ctx->stats->unpackerSize += UNPACKER_SIZE * 2;
+        }
+    }
+
+    for(size_t i = 0; i < count; i++){
+        if(segments == 0 || packs[i].packed == NULL) storeBlock(ctx, &packs[i]);
+    }
+}
+
+
+//Helper function to get where the next segment of packed bytes starts, and
+//how many bytes the segment unpacks to
+static size_t segmentEnd(const unsigned char *packed, size_t start, size_t *unpacked){
+    *unpacked = 0;
+    for(;;){
+        unsigned char tokenByte = packed[start++];
+        if(tokenByte == 0) return start;
+        if(tokenByte < 0x80){
+            start += tokenByte;
+            *unpacked += tokenByte;
+        }
+        else{
+            start++;
+            *unpacked += (tokenByte & 0x7F) + MATCH_MIN;
+        }
+    }
+}
+
+
+void fillPackTable(assembler *ctx, const size_t *offsets){
+    if(ctx->packTable == NULL) return;
+
+    //The table lists the segments of the packed blocks in order
+    size_t entry = 0;
+    for(size_t b = 0; b < ctx->packSize; b++){
+        const packedBlock *block = &ctx->packs[b];
+        if(block->packed == NULL) continue;
+
+        size_t address = 0;
+        for(size_t i = 0; i < ctx->codeSize; i++){
+            if(ctx->code[i].data == block->packed) address = offsets[i];
+        }
+
+        size_t start = 0, destination = block->address;
+        while(start < block->packedSize){
+            //Entries are opcodes the unpacker writes over its own, so they are in
+            //the byte order of instructions
+            unsigned char *e = ctx->packTable + entry;
+            bool little = ctx->options->littleEndian;
+            e[little] = 0xA0 | (address + start) >> 8;
+            e[!little] = (address + start) & 0xFF;
+            e[2 + little] = 0xA0 | destination >> 8;
+            e[2 + !little] = destination & 0xFF;
+            entry += 4;
+
+            size_t unpacked;
+            start = segmentEnd(block->packed, start, &unpacked);
+            destination += unpacked;
+        }
+
+        //Unpacking must not write over any part of the program
+        size_t end = block->address + block->size;
+        for(size_t i = 0; i < ctx->codeSize; i++){
+            size_t from = offsets[i], to = offsets[i + 1];
+            if(i + 1 < ctx->codeSize && ctx->code[i + 1].section != ctx->code[i].section) to = from + (ctx->code[i].data ? ctx->code[i].size : 2);
+            if(from < to && from < end && (size_t)block->address < to){
+                ctx->line = block->line;
+                error(ctx, "pack unpacks to 0x%03X to 0x%03X, over the program at 0x%03X", block->address, (int)end - 1, (int)from);
+                break;
+            }
+        }
+    }
+}
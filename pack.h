@@ -0,0 +1,56 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Packed data: the pack directive's bytes are compressed once the whole program
+//has been read, and an unpacker at the start of the program expands them to
+//their address in memory before the program's own first instruction runs.
+//
+//The bytes are packed in segments of up to 256 that unpack on their own. A
+//segment is a series of tokens, each a byte followed by what it needs:
+//  0           ends the segment
+//  1 to 127    that many bytes follow, copied as they are
+//  128 to 255  a byte follows with a distance from 1 to 255, and the token
+//              minus 125 bytes are copied from that far back in the segment
+//A run of the same byte is a copy from a distance of 1.
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+
+#include "assembler.h"
+
+//Record the bytes of a pack line
+void addPackedBlock(assembler *ctx, const lineResult *r);
+
+//Pack every block that takes less room packed, and add the unpacker to the
+//start of the main section. Blocks stored as they are go at their address
+//like an org section.
+void packBlocks(assembler *ctx);
+
+//Fill in the segments the unpacker reads, once the layout has given the
+//packed bytes their addresses, and check that no block unpacks over the program
+void fillPackTable(assembler *ctx, const size_t *offsets);
+
+#endif
@@ -0,0 +1,464 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#include "profile.h"
+#include "cfg.h"
+#include "section.h"
+#include "optimize.h"
+#include "symtab.h"
+
+//Ways a block can be followed by another in the layout
+#define EDGE_FALLS 0        //It runs on into the block, which needs a jp if it is placed elsewhere
+#define EDGE_JUMPS 1        //Its jp goes to the block, and can be removed if it is placed next
+#define EDGE_FLIPS 2        //A skipped jp goes to the block, which can follow once the skip is turned around
+
+typedef struct{
+    int from;
+    int to;
+    unsigned long long weight;  //Times the edge ran, ULLONG_MAX if the blocks must stay together
+    unsigned char kind;
+} layoutEdge;
+
+//State of one layout
+typedef struct{
+    assembler *ctx;
+    controlFlowGraph g;
+    const unsigned long long *counts;   //Times each instruction ran
+    int *follow;            //Block that has to run next without a jump, -1 if there is none
+    int *succ;              //Block placed right after each one, -1 if there is none yet
+    int *pred;              //Block placed right before each one, -1 if there is none yet
+    int *chain;             //Union-find of the blocks placed together
+    bool *flipped;          //Skipped jp whose skip is turned around
+    bool *labelled;         //Something points at the instruction, so it is reached by more than the code before it
+} layoutState;
+
+
+int chip8_load_profile(const char *path, unsigned long long *counts){
+    FILE *file = fopen(path, "r");
+    if(file == NULL) return -1;
+    memset(counts, 0, CHIP8_MEMORY_SIZE * sizeof(counts[0]));
+
+    char line[256];
+    int lineNumber = 0;
+    int result = 0;
+    while(fgets(line, sizeof(line), file) != NULL){
+        lineNumber++;
+        char *comment = strchr(line, ';');
+        if(comment != NULL) *comment = '\0';
+
+        char *text = line;
+        while(isspace((unsigned char)*text)) text++;
+        if(*text == '\0') continue;
+
+        char *end, *countEnd;
+        unsigned long address = strtoul(text, &end, 0);
+        unsigned long long count = strtoull(end, &countEnd, 10);
+        while(isspace((unsigned char)*countEnd)) countEnd++;
+        if(end == text || countEnd == end || *countEnd != '\0' || address >= CHIP8_MEMORY_SIZE){
+            result = lineNumber;
+            break;
+        }
+
+        //Profiles of several runs can be put together in one file
+        counts[address] += count;
+    }
+
+    fclose(file);
+    return result;
+}
+
+
+int chip8_save_profile(const char *path, const unsigned long long *counts){
+    FILE *f = fopen(path, "w");
+    if(f == NULL) return 1;
+
+    fprintf(f, "; Address and the times the instruction there ran\n");
+    for(int address = 0; address < CHIP8_MEMORY_SIZE; address++){
+        if(counts[address] > 0) fprintf(f, "0x%03X %llu\n", address, counts[address]);
+    }
+    return fclose(f) != 0;
+}
+
+
+//Helper function to get the times the last instruction of a block ran, which
+//is how often the block is left
+static unsigned long long exitCount(const layoutState *s, int b){
+    const basicBlock *bb = &s->g.blocks[b];
+    for(int i = bb->end - 1; i >= bb->first; i--){
+        if(s->ctx->code[i].data == NULL) return s->counts[i];
+    }
+    return 0;
+}
+
+
+//Helper function to see if a block is the one instruction a skip skips
+static bool isSkipped(const layoutState *s, int b){
+    return b > 0 && s->g.blocks[b - 1].exit == BLOCK_SKIPS && s->g.blocks[b - 1].next == b;
+}
+
+
+//Helper function to get the times a block ran on into the block it has to be followed by
+static unsigned long long followCount(const layoutState *s, int b){
+    const basicBlock *bb = &s->g.blocks[b];
+    if(!isSkipped(s, b)) return exitCount(s, b);
+
+    //The landing after a skipped instruction is reached when the skip is taken,
+    //and after the skipped instruction unless it jumps away
+    unsigned long long skips = exitCount(s, b - 1);
+    unsigned long long runs = exitCount(s, b);
+    unsigned long long count = skips > runs ? skips - runs : 0;
+    if(bb->exit == BLOCK_FALLS || bb->exit == BLOCK_CALLS) count += runs;
+    return count;
+}
+
+
+//Helper function to find the first block placed together with b
+static int findChain(layoutState *s, int b){
+    while(s->chain[b] != b){
+        s->chain[b] = s->chain[s->chain[b]];
+        b = s->chain[b];
+    }
+    return b;
+}
+
+
+static int compareEdges(const void *a, const void *b){
+    const layoutEdge *x = a, *y = b;
+    if(x->weight != y->weight) return x->weight < y->weight ? 1 : -1;
+    if(x->kind != y->kind) return x->kind - y->kind;
+    return x->from - y->from;
+}
+
+
+//Helper function to list the ways blocks can follow each other. Blocks that
+//have to run on into the next one do unless it ran never, and jps can be
+//removed or turned around where they ran.
+static layoutEdge *findEdges(layoutState *s, size_t *edgeCount){
+    const instruction *code = s->ctx->code;
+    layoutEdge *edges = malloc((2 * s->g.count + 1) * sizeof(layoutEdge));
+    if(edges == NULL) return NULL;
+
+    size_t count = 0;
+    for(size_t b = 0; b < s->g.count; b++){
+        const basicBlock *bb = &s->g.blocks[b];
+        const instruction *last = &code[bb->end - 1];
+        s->follow[b] = -1;
+
+        //Running out of data means nothing, so data does not have to be followed
+        const instruction *filled = last;
+        for(int i = bb->end - 1; i > bb->first && filled->data != NULL && filled->size == 0; i--) filled = &code[i - 1];
+        bool data = filled->data != NULL && filled->size > 0;
+
+        if(isSkipped(s, b)) s->follow[b] = bb->next;
+        else if(!data && (bb->exit == BLOCK_FALLS || bb->exit == BLOCK_SKIPS || bb->exit == BLOCK_CALLS)) s->follow[b] = bb->next;
+
+        if(s->follow[b] >= 0){
+            unsigned long long weight = bb->exit == BLOCK_SKIPS ? ULLONG_MAX : followCount(s, b);
+            edges[count++] = (layoutEdge){b, s->follow[b], weight, EDGE_FALLS};
+        }
+
+        if(bb->exit != BLOCK_JUMPS || bb->branch < 0 || exitCount(s, b) == 0) continue;
+        if(code[s->g.blocks[bb->branch].first].section != last->section) continue;
+
+        //Turning a skip around changes where its jp goes, so the jp must only be
+        //reached from that skip, and the skip must not be skipped itself
+        if(!isSkipped(s, b)) edges[count++] = (layoutEdge){b, bb->branch, exitCount(s, b), EDGE_JUMPS};
+        else if(bb->next >= 0 && bb->first + 1 == bb->end && !isSkipped(s, b - 1) && !s->labelled[bb->first]) edges[count++] = (layoutEdge){b, bb->branch, exitCount(s, b), EDGE_FLIPS};
+    }
+
+    qsort(edges, count, sizeof(layoutEdge), compareEdges);
+    *edgeCount = count;
+    return edges;
+}
+
+
+//Helper function to join blocks into chains along the heaviest edges first.
+//A block can only be placed after one other, and the first block of a section
+//has to stay first.
+static void buildChains(layoutState *s, const layoutEdge *edges, size_t edgeCount){
+    const instruction *code = s->ctx->code;
+    for(size_t b = 0; b < s->g.count; b++){
+        s->succ[b] = -1;
+        s->pred[b] = -1;
+        s->chain[b] = b;
+        s->flipped[b] = false;
+    }
+
+    for(size_t e = 0; e < edgeCount; e++){
+        const layoutEdge *edge = &edges[e];
+        int from = edge->from, to = edge->to;
+        int first = s->g.blocks[to].first;
+        bool sectionStart = first == 0 || code[first - 1].section != code[first].section;
+        if(s->succ[from] != -1 || s->pred[to] != -1 || sectionStart) continue;
+        if(findChain(s, from) == findChain(s, to)) continue;
+
+        s->succ[from] = to;
+        s->pred[to] = from;
+        s->chain[findChain(s, to)] = findChain(s, from);
+        s->flipped[from] = edge->kind == EDGE_FLIPS;
+    }
+}
+
+
+//Helper function to put the chains of each section in order: the one the
+//section starts with, then the ones that ran, then the ones that never did,
+//each in the order they were written. Returns the number of blocks placed.
+static size_t orderBlocks(layoutState *s, int *order){
+    const instruction *code = s->ctx->code;
+    size_t count = s->g.count;
+    size_t placed = 0;
+
+    bool *hot = calloc(count + 1, sizeof(bool));
+    if(hot == NULL) return 0;
+    for(size_t b = 0; b < count; b++){
+        if(exitCount(s, b) > 0 || s->counts[s->g.blocks[b].first] > 0) hot[findChain(s, b)] = true;
+    }
+
+    size_t b = 0;
+    while(b < count){
+        int sectionIndex = code[s->g.blocks[b].first].section;
+        size_t end = b;
+        while(end < count && code[s->g.blocks[end].first].section == sectionIndex) end++;
+
+        for(int pass = 0; pass < 3; pass++){
+            for(size_t head = b; head < end; head++){
+                if(s->pred[head] != -1) continue;
+                bool wanted = pass == 0 ? head == b : head != b && hot[findChain(s, head)] == (pass == 1);
+                if(!wanted) continue;
+                for(int c = head; c != -1; c = s->succ[c]) order[placed++] = c;
+            }
+        }
+        b = end;
+    }
+    free(hot);
+    return placed;
+}
+
+
+//Helper function to add a jp to the block to to the end of the new code, or
+//only count it when out is NULL
+static void putJump(const layoutState *s, instruction *out, size_t *size, const instruction *from, int to){
+    if(out != NULL){
+        instruction *ins = &out[*size];
+        memset(ins, 0, sizeof(*ins));
+        ins->opcode = 0x1000;
+        ins->max = 4095;
+        ins->target = s->g.blocks[to].first;
+        ins->line = from->line;
+        ins->section = from->section;
+    }
+    (*size)++;
+}
+
+
+//Helper function to write the blocks in their new order to out, with jps
+//where a block no longer runs on into the one it has to, or only count them
+//when out is NULL. places gets the new index of every instruction. jumps
+//gets the times the jps in the new code will run by the profile.
+static size_t writeBlocks(const layoutState *s, const int *order, size_t orderCount, instruction *out,
+                          int *places, unsigned long long *jumps){
+    const instruction *code = s->ctx->code;
+    size_t size = 0;
+    *jumps = 0;
+
+    for(size_t p = 0; p < orderCount; p++){
+        int b = order[p];
+        const basicBlock *bb = &s->g.blocks[b];
+        int next = p + 1 < orderCount ? order[p + 1] : -1;
+        if(next >= 0 && code[s->g.blocks[next].first].section != code[bb->first].section) next = -1;
+
+        for(int i = bb->first; i < bb->end; i++){
+            const instruction *ins = &code[i];
+            places[i] = size;
+            bool last = i == bb->end - 1;
+
+            //A jp to the block placed next is not needed
+            if(last && bb->exit == BLOCK_JUMPS && !isSkipped(s, b) && next >= 0 && ins->target == s->g.blocks[next].first) continue;
+
+            if(out != NULL){
+                out[size] = *ins;
+                if(last && bb->exit == BLOCK_SKIPS && s->flipped[bb->next]) out[size].opcode = invertSkip(ins->opcode);
+                if(last && s->flipped[b]) out[size].target = s->g.blocks[bb->next].first;
+            }
+            size++;
+
+            if(last && (ins->opcode & 0xF000) == 0x1000 && ins->data == NULL){
+                *jumps += s->flipped[b] ? followCount(s, b) : exitCount(s, b);
+            }
+        }
+
+        if(s->flipped[b] || s->follow[b] < 0 || s->follow[b] == next) continue;
+        putJump(s, out, &size, &code[bb->end - 1], s->follow[b]);
+        *jumps += followCount(s, b);
+    }
+    return size;
+}
+
+
+//Helper function to free a layout
+static void freeLayout(layoutState *s){
+    freeControlFlowGraph(&s->g);
+    free(s->follow);
+    free(s->succ);
+    free(s->pred);
+    free(s->chain);
+    free(s->flipped);
+    free(s->labelled);
+}
+
+
+void profileLayout(assembler *ctx){
+    const unsigned long long *profile = ctx->options->profile;
+    const instruction *pinned = findPinned(ctx);
+    if(pinned != NULL){
+        warnPinned(ctx, pinned, "Profile layout");
+        return;
+    }
+
+    size_t size = ctx->codeSize;
+    layoutState s = {0};
+    s.ctx = ctx;
+    size_t *offsets = malloc((size + 1) * sizeof(size_t));
+    unsigned long long *counts = calloc(size + 1, sizeof(unsigned long long));
+    int *order = NULL, *places = NULL;
+    layoutEdge *edges = NULL;
+    instruction *code = NULL;
+    if(offsets == NULL || counts == NULL){
+        ctx->outOfMemory = true;
+        goto done;
+    }
+    s.counts = counts;
+
+    //Sections that do not fit are reported when the image is laid out
+    if(!placeSections(ctx, offsets, false)) goto done;
+
+    //Every run in the profile has to be of an instruction of this program
+    unsigned long long total = 0, matched = 0, jumpsBefore = 0;
+    for(int address = 0; address < CHIP8_MEMORY_SIZE; address++) total += profile[address];
+    for(size_t i = 0; i < size; i++){
+        const instruction *ins = &ctx->code[i];
+        if(ins->data != NULL || offsets[i] >= CHIP8_MEMORY_SIZE) continue;
+        counts[i] = profile[offsets[i]];
+        matched += counts[i];
+        if((ins->opcode & 0xF000) == 0x1000) jumpsBefore += counts[i];
+    }
+    ctx->line = 0;
+    if(matched != total){
+        warning(ctx, "Profile layout skipped, the profile has runs at addresses where the program has no instruction");
+        goto done;
+    }
+
+    if(buildControlFlowGraph(ctx->code, size, &s.g) != 0){
+        ctx->outOfMemory = true;
+        goto done;
+    }
+    size_t blocks = s.g.count;
+    s.follow = malloc((blocks + 1) * sizeof(int));
+    s.succ = malloc((blocks + 1) * sizeof(int));
+    s.pred = malloc((blocks + 1) * sizeof(int));
+    s.chain = malloc((blocks + 1) * sizeof(int));
+    s.flipped = calloc(blocks + 1, sizeof(bool));
+    s.labelled = calloc(size + 1, sizeof(bool));
+    order = malloc((blocks + 1) * sizeof(int));
+    places = malloc((size + 1) * sizeof(int));
+    if(s.follow == NULL || s.succ == NULL || s.pred == NULL || s.chain == NULL || s.flipped == NULL || s.labelled == NULL || order == NULL || places == NULL){
+        ctx->outOfMemory = true;
+        goto done;
+    }
+
+    for(size_t i = 0; i < size; i++){
+        if(ctx->code[i].target >= 0) s.labelled[ctx->code[i].target] = true;
+    }
+    //Anchor points can also be used in values worked out at layout
+    for(size_t i = 0; i < ctx->anchors->capacity; i++){
+        if(ctx->anchors->values[i].nameLength > 0) s.labelled[ctx->anchors->values[i].place] = true;
+    }
+
+    size_t edgeCount;
+    edges = findEdges(&s, &edgeCount);
+    if(edges == NULL){
+        ctx->outOfMemory = true;
+        goto done;
+    }
+    buildChains(&s, edges, edgeCount);
+    size_t placed = orderBlocks(&s, order);
+    if(placed != blocks){
+        ctx->outOfMemory = true;
+        goto done;
+    }
+
+    //Only a layout that runs fewer jps is worth having
+    unsigned long long jumpsAfter;
+    size_t newSize = writeBlocks(&s, order, blocks, NULL, places, &jumpsAfter);
+    if(jumpsAfter >= jumpsBefore){
+        note(ctx, "Profile layout found no jumps to remove on the profiled path");
+        goto done;
+    }
+
+    code = malloc((newSize + 1) * sizeof(instruction));
+    if(code == NULL){
+        ctx->outOfMemory = true;
+        goto done;
+    }
+    writeBlocks(&s, order, blocks, code, places, &jumpsAfter);
+    places[size] = newSize;
+    for(size_t i = 0; i < newSize; i++){
+        if(code[i].target >= 0) code[i].target = places[code[i].target];
+    }
+    moveAnchorPoints(ctx->anchors, places);
+
+    size_t flips = 0;
+    for(size_t b = 0; b < blocks; b++) flips += s.flipped[b];
+
+    free(ctx->code);
+    ctx->code = code;
+    ctx->codeSize = newSize;
+    ctx->codeCapacity = newSize + 1;
+    ctx->PC = newSize;
+    code = NULL;
+
+    if(ctx->stats){
+        ctx->stats->profiledJumps += jumpsBefore;
+        ctx->stats->profileJumpsRemoved += jumpsBefore - jumpsAfter;
+        ctx->stats->flippedSkips += flips;
+    }
+    note(ctx, "Profile layout cut the jumps run on the profiled path from %llu to %llu (%.1f%% fewer), %zu skips flipped",
+         jumpsBefore, jumpsAfter, 100.0 * (jumpsBefore - jumpsAfter) / jumpsBefore, flips);
+
+done:
+    free(offsets);
+    free(counts);
+    free(order);
+    free(places);
+    free(edges);
+    free(code);
+    freeLayout(&s);
+}
@@ -0,0 +1,637 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "regalloc.h"
+#include "symtab.h"
+#include "opcodes.h"
+#include "cfg.h"
+
+//VF holds the flag of arithmetic and drw, so it is never given out
+#define FLAG_REGISTER 15
+
+//ld [i], v0 and ld v0, [i] are the only ways to move a single register to and
+//from memory, so every value kept in memory passes through v0
+#define SPILL_REGISTER 0
+
+//A use inside a loop counts this many times more than one outside it when
+//picking what to keep in memory, up to LOOP_DEPTH loops deep
+#define LOOP_WEIGHT 8
+#define LOOP_DEPTH 5
+
+//What one instruction does with the virtual registers and I
+typedef struct{
+    int reads[2];           //Virtual registers read, -1 for none
+    int writes;             //Virtual register written, -1 for none
+    bool readsI;
+    bool writesI;
+} access;
+
+//State of one allocation. Live sets have a bit for each virtual register and
+//one more for I, which decides where values can be loaded and stored.
+typedef struct{
+    assembler *ctx;
+    controlFlowGraph g;
+    size_t count;           //Virtual registers, I is bit count of a live set
+    size_t words;           //Words in a live set
+    uint64_t *liveIn;       //Live set at the start of each block
+    uint64_t *liveOut;      //Live set at the end of each block
+    uint64_t *interferes;   //count x count matrix of virtual registers live at the same time
+    double *cost;           //Uses and writes, weighted by loop depth
+    int *hint;              //Virtual register copied to or from, -1 if none
+    int *blocked;           //Line where a virtual register can not be kept in memory, 0 if there is none
+    int *color;             //Register given to each virtual register, -1 if it is kept in memory
+} allocation;
+
+
+int addVirtualRegister(assembler *ctx, const char *name, size_t length){
+    bool valid = length >= 2 && !isdigit((unsigned char)name[1]);
+    for(size_t i = 1; i < length && valid; i++) valid = isalnum((unsigned char)name[i]) || name[i] == '_' || name[i] == '@';
+    if(!valid){
+        error(ctx, "Invalid virtual register %.*s", (int)length, name);
+        return 0;
+    }
+
+    if(ctx->registerNames == NULL){
+        ctx->registerNames = newAnchorPointList();
+        if(ctx->registerNames == NULL){
+            ctx->outOfMemory = true;
+            return 0;
+        }
+    }
+
+    int index = getPCFromAnchorpoint(name, length, ctx->registerNames);
+    if(index != -1) return index + 1;
+
+    //Instructions keep the number in an unsigned short
+    if(ctx->virtualSize == 0xFFFF){
+        error(ctx, "Too many virtual registers");
+        return 0;
+    }
+    if(ctx->virtualSize == ctx->virtualCapacity){
+        size_t newCapacity = ctx->virtualCapacity ? ctx->virtualCapacity * 2 : 32;
+        virtualRegister *temp = realloc(ctx->virtuals, newCapacity * sizeof(ctx->virtuals[0]));
+        if(temp == NULL){
+            ctx->outOfMemory = true;
+            return 0;
+        }
+        ctx->virtuals = temp;
+        ctx->virtualCapacity = newCapacity;
+    }
+    if(addAnchorPoint(ctx->registerNames, name, length, ctx->virtualSize) != ANCHOR_OK){
+        ctx->outOfMemory = true;
+        return 0;
+    }
+
+    virtualRegister *v = &ctx->virtuals[ctx->virtualSize];
+    v->name = name;
+    v->length = length;
+    v->line = ctx->line;
+    return ++ctx->virtualSize;
+}
+
+
+//Helper function to see what an instruction reads and writes
+static void getAccess(const instruction *ins, access *a){
+    unsigned short opcode = ins->opcode;
+    unsigned short group = opcode & 0xF000;
+    unsigned char low = opcode & 0xFF;
+
+    bool readsDelay = group == 0xF000 && (low == 0x07 || low == 0x0A);
+    bool writesX = group == 0x6000 || group == 0x7000 || group == 0x8000 || group == 0xC000 || readsDelay;
+    bool setsX = group == 0x6000 || group == 0xC000 || (group == 0x8000 && (opcode & 0xF) == 0) || readsDelay;
+
+    a->reads[0] = ins->data == NULL && !setsX ? ins->registers[0] - 1 : -1;
+    a->reads[1] = ins->data == NULL ? ins->registers[1] - 1 : -1;
+    a->writes = ins->data == NULL && writesX ? ins->registers[0] - 1 : -1;
+    a->readsI = ins->data == NULL && (group == 0xD000 || (group == 0xF000 && (low == 0x1E || low == 0x21 || low == 0x37 || low == 0x41)));
+    a->writesI = ins->data == NULL && (group == 0xA000 || (group == 0xF000 && (low == 0x1D || low == 0x1E || low == 0x30)));
+}
+
+
+static inline bool testBit(const uint64_t *set, size_t bit){
+    return set[bit / 64] >> (bit % 64) & 1;
+}
+
+static inline void setBit(uint64_t *set, size_t bit){
+    set[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static inline void clearBit(uint64_t *set, size_t bit){
+    set[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+
+//Helper function to get the registers the program names itself, which are
+//never given to a virtual register. ld [i] and ld vx, [i] use v0 to vx, and jp v0 uses v0.
+static unsigned short namedRegisters(const assembler *ctx){
+    unsigned short named = 1 << FLAG_REGISTER;
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        const instruction *ins = &ctx->code[i];
+        if(ins->data != NULL) continue;
+
+        const opcodeEntry *form = decodeOpcode(ins->opcode);
+        if(form == NULL) continue;
+        if(form->opcode == 0xB000) named |= 1 << 0;
+        if(form->opcode == 0xF037 || form->opcode == 0xF041) named |= (2 << (ins->opcode >> 8 & 0xF)) - 1;
+
+        int field = 0;
+        for(int j = 0; j < form->operandCount; j++){
+            if(form->operands[j] != OPERAND_REGISTER) continue;
+            int shift = field == 0 ? 8 : 4;
+            if(ins->registers[field] == 0) named |= 1 << (ins->opcode >> shift & 0xF);
+            field++;
+        }
+    }
+    return named;
+}
+
+
+//Helper function to see if a skip decides whether an instruction runs, in which
+//case nothing can be put in front of it or after it
+static bool isGuarded(const assembler *ctx, size_t i){
+    if(i == 0) return false;
+    const instruction *prev = &ctx->code[i - 1];
+    return prev->data == NULL && prev->section == ctx->code[i].section && isSkipOpcode(prev->opcode);
+}
+
+
+//Helper function to work out what is live at the start and end of every block.
+//A ret can go back after any call, and a jump that can not be followed may
+//go anywhere, so everything is live there.
+static void findLiveness(allocation *al, uint64_t *gen, uint64_t *kill, uint64_t *returns){
+    const assembler *ctx = al->ctx;
+    size_t words = al->words;
+
+    for(size_t b = 0; b < al->g.count; b++){
+        const basicBlock *bb = &al->g.blocks[b];
+        uint64_t *g = gen + b * words;
+        uint64_t *k = kill + b * words;
+        for(int i = bb->end - 1; i >= bb->first; i--){
+            access a;
+            getAccess(&ctx->code[i], &a);
+            if(a.writes >= 0){
+                clearBit(g, a.writes);
+                setBit(k, a.writes);
+            }
+            if(a.writesI){
+                clearBit(g, al->count);
+                setBit(k, al->count);
+            }
+            for(int r = 0; r < 2; r++){
+                if(a.reads[r] >= 0) setBit(g, a.reads[r]);
+            }
+            if(a.readsI) setBit(g, al->count);
+        }
+    }
+
+    bool changed = true;
+    while(changed){
+        changed = false;
+
+        memset(returns, 0, words * sizeof(uint64_t));
+        for(size_t b = 0; b < al->g.count; b++){
+            const basicBlock *bb = &al->g.blocks[b];
+            if(bb->exit != BLOCK_CALLS || bb->next < 0) continue;
+            const uint64_t *in = al->liveIn + bb->next * words;
+            for(size_t w = 0; w < words; w++) returns[w] |= in[w];
+        }
+
+        for(size_t b = al->g.count; b-- > 0;){
+            const basicBlock *bb = &al->g.blocks[b];
+            uint64_t *in = al->liveIn + b * words;
+            uint64_t *out = al->liveOut + b * words;
+
+            int successors[2] = {-1, -1};
+            if(bb->exit == BLOCK_FALLS || bb->exit == BLOCK_SKIPS || bb->exit == BLOCK_CALLS) successors[0] = bb->next;
+            if(bb->exit == BLOCK_JUMPS || bb->exit == BLOCK_SKIPS || bb->exit == BLOCK_CALLS) successors[1] = bb->branch;
+
+            for(size_t w = 0; w < words; w++){
+                uint64_t live = 0;
+                if(bb->exit == BLOCK_UNKNOWN) live = ~(uint64_t)0;
+                else if(bb->exit == BLOCK_RETURNS) live = returns[w];
+                for(int s = 0; s < 2; s++){
+                    if(successors[s] >= 0) live |= al->liveIn[successors[s] * words + w];
+                }
+
+                uint64_t liveIn = gen[b * words + w] | (live & ~kill[b * words + w]);
+                if(live != out[w] || liveIn != in[w]) changed = true;
+                out[w] = live;
+                in[w] = liveIn;
+            }
+        }
+    }
+}
+
+
+//Helper function to walk every instruction from the end of its block with what
+//is live after it, recording which virtual registers interfere, what each one
+//costs to keep in memory, and where one can not be loaded or stored
+static void findInterference(allocation *al, const int *depth){
+    const assembler *ctx = al->ctx;
+    size_t words = al->words;
+    uint64_t *live = malloc(words * sizeof(uint64_t));
+    if(live == NULL){
+        al->ctx->outOfMemory = true;
+        return;
+    }
+
+    for(size_t b = 0; b < al->g.count; b++){
+        const basicBlock *bb = &al->g.blocks[b];
+        memcpy(live, al->liveOut + b * words, words * sizeof(uint64_t));
+
+        for(int i = bb->end - 1; i >= bb->first; i--){
+            const instruction *ins = &ctx->code[i];
+            access a;
+            getAccess(ins, &a);
+            if(a.writes < 0 && a.reads[0] < 0 && a.reads[1] < 0 && !a.writesI && !a.readsI) continue;
+
+            double weight = 1;
+            for(int d = 0; d < depth[i] && d < LOOP_DEPTH; d++) weight *= LOOP_WEIGHT;
+            bool guarded = isGuarded(ctx, i);
+
+            //A value kept in memory is stored right after it is written, which needs I
+            if(a.writes >= 0){
+                int w = a.writes;
+                al->cost[w] += weight;
+                if((guarded || testBit(live, al->count)) && (al->blocked[w] == 0 || ins->line < al->blocked[w])) al->blocked[w] = ins->line;
+
+                //A copy does not make the two registers interfere, they hold the same value
+                bool copies = (ins->opcode & 0xF00F) == 0x8000;
+                for(size_t v = 0; v < al->count; v++){
+                    if(!testBit(live, v) || (int)v == w || (copies && (int)v == a.reads[1])) continue;
+                    setBit(al->interferes + w * words, v);
+                    setBit(al->interferes + v * words, w);
+                }
+                if(copies && a.reads[1] >= 0){
+                    al->hint[w] = a.reads[1];
+                    al->hint[a.reads[1]] = w;
+                }
+                clearBit(live, w);
+            }
+            if(a.writesI) clearBit(live, al->count);
+            for(int r = 0; r < 2; r++){
+                if(a.reads[r] >= 0) setBit(live, a.reads[r]);
+            }
+            if(a.readsI) setBit(live, al->count);
+
+            //and loaded right before it is read, which needs I too
+            for(int r = 0; r < 2; r++){
+                int v = a.reads[r];
+                if(v < 0) continue;
+                al->cost[v] += weight;
+                if((guarded || testBit(live, al->count)) && (al->blocked[v] == 0 || ins->line < al->blocked[v])) al->blocked[v] = ins->line;
+            }
+        }
+    }
+    free(live);
+}
+
+
+//Helper function to count the loops around every instruction. A jump back to
+//an earlier instruction of its section closes a loop over the ones in between.
+static void findLoopDepth(const assembler *ctx, int *depth){
+    memset(depth, 0, (ctx->codeSize + 1) * sizeof(int));
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        int target = jumpTarget(&ctx->code[i], ctx->codeSize);
+        if((ctx->code[i].opcode & 0xF000) != 0x1000 || target < 0 || (size_t)target > i) continue;
+        if(ctx->code[target].section != ctx->code[i].section) continue;
+        depth[target]++;
+        depth[i + 1]--;
+    }
+    for(size_t i = 1; i <= ctx->codeSize; i++) depth[i] += depth[i - 1];
+}
+
+
+//Helper function to color the interference graph with the registers in order.
+//Virtual registers with the fewest neighbours are taken out first, and when
+//none has fewer than there are registers, the cheapest to keep in memory is.
+//They get colors in the reverse order, so one taken out as a spill may still
+//find a register free. Returns the number kept in memory.
+static size_t colorGraph(allocation *al, const int *registers, int registerCount){
+    size_t count = al->count;
+    size_t words = al->words;
+    int *degree = malloc((count + 1) * sizeof(int));
+    int *stack = malloc((count + 1) * sizeof(int));
+    bool *removed = calloc(count + 1, sizeof(bool));
+    if(degree == NULL || stack == NULL || removed == NULL){
+        free(degree);
+        free(stack);
+        free(removed);
+        al->ctx->outOfMemory = true;
+        return 0;
+    }
+
+    for(size_t v = 0; v < count; v++){
+        degree[v] = 0;
+        for(size_t w = 0; w < words; w++) degree[v] += __builtin_popcountll(al->interferes[v * words + w]);
+    }
+
+    for(size_t step = 0; step < count; step++){
+        int pick = -1;
+        for(size_t v = 0; v < count && pick == -1; v++){
+            if(!removed[v] && degree[v] < registerCount) pick = v;
+        }
+
+        //Values that can not be kept in memory are only picked when nothing else is left
+        if(pick == -1){
+            double best = 0;
+            for(size_t v = 0; v < count; v++){
+                if(removed[v]) continue;
+                double score = al->cost[v] / (degree[v] + 1);
+                if(al->blocked[v] != 0) score += 1e300;
+                if(pick == -1 || score < best){
+                    pick = v;
+                    best = score;
+                }
+            }
+        }
+
+        removed[pick] = true;
+        stack[step] = pick;
+        for(size_t u = 0; u < count; u++){
+            if(!removed[u] && testBit(al->interferes + pick * words, u)) degree[u]--;
+        }
+    }
+
+    size_t spilled = 0;
+    for(size_t v = 0; v < count; v++) al->color[v] = -1;
+    for(size_t step = count; step-- > 0;){
+        int v = stack[step];
+        unsigned short taken = 0;
+        for(size_t u = 0; u < count; u++){
+            if(al->color[u] >= 0 && testBit(al->interferes + v * words, u)) taken |= 1 << al->color[u];
+        }
+
+        //A copy between two virtual registers goes away when they share one
+        int hint = al->hint[v];
+        if(hint >= 0 && al->color[hint] >= 0 && !(taken >> al->color[hint] & 1)){
+            al->color[v] = al->color[hint];
+            continue;
+        }
+        for(int r = 0; r < registerCount && al->color[v] < 0; r++){
+            if(!(taken >> registers[r] & 1)) al->color[v] = registers[r];
+        }
+        if(al->color[v] < 0) spilled++;
+    }
+
+    free(degree);
+    free(stack);
+    free(removed);
+    return spilled;
+}
+
+
+//Helper function to add an instruction in front of or after from to out, or
+//only count it when out is NULL
+static void putInstruction(instruction *out, size_t *size, const instruction *from, unsigned short opcode, int target){
+    if(out != NULL){
+        instruction *ins = &out[*size];
+        memset(ins, 0, sizeof(*ins));
+        ins->opcode = opcode;
+        ins->max = target >= 0 ? 4095 : 0;
+        ins->target = target;
+        ins->line = from->line;
+        ins->section = from->section;
+    }
+    (*size)++;
+}
+
+
+//Helper function to write an instruction with its registers filled in to out,
+//along with the loads in front of it and the store after it that values kept
+//in memory need, or only count them when out is NULL. Returns the count.
+static size_t rewriteInstruction(const allocation *al, const instruction *from, const int *slots, size_t slotBase,
+                                 int scratch, const int *places, instruction *out){
+    instruction ins = *from;
+    access a;
+    getAccess(&ins, &a);
+    int x = ins.registers[0] - 1;
+    int y = ins.registers[1] - 1;
+    bool xSpilled = x >= 0 && slots[x] >= 0;
+    bool ySpilled = y >= 0 && slots[y] >= 0;
+    size_t size = 0;
+
+    if(ySpilled){
+        int r = xSpilled && y != x ? scratch : SPILL_REGISTER;
+        putInstruction(out, &size, from, 0xA000, slotBase + slots[y]);
+        putInstruction(out, &size, from, 0xF041, -1);
+        if(r != SPILL_REGISTER) putInstruction(out, &size, from, 0x8000 | r << 8 | SPILL_REGISTER << 4, -1);
+        ins.opcode |= r << 4;
+    }
+    else if(y >= 0) ins.opcode |= al->color[y] << 4;
+
+    if(xSpilled){
+        if(a.reads[0] >= 0 && y != x){
+            putInstruction(out, &size, from, 0xA000, slotBase + slots[x]);
+            putInstruction(out, &size, from, 0xF041, -1);
+        }
+        ins.opcode |= SPILL_REGISTER << 8;
+    }
+    else if(x >= 0) ins.opcode |= al->color[x] << 8;
+
+    if(out != NULL){
+        ins.registers[0] = ins.registers[1] = 0;
+        if(ins.target >= 0) ins.target = places[ins.target];
+        out[size] = ins;
+    }
+    size++;
+
+    if(xSpilled && a.writes >= 0){
+        putInstruction(out, &size, from, 0xA000, slotBase + slots[x]);
+        putInstruction(out, &size, from, 0xF037, -1);
+    }
+    return size;
+}
+
+
+//Helper function to put the registers into every instruction, with the loads
+//and stores around the ones that use a value kept in memory. Each value kept
+//in memory gets a byte at the end of the main section. scratch holds a second
+//value when an instruction reads two that are kept in memory.
+static void rewriteCode(allocation *al, int scratch){
+    assembler *ctx = al->ctx;
+    size_t size = ctx->codeSize;
+
+    int *slots = malloc((al->count + 1) * sizeof(int));
+    int *places = malloc((size + 1) * sizeof(int));
+    if(slots == NULL || places == NULL){
+        free(slots);
+        free(places);
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    size_t slotCount = 0;
+    for(size_t v = 0; v < al->count; v++) slots[v] = al->color[v] < 0 ? (int)slotCount++ : -1;
+
+    //Work out where everything goes. Anything that pointed at an instruction
+    //points at the loads in front of it.
+    size_t mainEnd = 0;
+    while(mainEnd < size && ctx->code[mainEnd].section == 0) mainEnd++;
+
+    size_t newSize = 0;
+    size_t slotBase = 0;
+    for(size_t i = 0; i <= size; i++){
+        if(i == mainEnd){
+            slotBase = newSize;
+            newSize += slotCount;
+        }
+        places[i] = newSize;
+        if(i < size) newSize += rewriteInstruction(al, &ctx->code[i], slots, slotBase, scratch, places, NULL);
+    }
+
+    instruction *code = malloc((newSize + 1) * sizeof(instruction));
+    unsigned char *bytes = slotCount ? allocateData(ctx, slotCount) : NULL;
+    if(code == NULL || (slotCount && bytes == NULL)){
+        free(slots);
+        free(places);
+        free(code);
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    size_t out = 0;
+    for(size_t i = 0; i <= size; i++){
+        if(i == mainEnd){
+            for(size_t v = 0; v < al->count; v++){
+                if(slots[v] < 0) continue;
+                instruction *slot = &code[out++];
+                memset(slot, 0, sizeof(*slot));
+                slot->target = -1;
+                slot->line = ctx->virtuals[v].line;
+                slot->data = bytes + slots[v];
+                slot->size = 1;
+                bytes[slots[v]] = 0;
+            }
+        }
+        if(i < size) out += rewriteInstruction(al, &ctx->code[i], slots, slotBase, scratch, places, code + out);
+    }
+    moveAnchorPoints(ctx->anchors, places);
+
+    if(ctx->stats){
+        ctx->stats->spilledRegisters += slotCount;
+        ctx->stats->spillInstructions += newSize - size - slotCount;
+    }
+
+    free(ctx->code);
+    ctx->code = code;
+    ctx->codeSize = newSize;
+    ctx->codeCapacity = newSize + 1;
+    ctx->PC = newSize;
+    free(slots);
+    free(places);
+}
+
+
+//Helper function to free an allocation
+static void freeAllocation(allocation *al){
+    freeControlFlowGraph(&al->g);
+    free(al->liveIn);
+    free(al->liveOut);
+    free(al->interferes);
+    free(al->cost);
+    free(al->hint);
+    free(al->blocked);
+    free(al->color);
+}
+
+
+void allocateRegisters(assembler *ctx){
+    if(ctx->virtualSize == 0) return;
+    if(ctx->stats) ctx->stats->virtualRegisters += ctx->virtualSize;
+
+    allocation al = {0};
+    al.ctx = ctx;
+    al.count = ctx->virtualSize;
+    al.words = (al.count + 1 + 63) / 64;
+    if(buildControlFlowGraph(ctx->code, ctx->codeSize, &al.g) != 0){
+        ctx->outOfMemory = true;
+        return;
+    }
+
+    size_t blockWords = (al.g.count + 1) * al.words;
+    uint64_t *gen = calloc(blockWords, sizeof(uint64_t));
+    uint64_t *kill = calloc(blockWords, sizeof(uint64_t));
+    uint64_t *returns = calloc(al.words, sizeof(uint64_t));
+    int *depth = malloc((ctx->codeSize + 1) * sizeof(int));
+    al.liveIn = calloc(blockWords, sizeof(uint64_t));
+    al.liveOut = calloc(blockWords, sizeof(uint64_t));
+    al.interferes = calloc(al.count * al.words, sizeof(uint64_t));
+    al.cost = calloc(al.count, sizeof(double));
+    al.hint = malloc(al.count * sizeof(int));
+    al.blocked = calloc(al.count, sizeof(int));
+    al.color = malloc(al.count * sizeof(int));
+    if(gen == NULL || kill == NULL || returns == NULL || depth == NULL || al.liveIn == NULL || al.liveOut == NULL ||
+       al.interferes == NULL || al.cost == NULL || al.hint == NULL || al.blocked == NULL || al.color == NULL){
+        ctx->outOfMemory = true;
+        goto done;
+    }
+    for(size_t v = 0; v < al.count; v++) al.hint[v] = -1;
+
+    findLiveness(&al, gen, kill, returns);
+    findLoopDepth(ctx, depth);
+    findInterference(&al, depth);
+    if(ctx->outOfMemory) goto done;
+
+    int registers[16];
+    int registerCount = 0;
+    unsigned short named = namedRegisters(ctx);
+    for(int r = 0; r < 16; r++){
+        if(!(named >> r & 1)) registers[registerCount++] = r;
+    }
+
+    //Try every free register first. If that is not enough, v0 and one more are
+    //kept for moving values to and from memory.
+    int scratch = -1;
+    if(colorGraph(&al, registers, registerCount) > 0 && !ctx->outOfMemory){
+        bool spillable = registerCount >= 3 && registers[0] == SPILL_REGISTER;
+        if(spillable){
+            scratch = registers[--registerCount];
+            colorGraph(&al, registers + 1, registerCount - 1);
+        }
+
+        for(size_t v = 0; v < al.count; v++){
+            const virtualRegister *vr = &ctx->virtuals[v];
+            ctx->line = vr->line;
+            if(al.color[v] >= 0) continue;
+            if(!spillable) error(ctx, "Not enough registers for %.*s, keeping it in memory needs v0 and one more free", (int)vr->length, vr->name);
+            else if(al.blocked[v] != 0) error(ctx, "Not enough registers for %.*s, and line %i uses I or follows a skip so it can not be kept in memory", (int)vr->length, vr->name, al.blocked[v]);
+            else note(ctx, "%.*s is kept in memory, there is no register free for it", (int)vr->length, vr->name);
+        }
+    }
+    if(ctx->errors == 0 && !ctx->outOfMemory) rewriteCode(&al, scratch);
+
+done:
+    free(gen);
+    free(kill);
+    free(returns);
+    free(depth);
+    freeAllocation(&al);
+}
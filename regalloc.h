@@ -0,0 +1,43 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Virtual registers: names such as %tmp that can stand in for a register in any
+//instruction, given real registers by liveness analysis over the control flow
+//graph and graph coloring once the whole program is known
+
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include "assembler.h"
+
+//Get the number of the virtual register a word names, as its index + 1, adding
+//it the first time it is used. Returns 0 after reporting an error.
+int addVirtualRegister(assembler *ctx, const char *name, size_t length);
+
+//Give every virtual register a register the program does not use by name,
+//never VF. Values that do not fit are kept in memory and loaded through v0
+//around the instructions that use them.
+void allocateRegisters(assembler *ctx);
+
+#endif
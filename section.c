@@ -0,0 +1,330 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#include "section.h"
+#include "symtab.h"
+
+//Every section has to end before the end marker, which goes at the very end of the image
+#define MEMORY_END (CHIP8_MEMORY_SIZE - 4)
+
+//A stretch of memory no section has been placed in
+typedef struct{
+    size_t start;
+    size_t end;
+} freeSpace;
+
+
+//Helper function to add a section. Returns its index, or -1 if out of memory.
+static int addSection(assembler *ctx, const char *name, size_t length, int origin, int line){
+    if(ctx->sectionSize == ctx->sectionCapacity){
+        size_t newCapacity = ctx->sectionCapacity ? ctx->sectionCapacity * 2 : 8;
+        section *temp = realloc(ctx->sections, newCapacity * sizeof(ctx->sections[0]));
+        if(temp == NULL){
+            ctx->outOfMemory = true;
+            return -1;
+        }
+        ctx->sections = temp;
+        ctx->sectionCapacity = newCapacity;
+    }
+
+    section *s = &ctx->sections[ctx->sectionSize];
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    s->nameLength = length;
+    s->origin = origin;
+    s->line = line;
+    return ctx->sectionSize++;
+}
+
+
+//Helper function to compare two names of the same length, ignoring case
+static bool sameName(const char *a, const char *b, size_t length){
+    size_t i = 0;
+    while(i < length && tolower((unsigned char)a[i]) == tolower((unsigned char)b[i])) i++;
+    return i == length;
+}
+
+
+//Helper function to find a named section, or -1 if there is none. main names the main section.
+static int findSection(const assembler *ctx, const char *name, size_t length){
+    if(length == 4 && sameName(name, "main", 4)) return 0;
+    for(size_t i = 1; i < ctx->sectionSize; i++){
+        const section *s = &ctx->sections[i];
+        if(s->name != NULL && s->nameLength == length && sameName(s->name, name, length)) return i;
+    }
+    return -1;
+}
+
+
+//Helper function to end the part of the current section read so far with an
+//empty piece of data, so anchor points at its end stay in the section
+static void closeSection(assembler *ctx){
+    static const unsigned char none[1] = {0};
+    lineResult end = {0};
+    end.kind = LINE_DATA;
+    end.data = none;
+    addInstruction(ctx, &end);
+    ctx->PC++;
+}
+
+
+//Helper function to describe a section in a message
+static void describeSection(const assembler *ctx, int index, char *text, size_t size){
+    const section *s = &ctx->sections[index];
+    if(index == 0) snprintf(text, size, "section main");
+    else if(s->name != NULL) snprintf(text, size, "section %.*s", (int)(s->nameLength > 32 ? 32 : s->nameLength), s->name);
+    else snprintf(text, size, "org 0x%03X", s->origin);
+}
+
+
+void beginSection(assembler *ctx, const lineResult *r){
+    //The main section is only made once it is not the only one
+    if(ctx->sectionSize == 0 && addSection(ctx, NULL, 0, CHIP8_PROGRAM_START, 0) == -1) return;
+    closeSection(ctx);
+
+    int index = r->name != NULL ? findSection(ctx, r->name, r->length) : -1;
+    if(index == -1) index = addSection(ctx, r->name, r->length, r->name != NULL ? -1 : (int)r->size, ctx->line);
+    if(index != -1) ctx->currentSection = index;
+}
+
+
+int addFixedSection(assembler *ctx, int origin, int line){
+    if(ctx->sectionSize == 0){
+        if(addSection(ctx, NULL, 0, CHIP8_PROGRAM_START, 0) == -1) return -1;
+        closeSection(ctx);
+    }
+    return addSection(ctx, NULL, 0, origin, line);
+}
+
+
+void endSections(assembler *ctx){
+    if(ctx->sectionSize == 0) return;
+    closeSection(ctx);
+    if(ctx->outOfMemory) return;
+
+    size_t size = ctx->codeSize;
+    bool grouped = true;
+    for(size_t i = 1; i < size && grouped; i++) grouped = ctx->code[i].section >= ctx->code[i - 1].section;
+    if(grouped) return;
+
+    size_t *next = calloc(ctx->sectionSize, sizeof(size_t));
+    int *places = malloc((size + 1) * sizeof(int));
+    instruction *code = malloc(ctx->codeCapacity * sizeof(instruction));
+    if(next == NULL || places == NULL || code == NULL){
+        ctx->outOfMemory = true;
+        free(next);
+        free(places);
+        free(code);
+        return;
+    }
+
+    //Each section starts after the ones before it, and keeps its own order
+    for(size_t i = 0; i < size; i++) next[ctx->code[i].section]++;
+    size_t start = 0;
+    for(size_t s = 0; s < ctx->sectionSize; s++){
+        size_t count = next[s];
+        next[s] = start;
+        start += count;
+    }
+    for(size_t i = 0; i < size; i++){
+        places[i] = next[ctx->code[i].section]++;
+        code[places[i]] = ctx->code[i];
+    }
+    places[size] = size;
+    moveAnchorPoints(ctx->anchors, places);
+
+    free(ctx->code);
+    ctx->code = code;
+    free(next);
+    free(places);
+}
+
+
+bool placeSections(assembler *ctx, size_t *offsets, bool report){
+    //Where each instruction is in its section. Instructions start on an even
+    //byte, after data of an odd length too.
+    size_t offset = 0;
+    for(size_t i = 0; i < ctx->codeSize; i++){
+        const instruction *ins = &ctx->code[i];
+        if(i > 0 && ins->section != ctx->code[i - 1].section){
+            ctx->sections[ctx->code[i - 1].section].size = offset + (offset & 1);
+            offset = 0;
+        }
+        if(ins->data == NULL) offset += offset & 1;
+        offsets[i] = offset;
+        offset += ins->data ? ins->size : 2;
+    }
+
+    //A program of one section simply starts at the beginning
+    if(ctx->sectionSize == 0){
+        for(size_t i = 0; i < ctx->codeSize; i++) offsets[i] += CHIP8_PROGRAM_START;
+        size_t end = CHIP8_PROGRAM_START + offset + (offset & 1);
+        offsets[ctx->codeSize] = end;
+        if(ctx->stats){
+            ctx->stats->sections = 1;
+            ctx->stats->largestFree = end < MEMORY_END ? MEMORY_END - end : 0;
+        }
+        return true;
+    }
+    if(ctx->codeSize > 0) ctx->sections[ctx->code[ctx->codeSize - 1].section].size = offset + (offset & 1);
+
+    size_t count = ctx->sectionSize;
+    section *sections = ctx->sections;
+    int *order = malloc(count * sizeof(int));
+    freeSpace *spaces = malloc((count + 1) * sizeof(freeSpace));
+    if(order == NULL || spaces == NULL){
+        ctx->outOfMemory = true;
+        free(order);
+        free(spaces);
+        return false;
+    }
+
+    //Sections at a fixed address, in address order, leave gaps between them
+    size_t fixed = 0;
+    for(size_t i = 0; i < count; i++){
+        sections[i].address = sections[i].origin;
+        if(sections[i].origin < 0) continue;
+
+        size_t k = fixed++;
+        while(k > 0 && sections[order[k - 1]].origin > sections[i].origin){
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+
+    bool fits = true;
+    char name[48], other[48];
+    size_t spaceCount = 0;
+    size_t last = CHIP8_PROGRAM_START;
+    int lastSection = -1;
+    for(size_t k = 0; k < fixed; k++){
+        const section *s = &sections[order[k]];
+        size_t end = s->address + s->size;
+        if(s->size == 0) continue;
+
+        ctx->line = s->line;
+        describeSection(ctx, order[k], name, sizeof(name));
+        if(end > MEMORY_END){
+            if(report) error(ctx, "%s ends at 0x%03zX, past the end of memory at 0x%03X", name, end, MEMORY_END);
+            fits = false;
+            continue;
+        }
+        if(lastSection != -1 && (size_t)s->address < last){
+            describeSection(ctx, lastSection, other, sizeof(other));
+            if(report) error(ctx, "%s overlaps %s, which ends at 0x%03zX", name, other, last);
+            fits = false;
+            continue;
+        }
+
+        if((size_t)s->address > last) spaces[spaceCount++] = (freeSpace){last, s->address};
+        last = end;
+        lastSection = order[k];
+    }
+    size_t holes = spaceCount;
+    freeSpace *tail = &spaces[spaceCount++];
+    *tail = (freeSpace){last, MEMORY_END};
+
+    //Named sections, biggest first, go in the smallest gap between fixed
+    //sections that holds them
+    size_t floating = 0;
+    for(size_t i = 0; i < count; i++){
+        if(sections[i].origin >= 0) continue;
+
+        size_t k = floating++;
+        while(k > 0 && sections[order[k - 1]].size < sections[i].size){
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+    for(size_t k = 0; k < floating; k++){
+        section *s = &sections[order[k]];
+        if(s->size == 0) continue;
+
+        size_t best = holes;
+        for(size_t h = 0; h < holes; h++){
+            size_t room = spaces[h].end - spaces[h].start;
+            if(room >= s->size && (best == holes || room < spaces[best].end - spaces[best].start)) best = h;
+        }
+        if(best == holes) continue;
+        s->address = spaces[best].start;
+        spaces[best].start += s->size;
+    }
+
+    //The rest follow the fixed sections in the order they were first used
+    for(size_t i = 0; i < count; i++){
+        section *s = &sections[i];
+        if(s->origin >= 0 || s->address >= 0) continue;
+
+        if(tail->end - tail->start < s->size){
+            size_t largest = 0, total = 0;
+            for(size_t h = 0; h < spaceCount; h++){
+                size_t room = spaces[h].end - spaces[h].start;
+                if(room > largest) largest = room;
+                total += room;
+            }
+
+            ctx->line = s->line;
+            describeSection(ctx, i, name, sizeof(name));
+            if(report) error(ctx, "No room for %s, it needs %zu bytes and the largest free space is %zu of %zu free", name, s->size, largest, total);
+            fits = false;
+            continue;
+        }
+        s->address = tail->start;
+        tail->start += s->size;
+    }
+
+    if(fits){
+        size_t end = CHIP8_PROGRAM_START, used = 0;
+        for(size_t i = 0; i < count; i++){
+            if(sections[i].size == 0) continue;
+            if(sections[i].address + sections[i].size > end) end = sections[i].address + sections[i].size;
+            used += sections[i].size;
+        }
+        for(size_t i = 0; i < ctx->codeSize; i++) offsets[i] += sections[ctx->code[i].section].address;
+        offsets[ctx->codeSize] = end;
+
+        if(ctx->stats){
+            size_t largest = 0;
+            for(size_t h = 0; h < spaceCount; h++){
+                size_t room = spaces[h].end - spaces[h].start;
+                if(room > largest) largest = room;
+            }
+            ctx->stats->sections = count;
+            ctx->stats->gapBytes = end - CHIP8_PROGRAM_START - used;
+            ctx->stats->largestFree = largest;
+        }
+    }
+
+    free(order);
+    free(spaces);
+    return fits;
+}
@@ -0,0 +1,56 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+//Sections: the org and section directives, and the layout stage that places
+//every section in memory like a linker
+
+#ifndef SECTION_H
+#define SECTION_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "assembler.h"
+
+//Start the section an org or section line names. A named section that was
+//used before carries on where it left off.
+void beginSection(assembler *ctx, const lineResult *r);
+
+//Add a section at a fixed address after every other one, for data placed
+//once the whole program has been read. Returns its index, or -1 if out of memory.
+int addFixedSection(assembler *ctx, int origin, int line);
+
+//Close the last section and put the instructions of each section together, so
+//every section is one run of the instruction list, in the order the sections
+//were first used
+void endSections(assembler *ctx);
+
+//Place every section in memory and store the address of each instruction in
+//offsets, and the end of the image in offsets[ctx->codeSize]. Fixed sections
+//go at their address, and named ones are packed into the gaps between them or
+//after them. Returns false if the sections do not fit, after reporting why
+//when report is true.
+bool placeSections(assembler *ctx, size_t *offsets, bool report);
+
+#endif
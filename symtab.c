@@ -0,0 +1,170 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "symtab.h"
+
+//Slot hash value reserved to mark an empty slot
+#define EMPTY_SLOT 0
+
+#define INITIAL_CAPACITY 64
+#define INITIAL_ARENA 1024
+
+
+//FNV-1a over the lowercase form of the name. Never returns EMPTY_SLOT.
+static uint32_t hashName(const char *name, size_t length){
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 16777619u;
+    }
+    return h == EMPTY_SLOT ? 1 : h;
+}
+
+//Case-insensitive compare of a name against an interned (lowercase) one
+static int nameEquals(const char *interned, const char *name, size_t length){
+    for(size_t i = 0; i < length; i++){
+        if(interned[i] != (char)tolower((unsigned char)name[i])) return 0;
+    }
+    return 1;
+}
+
+//Find the slot holding name, or the empty slot where it would be inserted
+static anchorPoint *findSlot(const anchorPointList *a, const char *name, size_t length, uint32_t hash){
+    size_t mask = a->capacity - 1;
+    size_t i = hash & mask;
+
+    while(1){
+        anchorPoint *p = &a->values[i];
+        if(p->hash == EMPTY_SLOT) return p;
+        if(p->hash == hash && p->nameLength == length && nameEquals(a->arena + p->nameOffset, name, length)){
+            return p;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+//Double the slot array and rehash every entry
+static int grow(anchorPointList *a){
+    size_t newCapacity = a->capacity * 2;
+    anchorPoint *newValues = calloc(newCapacity, sizeof(anchorPoint));
+    if(!newValues) return ANCHOR_NOMEM;
+
+    size_t mask = newCapacity - 1;
+    for(size_t i = 0; i < a->capacity; i++){
+        anchorPoint *p = &a->values[i];
+        if(p->hash == EMPTY_SLOT) continue;
+
+        size_t j = p->hash & mask;
+        while(newValues[j].hash != EMPTY_SLOT) j = (j + 1) & mask;
+        newValues[j] = *p;
+    }
+
+    free(a->values);
+    a->values = newValues;
+    a->capacity = newCapacity;
+    return ANCHOR_OK;
+}
+
+//Copy a lowercase, null terminated name into the arena and return its offset
+static int intern(anchorPointList *a, const char *name, size_t length, uint32_t *offset){
+    size_t needed = a->arenaSize + length + 1;
+    if(needed > a->arenaCapacity){
+        size_t newCapacity = a->arenaCapacity;
+        while(newCapacity < needed) newCapacity *= 2;
+
+        char *temp = realloc(a->arena, newCapacity);
+        if(!temp) return ANCHOR_NOMEM;
+        a->arena = temp;
+        a->arenaCapacity = newCapacity;
+    }
+
+    char *dest = a->arena + a->arenaSize;
+    for(size_t i = 0; i < length; i++) dest[i] = tolower((unsigned char)name[i]);
+    dest[length] = '\0';
+
+    *offset = a->arenaSize;
+    a->arenaSize = needed;
+    return ANCHOR_OK;
+}
+
+
+anchorPointList *newAnchorPointList(void){
+    anchorPointList *a = calloc(1, sizeof(anchorPointList));
+    if(!a) return NULL;
+
+    a->capacity = INITIAL_CAPACITY;
+    a->values = calloc(a->capacity, sizeof(anchorPoint));
+    a->arenaCapacity = INITIAL_ARENA;
+    a->arena = malloc(a->arenaCapacity);
+
+    if(!a->values || !a->arena){
+        freeAnchorPointList(a);
+        return NULL;
+    }
+    return a;
+}
+
+void freeAnchorPointList(anchorPointList *a){
+    if(!a) return;
+    free(a->values);
+    free(a->arena);
+    free(a);
+}
+
+int addAnchorPoint(anchorPointList *a, const char *name, size_t length, int place){
+    //Keep the load factor at or below 1/2 so probe sequences stay short
+    if((a->size + 1) * 2 > a->capacity){
+        if(grow(a) != ANCHOR_OK) return ANCHOR_NOMEM;
+    }
+
+    uint32_t hash = hashName(name, length);
+    anchorPoint *p = findSlot(a, name, length, hash);
+    if(p->hash != EMPTY_SLOT) return ANCHOR_DUPLICATE;
+
+    uint32_t offset;
+    if(intern(a, name, length, &offset) != ANCHOR_OK) return ANCHOR_NOMEM;
+
+    p->hash = hash;
+    p->nameOffset = offset;
+    p->nameLength = length;
+    p->place = place;
+    a->size++;
+    return ANCHOR_OK;
+}
+
+int getPCFromAnchorpoint(const char *name, size_t length, const anchorPointList *a){
+    anchorPoint *p = findSlot(a, name, length, hashName(name, length));
+    if(p->hash == EMPTY_SLOT) return -1;
+    return p->place;
+}
+
+void moveAnchorPoints(anchorPointList *a, const int *places){
+    for(size_t i = 0; i < a->capacity; i++){
+        anchorPoint *p = &a->values[i];
+        if(p->hash != EMPTY_SLOT) p->place = places[p->place];
+    }
+}
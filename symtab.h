@@ -0,0 +1,77 @@
+// MIT License
+
+// Copyright (c) 2021 Luke LaBonte
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Result codes returned by addAnchorPoint
+#define ANCHOR_OK 0
+#define ANCHOR_NOMEM 1
+#define ANCHOR_DUPLICATE 2
+
+//A single slot in the open-addressed anchorpoint table.
+//Names are interned in the table's arena and referenced by offset,
+//so growing the arena never invalidates a slot.
+typedef struct{
+    uint32_t hash;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    int place;
+} anchorPoint;
+
+typedef struct{
+    size_t size;
+    size_t capacity;
+    anchorPoint *values;
+
+    char *arena;
+    size_t arenaSize;
+    size_t arenaCapacity;
+} anchorPointList;
+
+//Create an empty anchorpoint table, or NULL if out of memory
+anchorPointList *newAnchorPointList(void);
+
+//Release a table created with newAnchorPointList
+void freeAnchorPointList(anchorPointList *a);
+
+//Add an anchorpoint. Names are case-insensitive and stored lowercase.
+//Returns ANCHOR_DUPLICATE if the name is already defined.
+int addAnchorPoint(anchorPointList *a, const char *name, size_t length, int place);
+
+//Get the numerical value of an anchorpoint, or -1 if it is not defined
+int getPCFromAnchorpoint(const char *name, size_t length, const anchorPointList *a);
+
+//Move every anchor point from place p to places[p], for passes that reorder or
+//remove instructions. places must cover every place in the table.
+void moveAnchorPoints(anchorPointList *a, const int *places);
+
+//Get the lowercase name stored for a table slot
+static inline const char *anchorPointName(const anchorPointList *a, const anchorPoint *p){
+    return a->arena + p->nameOffset;
+}
+
+#endif
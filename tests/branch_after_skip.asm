@@ -0,0 +1,12 @@
+; The se lands on the jp of the branch when v0 is 1, so the jp to the same
+; place after the branch can not stand in for it.
+; expect: v2=00
+ld v0, 1
+ld v1, 5
+se v0, 1
+jeq v1, 2, done
+jp done
+ld v2, 7
+.done
+.halt
+jp halt
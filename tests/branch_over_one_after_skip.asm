@@ -0,0 +1,11 @@
+; The se lands on the jp of the branch when v0 is 1, so the branch can not
+; become the opposite skip over ld v2, 7.
+; expect: v2=00
+ld v0, 1
+ld v1, 5
+se v0, 1
+jeq v1, 2, done
+ld v2, 7
+.done
+.halt
+jp halt
@@ -0,0 +1,5 @@
+; Only the instructions of a little-endian image are swapped, so the data
+; after them is written as it is.
+.halt
+jp halt
+db 1, 2, 3
@@ -0,0 +1,15 @@
+; The jp at l3 is reached from the skip before it and from the jp l3 below,
+; so it can not be pointed somewhere else to turn the skip around. v5 must
+; stay 0 and v7 must end at 2.
+ld v6, 0
+se v6, 2
+.l3
+jp l4
+ld v5, 1
+jp halt
+.l4
+add v7, 1
+se v7, 2
+jp l3
+.halt
+jp halt
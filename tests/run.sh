@@ -0,0 +1,100 @@
+#!/bin/sh
+# MIT License
+
+# Copyright (c) 2021 Luke LaBonte
+
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+
+
+#Regression tests. Builds the assembler and runs each check on the programs in
+#this folder. Run from anywhere: sh tests/run.sh
+
+cd "$(dirname "$0")/.." || exit 1
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+
+gcc -O2 -o "$out/asm" asm.c chip8asm.c symtab.c opcodes.c lexer.c batch.c cache.c optimize.c cfg.c analyze.c emulator.c directive.c expr.c macro.c disasm.c debuginfo.c section.c regalloc.c profile.c outline.c pack.c -lpthread || exit 1
+failed=0
+
+#Helper function to report a failed check
+fail(){
+    echo "FAIL $1"
+    echo "$2"
+    failed=$((failed + 1))
+}
+
+#A register allocation error for a long virtual register name keeps the text after the name
+message=$("$out/asm" tests/regalloc_long_name.asm -o "$out/rom" 2>&1)
+case "$message" in
+    *"keeping it in memory needs v0 and one more free"*) ;;
+    *) fail regalloc_long_name "$message" ;;
+esac
+
+#So does any other message with a long name in it
+message=$("$out/asm" tests/long_anchor_name.asm -o "$out/rom" 2>&1)
+case "$message" in
+    *"is already defined"*) ;;
+    *) fail long_anchor_name "$message" ;;
+esac
+
+#A little-endian image swaps the instructions but not the data
+"$out/asm" tests/little_endian_data.asm -o "$out/rom" --little-endian
+bytes=$(od -An -tx1 -N5 "$out/rom" | tr -d ' \n')
+[ "$bytes" = "0012010203" ] || fail little_endian_data "image starts with $bytes"
+
+#An image of an odd length can not be written as source, so it is rejected
+printf '\000\340\001' > "$out/odd.ch8"
+if "$out/asm" --verify "$out/odd.ch8" > /dev/null 2>&1; then fail odd_image "--verify accepted an odd image"; fi
+message=$("$out/asm" --disassemble "$out/odd.ch8" 2>&1)
+case "$message" in
+    *"odd number of bytes"*) ;;
+    *) fail odd_image "$message" ;;
+esac
+
+#Profile layout does not change what a program does
+for test in tests/profile_*.asm; do
+    name=$(basename "$test" .asm)
+    before=$("$out/asm" "$test" -o "$out/rom" --run --cycles 1000 --profile-out "$out/profile" 2>&1 | grep 'v0=')
+    after=$("$out/asm" "$test" -o "$out/rom" --profile "$out/profile" --run --cycles 1000 2>&1 | grep 'v0=')
+    if [ -z "$before" ] || [ "$before" != "$after" ]; then
+        fail "$name" "without --profile: $before
+with --profile:    $after"
+    fi
+done
+
+#Programs with expect lines end with those register values, with and without -O
+for test in $(grep -l '^; expect:' tests/*.asm); do
+    name=$(basename "$test" .asm)
+    for flags in "" -O; do
+        state=$("$out/asm" "$test" -o "$out/rom" $flags --run --cycles 1000 2>&1 | grep 'v0=')
+        for value in $(sed -n 's/^; expect://p' "$test"); do
+            case " $state " in
+                *" $value "*) ;;
+                *) fail "$name $flags" "expected $value: $state" ;;
+            esac
+        done
+    done
+done
+
+if [ "$failed" -ne 0 ]; then
+    echo "$failed tests failed"
+    exit 1
+fi
+echo "All tests passed"